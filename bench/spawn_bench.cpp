@@ -0,0 +1,132 @@
+#include "CommandExecutor.h"
+#include "Spawner.h"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/**
+ * Command launch microbenchmark
+ * Times starting /usr/bin/true and reaping it four ways: the fork()/execl() of
+ * /bin/sh that CommandExecutor used to do, CommandExecutor::spawn forced
+ * through the shell, CommandExecutor::spawn exec'ing it directly, and the
+ * same through the Spawner, while the process holds a growing amount of
+ * touched memory. fork() copies page tables for all of it; posix_spawn does
+ * not, the direct path also saves the shell's exec, and the Spawner forks
+ * from its own image, started before the memory was touched.
+ * Usage: ./spawn_bench [launches] [ballast MB ...]
+ */
+
+namespace {
+
+// The launch path CommandExecutor used before posix_spawn
+pid_t forkCommand(const char* command, int& output_fd) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        throw std::runtime_error(std::string("pipe2 failed: ") + strerror(errno));
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw std::runtime_error(std::string("fork failed: ") + strerror(errno));
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        signal(SIGPIPE, SIG_DFL);
+        close(pipefd[0]);
+        dup2(pipefd[1], STDOUT_FILENO);
+        dup2(pipefd[1], STDERR_FILENO);
+        close(pipefd[1]);
+        execl("/bin/sh", "sh", "-c", command, nullptr);
+        _exit(127);
+    }
+    close(pipefd[1]);
+    setpgid(pid, pid);
+    output_fd = pipefd[0];
+    return pid;
+}
+
+void drain(int fd) {
+    char buffer[4096];
+    while (read(fd, buffer, sizeof(buffer)) > 0) {
+    }
+    close(fd);
+}
+
+// Mean microseconds per launch of launch()
+template <typename Launch>
+double measure(int launches, Launch launch) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < launches; i++) {
+        launch();
+    }
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / launches;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    int launches = argc > 1 ? std::atoi(argv[1]) : 200;
+    std::vector<size_t> ballast_mb;
+    for (int i = 2; i < argc; i++) {
+        ballast_mb.push_back(static_cast<size_t>(std::atoll(argv[i])));
+    }
+    if (launches <= 0) {
+        std::cerr << "Usage: " << argv[0] << " [launches] [ballast MB ...]" << std::endl;
+        return 1;
+    }
+    if (ballast_mb.empty()) {
+        ballast_mb = {0, 256, 1024};
+    }
+    signal(SIGPIPE, SIG_IGN);  // As in the server
+    if (!Spawner::start()) {
+        return 1;
+    }
+
+    std::cout << std::setw(12) << "ballast MB" << std::setw(16) << "fork+sh us" << std::setw(16) << "spawn+sh us"
+              << std::setw(16) << "spawn us" << std::setw(16) << "spawner us" << std::endl;
+    std::vector<char> ballast;
+    for (size_t mb : ballast_mb) {
+        // Touched, so every page is mapped and fork has to copy its page table entry
+        ballast.assign(mb * 1024 * 1024, 1);
+
+        double forked = measure(launches, []() {
+            int fd = -1;
+            pid_t pid = forkCommand("exec true", fd);
+            drain(fd);
+            int status;
+            waitpid(pid, &status, 0);
+        });
+        // `exec` is a shell builtin, so this one still goes through /bin/sh (which has its own
+        // `true`; exec makes it run the same binary as the direct path)
+        Spawner::setEnabled(false);
+        double shelled = measure(launches, []() {
+            CommandExecutor::Process process = CommandExecutor::spawn("exec true");
+            drain(process.output_fd);
+            CommandExecutor::wait(process);
+        });
+        CommandExecutor::PathCache paths;
+        double spawned = measure(launches, [&paths]() {
+            CommandExecutor::Process process = CommandExecutor::spawn("true", -1, &paths);
+            drain(process.output_fd);
+            CommandExecutor::wait(process);
+        });
+        Spawner::setEnabled(true);
+        double zygote = measure(launches, [&paths]() {
+            CommandExecutor::Process process = CommandExecutor::spawn("true", -1, &paths);
+            drain(process.output_fd);
+            CommandExecutor::wait(process);
+        });
+        std::cout << std::setw(12) << mb << std::setw(16) << std::fixed << std::setprecision(1) << forked
+                  << std::setw(16) << shelled << std::setw(16) << spawned << std::setw(16) << zygote << std::endl;
+    }
+    return 0;
+}
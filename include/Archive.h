@@ -0,0 +1,137 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+
+/**
+ * In-process tar (POSIX ustar) writer for ARCHIVE requests
+ * The tree is walked with openat() and getdents64() relative to one
+ * directory fd per level, so no path is resolved twice and nothing goes
+ * through a shell. Headers are built here; file bodies are left to the
+ * caller, which can send them straight from the page cache, or to
+ * GzipPipeline when the stream is compressed.
+ */
+namespace Archive {
+
+constexpr size_t BLOCK_SIZE = 512;
+constexpr size_t PIPELINE_CHUNK = 1024 * 1024;  // Tar bytes handed from the reader to the compressor at once
+constexpr size_t PIPELINE_DEPTH = 4;            // Chunks each pipeline queue holds before its producer waits
+
+enum class Type : char {
+    File = '0',
+    Symlink = '2',
+    Directory = '5'
+};
+
+struct Entry {
+    std::string name;              // Path inside the archive; directories end in '/'
+    Type type;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    uint64_t size;                 // Bytes of file data (0 unless File)
+    time_t mtime;
+    std::string link;              // Symlink target
+    int fd;                        // File: open for reading, the caller closes it. Otherwise -1
+};
+
+/**
+ * Depth-first walk of a directory tree, the directory itself first. Entries
+ * that vanish or cannot be opened are skipped, as are sockets, FIFOs and
+ * devices; symlinks are stored, never followed.
+ */
+class Walker {
+private:
+    struct Level {
+        int fd;
+        std::string prefix;        // Archive name of the directory, with trailing '/'
+        std::vector<char> buffer;  // getdents64() records
+        size_t position;
+        size_t length;
+    };
+    std::vector<Level> stack_;
+    Entry root_;                   // The top directory, reported first
+    bool root_pending_;
+
+    void descend(int fd, const std::string& prefix);  // Push a directory to read next
+
+public:
+    // Walk path (relative to dir_fd); throws std::runtime_error if it is not a readable directory
+    Walker(int dir_fd, const std::string& path);
+    ~Walker();
+    Walker(const Walker&) = delete;
+    Walker& operator=(const Walker&) = delete;
+
+    bool next(Entry& entry);       // Next entry; false once the tree is done
+};
+
+// Header block(s) for entry, preceded by a GNU long-name record when the name or link
+// target does not fit ustar's fields
+std::string header(const Entry& entry);
+
+// Zero bytes that follow size bytes of file data
+size_t padding(uint64_t size);
+
+// Two zero blocks that end the archive
+std::string trailer();
+
+// Append length bytes of fd from offset to out, zero-filled past the end of a file that shrank
+// since it was stat'ed (the header already promised the old size); false on a read error
+bool readPadded(int fd, uint64_t offset, size_t length, std::string& out);
+
+/**
+ * Compressed archive stream: one thread walks the tree and reads the files,
+ * a second gzips what it read, and the caller sends the result, so disk
+ * reads, compression and the network all overlap. Queues between the stages
+ * are bounded, so a slow client holds back the readers instead of memory
+ * piling up. Dedicated threads rather than the session pool, because the
+ * stages block on each other.
+ */
+class GzipPipeline {
+private:
+    std::unique_ptr<Walker> walker_;
+    int level_;
+    std::function<void()> notify_;  // Called from the stages whenever take() or finished() may change
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<std::string> raw_;     // Tar stream, read but not yet compressed
+    std::deque<std::string> packed_;  // Compressed, waiting for take()
+    bool read_ = false;               // The reader has queued the whole stream
+    bool compressed_ = false;         // The compressor has queued the gzip trailer
+    bool stopped_ = false;            // Cancelled, or a stage failed
+    std::string error_;
+    std::thread reader_;
+    std::thread compressor_;
+
+    bool push(std::deque<std::string>& queue, std::string& chunk);
+    void fail(const std::string& error);
+    void read();
+    void compress();
+
+public:
+    // Start both stages; notify runs on their threads
+    GzipPipeline(std::unique_ptr<Walker> walker, int level, std::function<void()> notify);
+    ~GzipPipeline();               // Stops the stages and waits for them
+    GzipPipeline(const GzipPipeline&) = delete;
+    GzipPipeline& operator=(const GzipPipeline&) = delete;
+
+    bool take(std::string& chunk); // Next compressed chunk; false if none is ready yet
+    bool finished();               // Nothing more will come: complete, failed or stopped
+    void stop();
+    std::string error();           // Why the stream failed (empty if it did not)
+};
+
+} // namespace Archive
+
+#endif // ARCHIVE_H
@@ -0,0 +1,331 @@
+#ifndef ASYNCSOCKET_H
+#define ASYNCSOCKET_H
+
+#include "Socket.h"
+#include "EventLoop.h"
+#include <coroutine>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/types.h>
+
+/**
+ * Connected socket registered with an EventLoop, exposing awaitable I/O
+ * Incoming bytes are buffered as they arrive; a coroutine awaiting
+ * async_recv() is stored in a single slot and scheduled on the loop when it
+ * can make progress. Sends from any number of coroutines are queued and go
+ * out whole, one after another in await order, so frames never interleave.
+ * Awaiters live in the coroutine frame, so an operation never allocates.
+ * Only one reader may be waiting at a time. Once MAX_BUFFERED_INPUT bytes
+ * wait for a reader, receiving pauses until one takes them, so a peer that
+ * sends faster than it is served fills its own socket buffers instead.
+ */
+class AsyncSocket {
+public:
+    static constexpr size_t MAX_BUFFERED_INPUT = 1024 * 1024;  // Received bytes held before reads pause
+
+    class RecvAwaiter {
+    private:
+        AsyncSocket& socket_;
+        std::string& buffer_;
+
+    public:
+        RecvAwaiter(AsyncSocket& socket, std::string& buffer) : socket_(socket), buffer_(buffer) {}
+        bool await_ready() const;
+        void await_suspend(std::coroutine_handle<> handle);
+        ssize_t await_resume();
+    };
+
+    class SendAwaiter {
+    private:
+        friend class AsyncSocket;
+
+        AsyncSocket& socket_;
+        std::string_view data_;
+        int splice_fd_;
+        off_t splice_offset_;          // File position for sendfile, -1 to splice from a pipe
+        size_t splice_length_;
+        bool started_;
+        std::coroutine_handle<> handle_;
+
+    public:
+        SendAwaiter(AsyncSocket& socket, std::string_view data, int splice_fd, off_t splice_offset, size_t splice_length)
+            : socket_(socket), data_(data), splice_fd_(splice_fd), splice_offset_(splice_offset),
+              splice_length_(splice_length), started_(false) {}
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> handle);
+        bool await_resume() const;
+    };
+
+private:
+    EventLoop& loop_;
+    Socket socket_;
+    std::string input_;                // Received, not yet handed to a reader
+    std::string output_;               // Queued, not yet accepted by the kernel
+    int splice_fd_;                    // Pipe or file to move from once output_ is sent
+    off_t splice_offset_;              // Next file position for sendfile, -1 for a pipe
+    size_t splice_left_;               // Bytes still to move from splice_fd_
+    bool closed_;                      // EOF or error seen
+    bool read_paused_;                 // input_ is full, the loop has stopped receiving
+    int error_;                        // errno of the failure, 0 for a clean EOF
+    std::coroutine_handle<> reader_;
+    SendAwaiter* writer_;              // Send whose data is in output_ / being spliced
+    std::deque<SendAwaiter*> queued_;  // Sends waiting for their turn
+
+    // Event loop callbacks
+    void onData(const char* data, ssize_t length);
+    void onWritable();
+
+    // Send as much queued output as the socket accepts
+    void flush();
+
+    // Data of the current send still on its way to the kernel
+    bool sending() const;
+
+    // Hand a send's data to the kernel
+    void begin(SendAwaiter& send);
+
+    // Start queued sends until one has to wait for writability
+    void startQueued();
+
+    // Read the rest of a splice into output_ when the kernel cannot splice / sendfile to this socket
+    bool copySplice();
+
+    // Mark the socket dead and wake everyone waiting on it
+    void fail(int error);
+
+public:
+    // Takes ownership of a connected socket and registers it with the loop
+    AsyncSocket(EventLoop& loop, Socket socket);
+
+    // Unregisters from the loop and closes the socket
+    ~AsyncSocket();
+
+    AsyncSocket(const AsyncSocket&) = delete;
+    AsyncSocket& operator=(const AsyncSocket&) = delete;
+
+    int fd() const;
+
+    // False once the peer is gone (EOF or error)
+    bool isOpen() const;
+
+    // co_await: append available bytes to buffer; returns the count, 0 on EOF, -errno on error
+    RecvAwaiter async_recv(std::string& buffer);
+
+    // co_await: send data once earlier sends are done and wait until the kernel has all of it;
+    // data must stay valid until then. false if the peer is gone
+    SendAwaiter async_send(std::string_view data);
+
+    // co_await: send header, then move length bytes from pipe_fd to the socket inside the
+    // kernel (splice), copying only if the socket cannot take spliced pages.
+    // pipe_fd must already hold length bytes (see AsyncPipe::async_wait); false if the peer is gone
+    SendAwaiter async_splice(std::string_view header, int pipe_fd, size_t length);
+
+    // co_await: send header, then length bytes of file_fd starting at offset, straight from the
+    // page cache (sendfile). The file must hold them; false if the peer is gone
+    SendAwaiter async_sendfile(std::string_view header, int file_fd, off_t offset, size_t length);
+};
+
+/**
+ * Listening sockets registered with an EventLoop, exposing awaitable accept
+ * Connections accepted while nobody awaits are queued.
+ */
+class AsyncAcceptor {
+private:
+    EventLoop& loop_;
+    std::vector<Socket> listeners_;
+    std::deque<int> pending_;          // Accepted, not yet handed out
+    bool closed_;
+    std::coroutine_handle<> waiter_;
+
+    void onAccept(int fd);
+
+public:
+    class AcceptAwaiter {
+    private:
+        AsyncAcceptor& acceptor_;
+
+    public:
+        explicit AcceptAwaiter(AsyncAcceptor& acceptor) : acceptor_(acceptor) {}
+        bool await_ready() const;
+        void await_suspend(std::coroutine_handle<> handle);
+        Socket await_resume();
+    };
+
+    explicit AsyncAcceptor(EventLoop& loop);
+    ~AsyncAcceptor();
+
+    AsyncAcceptor(const AsyncAcceptor&) = delete;
+    AsyncAcceptor& operator=(const AsyncAcceptor&) = delete;
+
+    // Start accepting on a bound, listening socket
+    // exclusive asks for one wakeup per connection across processes sharing it
+    void listen(Socket listener, bool exclusive);
+
+    // co_await: next client socket, or an invalid Socket once closed
+    AcceptAwaiter async_accept();
+
+    // Unregister and close every listener; clients already accepted are still returned,
+    // then async_accept() yields an invalid Socket
+    void close();
+
+    // Close the listeners without touching the loop (forked child of the loop's owner)
+    void abandon();
+
+    bool isOpen() const;
+};
+
+/**
+ * Read end of a pipe (e.g. a child's output) with awaitable read / wait
+ * The pipe is only watched while a reader is suspended on it, so a reader
+ * busy elsewhere (sending the previous chunk) never gets level-triggered
+ * wakeups, and the kernel pipe buffer provides the backpressure.
+ */
+class AsyncPipe {
+public:
+    class ReadAwaiter {
+    private:
+        friend class AsyncPipe;
+
+        AsyncPipe& pipe_;
+        std::string* buffer_;          // Null: only wait for data
+        size_t max_;
+        ssize_t result_;
+        std::coroutine_handle<> handle_;
+
+    public:
+        ReadAwaiter(AsyncPipe& pipe, std::string* buffer, size_t max)
+            : pipe_(pipe), buffer_(buffer), max_(max), result_(0) {}
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> handle);
+        ssize_t await_resume() const;
+    };
+
+private:
+    EventLoop& loop_;
+    int fd_;
+    ReadAwaiter* reader_;              // Suspended read, registered with the loop while set
+
+    // Append up to max bytes to buffer; returns the count, 0 on EOF, -errno (-EAGAIN if empty)
+    ssize_t readInto(std::string& buffer, size_t max);
+
+    // Bytes buffered in the pipe; 0 on EOF, -EAGAIN if empty but still open
+    ssize_t available();
+
+    // Perform the awaited operation without blocking
+    ssize_t attempt(ReadAwaiter& reader);
+
+    // Event loop callback
+    void onReadable();
+
+public:
+    // Takes ownership of fd and makes it non-blocking
+    AsyncPipe(EventLoop& loop, int fd);
+
+    // Unregisters from the loop and closes the pipe
+    ~AsyncPipe();
+
+    AsyncPipe(const AsyncPipe&) = delete;
+    AsyncPipe& operator=(const AsyncPipe&) = delete;
+
+    int fd() const;
+
+    // co_await: append up to max bytes to buffer; returns the count, 0 on EOF, -errno on error
+    ReadAwaiter async_read(std::string& buffer, size_t max);
+
+    // co_await: wait for data without consuming it; returns the bytes buffered, 0 on EOF, -errno on error
+    ReadAwaiter async_wait();
+};
+
+/**
+ * Write end of a pipe (e.g. a shell's stdin) written from the loop
+ * What the pipe cannot take at once stays with the suspended writer while the
+ * loop waits for room, so a reader that stops reading never blocks the loop.
+ */
+class AsyncPipeWriter {
+public:
+    class WriteAwaiter {
+    private:
+        friend class AsyncPipeWriter;
+
+        AsyncPipeWriter& pipe_;
+        std::string_view data_;        // Not yet written
+        bool result_;
+        std::coroutine_handle<> handle_;
+
+    public:
+        WriteAwaiter(AsyncPipeWriter& pipe, std::string_view data)
+            : pipe_(pipe), data_(data), result_(false) {}
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> handle);
+        bool await_resume() const;
+    };
+
+private:
+    EventLoop& loop_;
+    int fd_;
+    WriteAwaiter* writer_;             // Suspended write, registered with the loop while set
+
+    // Write what the pipe takes; true once the data is all written or the pipe failed
+    bool attempt(WriteAwaiter& writer);
+
+    // Event loop callback
+    void onWritable();
+
+public:
+    // Writes fd, which must be non-blocking, without owning it
+    AsyncPipeWriter(EventLoop& loop, int fd);
+
+    // Unregisters from the loop if still waiting
+    ~AsyncPipeWriter();
+
+    AsyncPipeWriter(const AsyncPipeWriter&) = delete;
+    AsyncPipeWriter& operator=(const AsyncPipeWriter&) = delete;
+
+    // co_await: write all of data; false if the reader is gone
+    WriteAwaiter async_write(std::string_view data);
+};
+
+/**
+ * Exit of a started program, seen as its exit fd (a pidfd, or the Spawner's
+ * reply socket) turning readable. A session waits for it on the loop, and
+ * CommandExecutor::wait() then reaps without blocking; no thread sits in
+ * waitpid() and no SIGCHLD handler is involved.
+ */
+class AsyncExit {
+public:
+    class ExitAwaiter {
+    private:
+        AsyncExit& exit_;
+
+    public:
+        explicit ExitAwaiter(AsyncExit& exit) : exit_(exit) {}
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> handle);
+        void await_resume() const {}
+    };
+
+private:
+    EventLoop& loop_;
+    int fd_;
+    std::coroutine_handle<> waiter_;   // Suspended until the fd is readable, registered with the loop while set
+
+    // Event loop callback
+    void onReadable();
+
+public:
+    // Watches fd without owning it
+    AsyncExit(EventLoop& loop, int fd);
+
+    // Unregisters from the loop if still waiting
+    ~AsyncExit();
+
+    AsyncExit(const AsyncExit&) = delete;
+    AsyncExit& operator=(const AsyncExit&) = delete;
+
+    // co_await: until the program has exited
+    ExitAwaiter async_wait();
+};
+
+#endif // ASYNCSOCKET_H
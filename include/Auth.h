@@ -1,35 +1,70 @@
 #ifndef AUTH_H
 #define AUTH_H
 
+#include "SessionStore.h"
 #include <string>
 #include <map>
+#include <unordered_map>
 #include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
 
 /**
  * Authentication module for user authentication and session management
- * Uses SHA-256 hashing with salt for password storage
+ * Passwords are stored as salted PBKDF2-HMAC-SHA256; older salted SHA-256
+ * entries still verify and are rewritten with the KDF on their next login.
+ * The KDF is deliberately slow, so callers run authenticate() off their
+ * event loop, and a short-lived cache of recent successful logins keeps
+ * bursts of repeated logins from paying for it again.
+ * Sessions live in a SessionStore next to the users file, shared by every
+ * server process and kept across restarts
  */
 class Auth {
 public:
-    struct Session {
-        std::string username;
-        std::string token;
-        std::chrono::system_clock::time_point created_at;
-        std::chrono::system_clock::time_point last_activity;
-        bool is_valid;
-    };
+    using Session = SessionStore::Session;
+
+    static constexpr int DEFAULT_KDF_ITERATIONS = 100000;
+    static constexpr int MIN_KDF_ITERATIONS = 1000;
+    static constexpr int DEFAULT_CACHE_SECONDS = 60;
+    static constexpr size_t MAX_CACHED_LOGINS = 1024;
 
 private:
     std::string users_file_;
     std::map<std::string, std::string> users_;  // username -> password_hash
-    std::map<std::string, Session> sessions_;   // token -> session
     int session_timeout_minutes_;
+    mutable std::mutex mutex_;                  // Guards users_ (shared by shard threads)
+    mutable std::once_flag sessions_opened_;
+    mutable std::unique_ptr<SessionStore> sessions_;  // token -> session, mapped on first use
+    int kdf_iterations_;                        // PBKDF2 cost for new and upgraded hashes
+    std::chrono::seconds cache_lifetime_;       // How long a verified login is remembered (0 = never)
+    unsigned char cache_key_[32];               // Per-process HMAC key; cache entries never hold a password
+    std::mutex cache_mutex_;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> verified_;  // HMAC -> expiry
+
+    // The session table, mapping it on first use
+    SessionStore& sessions() const;
 
     // Load users from file
     void loadUsers();
 
-    // Hash password with salt using SHA-256
-    static std::string hashPassword(const std::string& password, const std::string& salt);
+    // Read-modify-write of the users file under flock(): update gets the entries on disk now
+    // (not users_, which another process may have outdated) and returns false to leave the
+    // file alone. The new file is written aside with mkstemp(), fsynced and renamed over the
+    // old one. false if the file could not be locked or written
+    bool rewriteUsers(const std::function<bool(std::map<std::string, std::string>&)>& update);
+
+    // Stored form of password: "pbkdf2-sha256$iterations$salt$hash" with a fresh salt
+    std::string hashPassword(const std::string& password) const;
+
+    // Check password against a stored entry (PBKDF2, or legacy "salt:hash" SHA-256).
+    // iterations is set to the entry's PBKDF2 cost, 0 for a legacy entry
+    static bool verifyPassword(const std::string& password, const std::string& stored, int& iterations);
+
+    // Cache key of a login: HMAC over the user, their stored entry and the password
+    std::string cacheKey(const std::string& username, const std::string& stored, const std::string& password) const;
+    bool recentlyVerified(const std::string& key);
+    void rememberVerified(const std::string& key);
 
     // Generate random salt
     static std::string generateSalt();
@@ -45,8 +80,16 @@ public:
     explicit Auth(const std::string& users_file = "data/users.txt", 
                   int timeout_minutes = 30);
 
+    // PBKDF2 iterations for hashes written from now on; existing hashes with another cost
+    // are rewritten on their next login
+    void setKdfIterations(int iterations);
+
+    // Remember successful logins for this long (0 disables the cache)
+    void setCacheLifetime(std::chrono::seconds lifetime);
+
     // Authenticate user with username and password
-    // Returns session token if successful, empty string if failed
+    // Returns session token if successful, empty string if failed.
+    // Runs the KDF unless the same login succeeded recently: call it off the event loop
     std::string authenticate(const std::string& username, const std::string& password);
 
     // Validate a session token
@@ -62,6 +105,10 @@ public:
     // Update session activity timestamp (for keeping session alive)
     void updateActivity(const std::string& token);
 
+    // Remember the session's working directory, or get it back ("" if never set)
+    void setWorkingDirectory(const std::string& token, const std::string& dir);
+    std::string getWorkingDirectory(const std::string& token);
+
     // Clean up expired sessions
     void cleanupExpiredSessions();
 
@@ -71,7 +118,7 @@ public:
     // Save users to file
     void saveUsers();
 
-    // Get session count
+    // Get session count (across all server processes)
     size_t getActiveSessionCount() const;
 };
 
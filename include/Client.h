@@ -2,6 +2,12 @@
 #define CLIENT_H
 
 #include "Socket.h"
+#include "Protocol.h"
+#include "FileTransfer.h"
+#include "Delta.h"
+#include <cstdint>
+#include <functional>
+#include <istream>
 #include <string>
 
 /**
@@ -14,9 +20,14 @@ private:
     std::string server_host_;
     int server_port_;
     bool connected_;
-    std::string auth_token_;       // Session token after authentication
+    std::string auth_token_;       // Session token after authentication; presented again on reconnect
     std::string username_;         // Username for authentication
     std::string password_;         // Password for authentication
+    Protocol::FrameParser parser_; // Received bytes not yet returned as frames
+    uint32_t next_request_id_;     // Tags each command so its response can be matched
+    bool quiet_;                   // No connect / disconnect messages (extra transfer streams)
+    size_t streams_;               // Connections a large get / put is split across
+    uint64_t range_size_;          // Bytes each of them moves per request
     
 public:
     
@@ -26,16 +37,80 @@ public:
     
     void disconnect();    // Disconnect from server
     
+    // Connect again after the connection broke, resuming the session (and its working directory)
+    // by token; falls back to the password if the server no longer knows the token
+    bool reconnect();
+    
     std::string sendCommand(const std::string& command);    // Send a command to server and receive response
     
+    // Send a command and pass each output chunk to on_output as it arrives; returns the exit code
+    int streamCommand(const std::string& command, const std::function<void(const std::string&)>& on_output);
+    
+    // Copy a remote file to local (resume: keep what local holds and fetch the rest), then
+    // check the SHA-256 of the whole file; false with the reason in error on failure
+    bool download(const std::string& remote, const std::string& local, bool resume, std::string& error);
+    
+    // Copy a local file to remote (resume: the server keeps what remote holds), then check
+    // the SHA-256 of the whole file; false with the reason in error on failure
+    bool upload(const std::string& local, const std::string& remote, bool resume, std::string& error);
+    
+    // Bring remote up to date with local, sending only what differs from the server's copy;
+    // the server swaps the new file in with a rename. A directory is synced file by file.
+    // Adds to stats; false with the reason in error on failure
+    bool sync(const std::string& local, const std::string& remote, Delta::Stats& stats, std::string& error);
+    
+    // Save the remote directory tree as a tar archive (gzip: compressed by the server) in local;
+    // false with the reason in error, and local removed, on failure
+    bool archive(const std::string& remote, const std::string& local, bool gzip, std::string& error);
+    
     void runInteractiveShell();    // Run interactive shell
     
+    // Pipeline commands read from input (one per line) without waiting for each response;
+    // outputs are printed in input order. With jobs > 0, up to that many run concurrently
+    // on their own channels. Returns the number of commands that failed
+    int runBatch(std::istream& input, size_t jobs = 0);
+    
     bool isConnected() const;      // Check if connected
     
     void setCredentials(const std::string& username, const std::string& password);  // Set authentication credentials
     
+    // Split get / put of files larger than range_size over up to streams connections
+    void setParallelism(size_t streams, uint64_t range_size);
+    
 private:
     bool performAuthentication();  // Perform authentication handshake
+    
+    void sendAll(const std::string& data);     // Send a whole buffer (handles partial sends)
+    
+    void sendFileRange(int fd, uint64_t offset, uint64_t length);  // Send file bytes with sendfile()
+    
+    // Frames of one GET or PUT until its EXIT. A GET writes DATA into fd from offset on, up to
+    // end (UINT64_MAX: the size FILE reports), adding it to hash; a PUT sends fd from where FILE
+    // says up to end, then hashes offset .. end. Returns the server's DIGEST, or "" with the
+    // reason in error; reported is the FILE payload
+    std::string finishTransfer(bool get, uint32_t request_id, int fd, uint64_t offset, uint64_t end,
+                               FileTransfer::Sha256& hash, uint64_t& reported, std::string& error);
+    
+    // Move bytes offset .. offset + length of a size-byte file as one FLAG_CHUNK request and
+    // check them against their own digest
+    bool transferRange(bool get, int fd, const std::string& remote, uint64_t offset, uint64_t length,
+                       uint64_t size, std::string& error);
+    
+    // Move all of fd in ranges over streams_ connections (this one and fresh ones)
+    bool transferParallel(bool get, int fd, const std::string& remote, uint64_t size, std::string& error);
+    
+    // The shell's connection broke: reconnect once (resuming the session); false if that failed
+    bool resumeShell();
+    
+    // get / put / sync / archive typed at the shell prompt
+    void runTransfer(const std::string& input);
+    
+    // SYNC of one regular file
+    bool syncFile(const std::string& local, const std::string& remote, Delta::Stats& stats, std::string& error);
+    
+    bool readFrame(Protocol::Frame& frame);    // Next frame from the server; false if it closed the connection
+    
+    bool nextFrame(Protocol::Frame& frame);    // Next already-received frame, decompressed; false if none
 };
 
 #endif // CLIENT_H
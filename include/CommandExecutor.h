@@ -2,7 +2,9 @@
 #define COMMANDEXECUTOR_H
 
 #include <string>
+#include <unordered_map>
 #include <vector>
+#include <sys/types.h>
 
 class CommandExecutor {
 public:
@@ -10,14 +12,84 @@ public:
         std::string output;
         int exit_code;
         bool success;
+        long long user_us = 0;     // CPU time of the command and the descendants it reaped (wait4)
+        long long system_us = 0;
+        long max_rss_kb = 0;       // Largest resident set among them
+    };
+    
+    /**
+     * Executables found on PATH, remembered per session. An entry is used
+     * again only while PATH is unchanged and the file still has the same
+     * device and inode, so replacing a binary or editing PATH re-resolves it.
+     */
+    class PathCache {
+    private:
+        struct Entry {
+            std::string file;
+            dev_t device;
+            ino_t inode;
+        };
+        std::string path_;                                 // PATH the entries were resolved against
+        std::unordered_map<std::string, Entry> entries_;   // Command name -> executable
+
+    public:
+        // Full path of name on PATH, or "" if there is no executable by that name
+        std::string resolve(const std::string& name);
+    };
+    
+    // A started program, reaped by wait()
+    struct Child {
+        pid_t pid = 0;         // Also the id of its process group
+        int exit_fd = -1;      // Readable once it has exited: its pidfd, or its Spawner reply socket
+                               // (close-on-exec, closed by wait())
+        bool spawned = false;  // Started by the Spawner, which reports its status on exit_fd
+        bool starting = false; // Handed to the Spawner but pid not yet known: exit_fd turns readable
+                               // once it has forked, then finishLaunch() fills in pid
+    };
+    
+    // A started command whose combined stdout/stderr is readable from output_fd
+    struct Process : Child {
+        int output_fd = -1;    // Read end of the output pipe (close-on-exec), owned by the caller
     };
     
     // Execute a command and capture the output
-    static Result execute(const std::string& command);
+    // If dir_fd is valid the command starts in that directory; the caller's cwd is untouched
+    static Result execute(const std::string& command, int dir_fd = -1);
+    
+    // Start a command without waiting for it; throws std::runtime_error if it cannot start.
+    // A simple command (words and quotes only) is exec'd directly, found through paths if given;
+    // anything else runs under /bin/sh -c. With deferred the result may still be starting
+    // (see Child); if finishLaunch() then throws, the caller closes output_fd
+    static Process spawn(const std::string& command, int dir_fd = -1, PathCache* paths = nullptr,
+                         bool deferred = false);
+    
+    // Reap a started program and close its exit_fd; blocks until it exits, so callers on an event
+    // loop wait for exit_fd to turn readable first. output holds termination notes only
+    static Result wait(const Child& child);
+    
+    // Start path in its own process group with stdout and stderr on output_fd, stdin on
+    // input_fd (-1: inherited) and dir_fd as cwd (-1: inherited); throws std::runtime_error.
+    // Goes through the Spawner when it runs; otherwise posix_spawn, or fork when limits are set.
+    // With deferred it returns as soon as the Spawner has the request, leaving the child starting
+    static Child launch(const char* path, char* const argv[], int dir_fd, int input_fd, int output_fd,
+                        bool deferred = false);
+    
+    // Take the pid of a starting child from its exit_fd (blocks until the Spawner answers; does
+    // nothing if it is not starting). Throws std::runtime_error, with exit_fd closed, if the
+    // command could not be started
+    static void finishLaunch(Child& child);
+    
+    // pidfd of a child (close-on-exec), readable once it has exited; -1 with errno set on failure
+    static int pidfd(pid_t pid);
     
 private:
-    // Parse command string into array
-    static std::vector<std::string> parseCommand(const std::string& command);
+    // Split a command into words with POSIX quoting; false if it needs the shell
+    // (operators, redirections, expansions, globs, assignments or a builtin)
+    static bool parseCommand(const std::string& command, std::vector<std::string>& words);
+    
+    // Track a child started by this process through its pidfd; kills and reaps it and throws
+    // std::runtime_error if the pidfd cannot be opened
+    static Child adopt(pid_t pid);
     
     // Read all data from a file descriptor
     static std::string readFromPipe(int fd);
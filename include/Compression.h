@@ -0,0 +1,50 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+/**
+ * Per-frame payload compression (zlib deflate)
+ * A compressed payload is the original length as a big-endian uint32
+ * followed by one complete zlib stream, so every frame decodes on its own
+ * and frames of different commands may interleave freely.
+ */
+namespace Compression {
+
+constexpr int DEFAULT_LEVEL = 1;          // Fastest; output is usually text that shrinks well anyway
+constexpr size_t MIN_INPUT = 256;         // Smaller payloads are not worth the header
+
+// Append the compressed form of input to out if it is smaller than input; otherwise leave
+// out untouched and return false
+bool compress(std::string_view input, std::string& out, int level);
+
+// Decode a payload made by compress(); throws std::runtime_error if it is corrupt or
+// would expand past Protocol::MAX_PAYLOAD
+std::string decompress(std::string_view input);
+
+/**
+ * Streaming gzip (RFC 1952) encoder for output too large to compress in one call,
+ * such as an archive of a directory tree
+ */
+class GzipStream {
+private:
+    void* stream_;                 // z_stream
+
+public:
+    explicit GzipStream(int level);  // Throws std::runtime_error if zlib cannot start
+    ~GzipStream();
+    GzipStream(const GzipStream&) = delete;
+    GzipStream& operator=(const GzipStream&) = delete;
+
+    // Compress input, appending whatever zlib has ready to out
+    void write(std::string_view input, std::string& out);
+
+    // Flush the rest and append the gzip trailer
+    void finish(std::string& out);
+};
+
+} // namespace Compression
+
+#endif // COMPRESSION_H
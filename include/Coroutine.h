@@ -0,0 +1,169 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include "EventLoop.h"
+#include "ThreadPool.h"
+#include <coroutine>
+#include <exception>
+#include <iostream>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+/**
+ * Owning handle to a top-level coroutine driven by an EventLoop
+ * Created suspended; start() runs it up to its first suspension point.
+ * The frame stays alive after completion until the Task is destroyed, so the
+ * owner decides when it is safe to free.
+ */
+class Task {
+public:
+    struct promise_type {
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+
+        // Nobody awaits a top-level task, so there is nobody to rethrow to
+        void unhandled_exception() noexcept {
+            try {
+                std::rethrow_exception(std::current_exception());
+            } catch (const std::exception& e) {
+                std::cerr << "Error in coroutine: " << e.what() << std::endl;
+            } catch (...) {
+                std::cerr << "Error in coroutine" << std::endl;
+            }
+        }
+    };
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+public:
+    Task() : handle_(nullptr) {}
+
+    // Destroys the frame wherever it is suspended
+    ~Task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+
+    Task& operator=(Task&& other) noexcept {
+        if (this != &other) {
+            if (handle_) {
+                handle_.destroy();
+            }
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+
+    // Run until the first suspension point
+    void start() {
+        handle_.resume();
+    }
+
+    // Check if the coroutine ran to completion
+    bool done() const {
+        return !handle_ || handle_.done();
+    }
+};
+
+/**
+ * co_await park(slot): suspend, leaving the handle in slot for whoever is to
+ * wake the coroutine (by scheduling it on the loop). Wakeups only mean
+ * "something changed", so callers re-check their condition in a loop.
+ */
+class ParkAwaiter {
+private:
+    std::coroutine_handle<>& slot_;
+
+public:
+    explicit ParkAwaiter(std::coroutine_handle<>& slot) : slot_(slot) {}
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle) noexcept { slot_ = handle; }
+    void await_resume() const noexcept {}
+};
+
+inline ParkAwaiter park(std::coroutine_handle<>& slot) {
+    return ParkAwaiter(slot);
+}
+
+// Resume whoever parked in slot, if anyone
+inline void unpark(EventLoop& loop, std::coroutine_handle<>& slot) {
+    if (slot) {
+        loop.schedule(std::exchange(slot, nullptr));
+    }
+}
+
+/**
+ * Awaitable that runs blocking work on a ThreadPool and resumes the awaiting
+ * coroutine on the loop thread with its result (or exception). The awaiter
+ * lives in the coroutine frame, so no allocation beyond the pool's queue entry.
+ * Without a pool the work runs inline and the coroutine never suspends.
+ */
+template <typename Work>
+class OffloadAwaiter {
+public:
+    using Result = std::invoke_result_t<Work&>;
+
+private:
+    ThreadPool* pool_;
+    EventLoop& loop_;
+    Work work_;
+    std::optional<Result> result_;
+    std::exception_ptr error_;
+
+    void runWork() {
+        try {
+            result_.emplace(work_());
+        } catch (...) {
+            error_ = std::current_exception();
+        }
+    }
+
+public:
+    OffloadAwaiter(ThreadPool* pool, EventLoop& loop, Work work)
+        : pool_(pool), loop_(loop), work_(std::move(work)) {}
+
+    bool await_ready() {
+        if (!pool_) {
+            runWork();
+            return true;
+        }
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        pool_->submit([this, handle]() {
+            runWork();
+            loop_.scheduleRemote(handle);
+        });
+    }
+
+    Result await_resume() {
+        if (error_) {
+            std::rethrow_exception(error_);
+        }
+        return std::move(*result_);
+    }
+};
+
+// co_await offload(pool, loop, work): run work() off the loop thread
+template <typename Work>
+OffloadAwaiter<Work> offload(ThreadPool* pool, EventLoop& loop, Work work) {
+    return OffloadAwaiter<Work>(pool, loop, std::move(work));
+}
+
+#endif // COROUTINE_H
@@ -0,0 +1,63 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "FileTransfer.h"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+/**
+ * rsync-style delta encoding for SYNC
+ * The receiver describes the file it already has as a signature: for every
+ * block (the last may be short), a rolling (weak) checksum and a truncated
+ * SHA-256 (strong).
+ * The sender slides a window over its new version and, wherever the window
+ * matches a block, sends a copy instruction instead of the bytes. Everything
+ * else goes out as literal data.
+ *
+ * Instructions, back to back in DATA payloads (integers big-endian):
+ *   'C' <uint64 first block> <uint32 count>   copy blocks of the old file
+ *   'L' <uint32 length> <bytes>               literal data
+ * An instruction never spans two payloads.
+ */
+namespace Delta {
+
+constexpr size_t STRONG_SIZE = 8;                     // Bytes of SHA-256 kept per block; the whole
+                                                      // file's digest catches the odd false match
+constexpr size_t ENTRY_SIZE = 4 + STRONG_SIZE;        // Signature bytes per block
+constexpr size_t MIN_BLOCK_SIZE = 2 * 1024;
+constexpr size_t MAX_BLOCK_SIZE = 128 * 1024;
+constexpr size_t MAX_LITERAL = 1024 * 1024;           // Largest literal instruction
+constexpr uint64_t PARALLEL_SIGNATURE = 16 * 1024 * 1024;  // Smaller files are signed on one thread
+
+// Block size for a file of size bytes: about its square root, as rsync picks
+size_t blockSize(uint64_t size);
+
+uint32_t weakChecksum(const char* data, size_t length);
+
+// Signature of the first size bytes of fd, ENTRY_SIZE bytes per block. Large files are split
+// over up to threads threads; throws std::runtime_error on a read error
+std::string signature(int fd, uint64_t size, size_t block_size, size_t threads);
+
+struct Stats {
+    uint64_t matched = 0;          // Bytes sent as block copies
+    uint64_t literal = 0;          // Bytes sent as literal data
+    
+    std::string describe() const;  // "476.8 MB, 24.0 KB sent"
+};
+
+// Encode data against the signature of a base_size-byte file, passing instructions to emit
+// in batches of about MAX_LITERAL bytes
+void encode(const char* data, uint64_t size, size_t block_size, uint64_t base_size, const std::string& signature,
+            const std::function<void(const std::string&)>& emit, Stats& stats);
+
+// Apply one payload of instructions: copies come from base_fd (base_size bytes), everything
+// is written to out_fd at offset (advanced, at most to limit) and added to hash. False with
+// the reason in error if the instructions are malformed or I/O fails
+bool apply(const std::string& instructions, int base_fd, size_t block_size, uint64_t base_size,
+           int out_fd, uint64_t& offset, uint64_t limit, FileTransfer::Sha256& hash, std::string& error);
+
+} // namespace Delta
+
+#endif // DELTA_H
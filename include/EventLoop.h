@@ -0,0 +1,158 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <coroutine>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <sys/epoll.h>
+#include <sys/types.h>
+
+class IoUring;
+
+/**
+ * Minimal reactor with two interchangeable backends
+ *  - epoll: readiness events, the loop performs accept()/recv() itself
+ *  - io_uring: multishot poll/accept/recv with registered (provided) receive
+ *    buffers; all submissions queued during an iteration go to the kernel in
+ *    the same io_uring_enter() call that waits for the next completions
+ * Handlers always run on the thread calling run()/poll().
+ * Doubles as the coroutine scheduler: scheduled handles are resumed on the
+ * loop thread after each batch of events, from reused queues.
+ */
+class EventLoop {
+public:
+    enum class Backend { Epoll, IoUring };
+
+    using Handler = std::function<void(uint32_t events)>;
+    // Receives a connected, non-blocking client fd, or -errno if accept failed
+    using AcceptHandler = std::function<void(int fd)>;
+    // Receives stream data; length 0 means the peer closed, negative is -errno
+    using DataHandler = std::function<void(const char* data, ssize_t length)>;
+
+private:
+    enum class Kind { Ready, Accept, Stream };
+
+    struct Watch {
+        int fd;
+        Kind kind;
+        uint64_t id;
+        uint32_t events;           // Ready: requested events
+        bool exclusive;            // Accept: EPOLLEXCLUSIVE wakeups (epoll backend)
+        bool want_write;           // Stream: caller has output queued
+        bool write_armed;          // Stream: io_uring POLLOUT request in flight
+        bool read_paused;          // Stream: caller's input is full, leave data in the socket
+        bool recv_armed;           // Stream: io_uring multishot recv in flight
+        bool unwatched;            // Stream: out of the epoll set after a hangup while paused
+        bool active;               // Cleared by remove() so in-flight callbacks stop
+        uint16_t generation;       // Bumped by modify() to ignore stale io_uring completions
+        Handler handler;           // Ready events, or Stream writability
+        AcceptHandler on_accept;
+        DataHandler on_data;
+    };
+
+    Backend backend_;
+    int epoll_fd_;
+    std::unique_ptr<IoUring> ring_;
+    std::vector<char> read_buffer_;                         // Receive buffer for the epoll backend
+    bool running_;
+    uint64_t next_id_;                                      // Registration id source
+    std::unordered_map<int, uint64_t> ids_;                 // fd -> registration id
+    std::unordered_map<uint64_t, std::shared_ptr<Watch>> watches_;  // id -> watch
+    int wake_fd_;                                           // eventfd signalled by post()
+    std::mutex posted_mutex_;
+    std::vector<std::function<void()>> posted_;             // Tasks queued from other threads
+    std::vector<std::coroutine_handle<>> remote_ready_;     // Handles scheduled from other threads (posted_mutex_)
+    std::vector<std::coroutine_handle<>> ready_;            // Handles to resume on this thread
+    std::vector<std::coroutine_handle<>> resuming_;         // Batch being resumed (capacity reused)
+
+    static Backend preferred_backend_;
+
+    // Register a new watch with the backend
+    void attach(const std::shared_ptr<Watch>& watch);
+
+    // Epoll backend helpers
+    uint32_t epollEvents(const Watch& watch) const;
+    void dispatchEpoll(Watch& watch, uint32_t events);
+
+    // accept4() until the listener's backlog is empty
+    void acceptPending(Watch& watch);
+
+    // io_uring backend helpers
+    void arm(Watch& watch, unsigned op);
+    void cancel(uint64_t user_data);
+    void dispatchCompletion(uint64_t user_data, int32_t res, uint32_t flags);
+
+    // Run tasks queued by post() and collect remotely scheduled handles
+    void runPosted();
+
+    // Resume every scheduled coroutine, including ones scheduled meanwhile
+    void resumeReady();
+
+public:
+    // Uses the preferred backend, falling back to epoll if io_uring cannot be set up
+    EventLoop();
+    ~EventLoop();
+
+    // Non-copyable: the epoll descriptor / ring is owned
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    // Backend used by loops created from now on (set once at startup)
+    static void setPreferredBackend(Backend backend);
+    static Backend preferredBackend();
+    static const char* backendName(Backend backend);
+
+    // Backend this loop actually runs on
+    Backend backend() const;
+
+    // Start watching a file descriptor for readiness (EPOLLIN, EPOLLOUT, ...)
+    void add(int fd, uint32_t events, Handler handler);
+
+    // Change the events watched for a file descriptor
+    void modify(int fd, uint32_t events);
+
+    // Accept connections from a listening socket as they arrive
+    void addAcceptor(int fd, bool exclusive, AcceptHandler on_accept);
+
+    // Receive from a stream socket; on_writable fires while setWantWrite(fd, true)
+    void addStream(int fd, DataHandler on_data, Handler on_writable);
+
+    // Ask for (or stop asking for) writability notifications on a stream
+    void setWantWrite(int fd, bool want);
+
+    // Stop (true) or resume (false) receiving on a stream; unread data then backs up to the peer
+    void setReadPaused(int fd, bool paused);
+
+    // Stop watching a file descriptor (safe to call from inside a handler)
+    void remove(int fd);
+
+    // Check if a file descriptor is registered
+    bool contains(int fd) const;
+
+    // Dispatch events until stop() is called
+    void run();
+
+    // Wait up to timeout_ms for events and dispatch them once (-1 blocks)
+    void poll(int timeout_ms);
+
+    // Queue a task to run on the loop thread (safe to call from any thread)
+    void post(std::function<void()> task);
+
+    // Resume a coroutine on the loop thread after the current batch (loop thread only)
+    void schedule(std::coroutine_handle<> handle);
+
+    // Resume a coroutine on the loop thread (safe to call from any thread)
+    void scheduleRemote(std::coroutine_handle<> handle);
+
+    // Ask run() to return after the current batch
+    void stop();
+
+    // Check if run() is active
+    bool isRunning() const;
+};
+
+#endif // EVENTLOOP_H
@@ -0,0 +1,56 @@
+#ifndef FILETRANSFER_H
+#define FILETRANSFER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+
+/**
+ * Helpers shared by both ends of GET / PUT
+ * Transfers resume by byte offset and are verified end to end with a
+ * SHA-256 of the whole file, so a resumed file is checked as one piece.
+ */
+namespace FileTransfer {
+
+constexpr size_t DATA_CHUNK_SIZE = 4 * 1024 * 1024;  // Largest DATA frame payload
+constexpr uint64_t DEFAULT_RANGE_SIZE = 64 * 1024 * 1024;  // Bytes per FLAG_CHUNK request of a parallel transfer
+constexpr size_t MAX_STREAMS = 16;                   // Connections one parallel transfer may open
+constexpr int MAX_RANGE_ATTEMPTS = 3;                // Tries per range before the transfer fails
+
+/**
+ * Incremental SHA-256, for hashing data as it streams past
+ */
+class Sha256 {
+private:
+    void* context_;   // EVP_MD_CTX, kept out of this header
+
+public:
+    Sha256();
+    ~Sha256();
+
+    Sha256(const Sha256&) = delete;
+    Sha256& operator=(const Sha256&) = delete;
+
+    void update(const void* data, size_t length);
+
+    // Hash length bytes of fd from offset on (pread, the file position is untouched);
+    // throws std::runtime_error on a read error or if the file is shorter
+    void updateFromFile(int fd, uint64_t offset, uint64_t length);
+
+    // Hex digest; the object is spent afterwards
+    std::string finish();
+};
+
+// Hex SHA-256 of length bytes of fd from offset on (read with pread, the file position is untouched);
+// throws std::runtime_error on a read error or if the file is shorter
+std::string sha256(int fd, uint64_t offset, uint64_t length);
+
+// "<number> ... <path>" payloads of GET and PUT: count decimal fields, then the path
+// (which may contain spaces); false if malformed
+bool parseRequest(const std::string& payload, size_t count, uint64_t* numbers, std::string& path);
+std::string formatRequest(std::initializer_list<uint64_t> numbers, const std::string& path);
+
+} // namespace FileTransfer
+
+#endif // FILETRANSFER_H
@@ -0,0 +1,92 @@
+#ifndef IOURING_H
+#define IOURING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+
+/**
+ * Thin io_uring wrapper built directly on the io_uring_* syscalls
+ * Maps the submission/completion rings and provides the receive buffers used
+ * by buffer-selecting (multishot) receives
+ */
+class IoUring {
+private:
+    int ring_fd_;
+
+    // Submission ring
+    void* sq_ptr_;
+    size_t sq_size_;
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned* sq_mask_;
+    unsigned* sq_array_;
+    io_uring_sqe* sqes_;
+    size_t sqes_size_;
+    unsigned sq_local_tail_;     // Entries filled but not yet published to the kernel
+
+    // Completion ring
+    void* cq_ptr_;
+    size_t cq_size_;
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned* cq_mask_;
+    io_uring_cqe* cqes_;
+
+    unsigned features_;
+
+    // Provided receive buffers: a registered ring, or legacy PROVIDE_BUFFERS when buf_ring_ is null
+    io_uring_buf_ring* buf_ring_;
+    size_t buf_ring_size_;
+    char* buffers_;
+    size_t buffers_size_;
+    unsigned buf_count_;
+    size_t buf_size_;
+    uint16_t buf_group_;
+    uint16_t buf_tail_;
+
+    // Publish locally filled SQEs to the kernel
+    unsigned publish();
+
+    // Provided buffer ring registration and a one-byte self-test of it
+    bool registerBufferRing(uint16_t group, unsigned count);
+    bool bufferRingWorks();
+
+public:
+    // Create a ring with at least `entries` submission slots (throws on failure)
+    explicit IoUring(unsigned entries);
+
+    // Unmaps the rings and closes the ring fd. Registrations are never undone
+    // explicitly, so a forked child dropping its copy cannot disturb the parent.
+    ~IoUring();
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    // Check whether this kernel supports everything the event loop backend needs
+    static bool isSupported();
+
+    // Get a zeroed submission entry; flushes the queue to the kernel if it is full
+    io_uring_sqe* getSqe();
+
+    // Submit all queued entries and wait for at least one completion (timeout_ms < 0 blocks)
+    void submitAndWait(int timeout_ms);
+
+    // Submit all queued entries without waiting
+    void submit();
+
+    // Next completion, or nullptr if none is ready; call advance() once it has been handled
+    io_uring_cqe* peekCqe();
+    void advance();
+
+    // Provide `count` receive buffers of `size` bytes to buffer-selecting requests (count must be a
+    // power of 2). Must be called on an idle ring; re-provided buffers complete with user_data 0.
+    void setupBufferRing(uint16_t group, unsigned count, size_t size);
+
+    // Provided buffer access
+    uint16_t bufferGroup() const;
+    const char* buffer(uint16_t bid) const;
+    void recycleBuffer(uint16_t bid);
+};
+
+#endif // IOURING_H
@@ -0,0 +1,125 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/**
+ * Length-prefixed wire protocol shared by client and server
+ *
+ * Every message is a frame: a fixed 12-byte header followed by the payload.
+ *   offset 0  uint8   version      PROTOCOL_VERSION
+ *   offset 1  uint8   type         FrameType
+ *   offset 2  uint16  flags        FrameFlag bits
+ *   offset 4  uint32  request_id   Matches responses to requests (0 = none)
+ *   offset 8  uint32  length       Payload bytes that follow
+ * Multi-byte fields are big-endian.
+ */
+namespace Protocol {
+
+constexpr uint8_t PROTOCOL_VERSION = 1;
+constexpr size_t HEADER_SIZE = 12;
+constexpr uint32_t MAX_PAYLOAD = 16 * 1024 * 1024;  // Larger frames are a protocol error
+constexpr uint32_t CHANNEL_WINDOW = 256 * 1024;     // Output credit a channel starts with
+constexpr size_t MAX_CHANNELS = 64;                 // Concurrent channels per session
+
+enum class FrameType : uint8_t {
+    Hello = 1,        // Server greeting; payload "AUTH_REQUIRED" or "READY"
+    Auth = 2,         // Client credentials "username:password"
+    AuthOk = 3,       // Payload is the session token
+    AuthFailed = 4,   // Payload is the reason
+    Command = 5,      // Command line to execute (or data to echo)
+    Output = 6,       // Chunk of command output; a command may produce any number
+    Error = 7,        // Protocol error; the sender closes the connection
+    Exit = 8,         // Command finished; payload is the decimal exit code (-1 if it never ran)
+    Window = 9,       // Client grants a channel more output credit; payload is decimal bytes
+    Cancel = 10,      // Client stops a command; it still ends with an EXIT frame
+    Get = 11,         // Download "<offset> <path>": FILE, DATA from offset on, DIGEST, EXIT
+    Put = 12,         // Upload "<size> <path>": server answers FILE, client sends DATA, server DIGEST, EXIT
+    File = 13,        // GET: decimal file size. PUT: decimal offset the client must send from.
+                      // SYNC: "<block size> <size>" of the server's copy; its signature follows
+    Data = 14,        // Chunk of file contents, in order; counts against the window like OUTPUT.
+                      // SYNC: signature bytes (server), then delta instructions (client)
+    Digest = 15,      // Hex SHA-256 of the whole file as the server has it. SYNC: the client
+                      // ends its delta with the digest of its file
+    Sync = 16,        // Delta upload "<size> <mode> <path>": FILE and DATA carry the signature of
+                      // the server's copy, the client answers with DATA and DIGEST, the server
+                      // renames the rebuilt file into place and ends with DIGEST, EXIT
+    Archive = 17,     // Directory "<path>" as a tar stream: DATA frames, then EXIT. With FLAG_COMPRESSED
+                      // the stream is gzip
+    Resume = 18       // Instead of AUTH: the token of an earlier session. Answered like AUTH; on
+                      // AUTH_FAILED the client may still send AUTH on the same connection
+};
+
+enum FrameFlag : uint16_t {
+    FLAG_NONE = 0,
+    // On COMMAND: run on its own channel, concurrently with the session's other commands.
+    // Its OUTPUT payloads may total CHANNEL_WINDOW bytes plus whatever WINDOW frames grant
+    // (the closing OUTPUT/EXIT frames are not counted). Plain commands run in arrival order
+    // without flow control.
+    FLAG_CHANNEL = 1 << 0,
+    // On AUTH / RESUME: the client can read compressed frames. On AUTH_OK: the server will send them.
+    // On OUTPUT: the payload is Compression::compress() output; window accounting counts
+    // the original bytes. On ARCHIVE: gzip the tar stream.
+    FLAG_COMPRESSED = 1 << 1,
+    // On PUT: keep what the target already holds and continue after it
+    FLAG_RESUME = 1 << 2,
+    // On GET / PUT: move one byte range, "<offset> <length> <path>" (PUT: "<offset> <length>
+    // <size> <path>", size being the whole file's). DATA and DIGEST cover only that range, so
+    // ranges can travel over separate connections and be checked and retried one by one
+    FLAG_CHUNK = 1 << 3
+};
+
+struct Frame {
+    FrameType type;
+    uint16_t flags;
+    uint32_t request_id;
+    std::string payload;
+};
+
+// Append one encoded frame to out (lets callers batch several frames into one send)
+void appendFrame(std::string& out, FrameType type, uint32_t request_id,
+                 std::string_view payload, uint16_t flags = FLAG_NONE);
+
+// Write a header into the first HEADER_SIZE bytes of dest (payload built in place after it)
+void encodeHeader(char* dest, FrameType type, uint32_t request_id,
+                  uint32_t length, uint16_t flags = FLAG_NONE);
+
+// Encode a single frame
+std::string encodeFrame(FrameType type, uint32_t request_id,
+                        std::string_view payload, uint16_t flags = FLAG_NONE);
+
+// Human-readable frame type for log messages
+const char* typeName(FrameType type);
+
+/**
+ * Incremental frame decoder
+ * Feed it whatever a read returned, however it is split, then pull complete
+ * frames with next(). Throws std::runtime_error on a malformed header.
+ */
+class FrameParser {
+private:
+    std::string buffer_;
+    size_t offset_;    // Start of the first unparsed byte in buffer_
+
+public:
+    FrameParser();
+
+    // Append received bytes
+    void feed(const char* data, size_t length);
+
+    // Input area for reads that append directly (e.g. AsyncSocket::async_recv)
+    std::string& buffer();
+
+    // Extract the next complete frame; false if more input is needed
+    bool next(Frame& frame);
+
+    // Bytes received but not yet returned as frames
+    size_t pending() const;
+};
+
+} // namespace Protocol
+
+#endif // PROTOCOL_H
@@ -2,34 +2,230 @@
 #define SERVER_H
 
 #include "Socket.h"
+#include "AsyncSocket.h"
+#include "CommandExecutor.h"
+#include "ShellSession.h"
 #include "Auth.h"
+#include "Coroutine.h"
+#include "Protocol.h"
+#include "EventLoop.h"
+#include "FileTransfer.h"
+#include "ThreadPool.h"
 #include <string>
 #include <memory>
+#include <deque>
+#include <coroutine>
+#include <unordered_map>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <sys/types.h>
 
 
 class Server {
 private:
-    Socket listen_socket_;
+    struct Shard;
+
+    // One command (or GET, or ARCHIVE) of a session, run by its own coroutine; its frames carry id as request_id
+    // Plain commands take turns in arrival order; FLAG_CHANNEL ones start at once and send
+    // output only while the client has granted window
+    struct Channel {
+        uint32_t id;
+        Protocol::FrameType kind;  // COMMAND, GET or ARCHIVE
+        std::string command;       // Command line, or the GET / ARCHIVE request
+        uint16_t flags;            // Flags of the request frame
+        bool ordered;              // Plain command: waits for the commands before it
+        size_t window;             // Output bytes the client still accepts (SIZE_MAX = no flow control)
+        pid_t pid;                 // Process group of the running command, 0 if none
+        bool cancelled;            // CANCEL received or the session is ending
+        std::coroutine_handle<> waiter;  // Parked until its turn, more window or cancellation
+        Task task;
+
+        Channel();
+    };
+
+    // PUT in progress: DATA frames are written (and hashed) at offset until size bytes are in place
+    struct Upload {
+        int fd;
+        uint64_t start;            // First byte the digest covers (0, or the start of a chunk)
+        uint64_t offset;
+        uint64_t size;             // End of the file, or of the chunk
+        std::unique_ptr<FileTransfer::Sha256> hash;  // Covers start .. offset
+        int base_fd = -1;          // SYNC: the copy being replaced, source of unchanged blocks
+        size_t block_size = 0;     // SYNC: block size of its signature (0 for a PUT)
+        uint64_t base_size = 0;    // SYNC: its length
+        mode_t mode = 0;           // SYNC: permissions of the new file
+        std::string temp;          // SYNC: new file being built next to path, renamed over it once verified
+        std::string path;
+    };
+
+    // Per-client session state; the session itself runs as a coroutine on the shard's loop
+    struct Connection {
+        enum class State { Authenticating, Ready };
+
+        std::unique_ptr<AsyncSocket> stream;
+        Shard* shard;              // Reactor that owns this connection
+        std::string peer;          // "ip:port" for log messages
+        State state;
+        Protocol::FrameParser parser;  // Bytes received but not yet processed
+        std::string auth_token;
+        std::string current_dir;   // Working directory of this session (for display)
+        int dir_fd;                // Working directory of this session (for spawning)
+        CommandExecutor::PathCache paths;  // Commands this session resolved on PATH
+        std::unique_ptr<ShellSession> shell;  // Persistent shell of the session, started by its first command
+        bool splice_output;        // No per-frame transform: command output may bypass userspace
+        int compression_level;     // zlib level for OUTPUT payloads, negotiated at AUTH (0 = off)
+        std::unordered_map<uint32_t, std::unique_ptr<Channel>> channels;  // Running and queued commands
+        std::deque<uint32_t> turns;        // Plain commands in arrival order; the front one runs
+        std::unordered_map<uint32_t, Upload> uploads;  // PUTs receiving DATA
+        size_t concurrent;                 // FLAG_CHANNEL commands among channels
+        std::coroutine_handle<> waiter;    // Session parked until a channel finishes
+        Task session;              // Declared last: its frame goes before the state it uses
+
+        Connection();
+        ~Connection();
+        Connection(const Connection&) = delete;
+        Connection& operator=(const Connection&) = delete;
+    };
+
+    // One reactor: event loop, listeners and session table
+    // Unsharded modes run a single shard; sharded mode runs one pinned thread per shard
+    struct Shard {
+        int index;
+        std::unique_ptr<EventLoop> loop;
+        std::vector<Socket> listeners;     // Bound listeners, handed to the acceptor by runShard()
+        std::unique_ptr<AsyncAcceptor> acceptor;
+        std::unordered_map<int, std::unique_ptr<Connection>> connections;  // fd -> session
+        int sessions_served;               // Sessions accepted by this shard
+        std::vector<pid_t> unwatched;      // Forked clients without a pidfd, reaped on later accepts
+        int expiry_timer;                  // timerfd sweeping expired sessions (shard 0), -1 if none
+        Task accept_task;
+        std::thread thread;
+    };
+
     int port_;
-    bool running_;
+    std::string bind_address_;    // Address the listeners bind to
+    std::vector<int> ports_;      // Ports to listen on (defaults to port_)
+    std::atomic<bool> running_;
     bool use_fork_;  
     std::shared_ptr<Auth> auth_;  // Authentication module
     bool require_auth_;           // Whether authentication is required
-    std::string current_dir_;  // Track current working directory
-    bool restart_requested_;      // Flag to request server restart
+    std::string current_dir_;  // Initial working directory for new sessions
+    std::atomic<bool> restart_requested_;  // Flag to request server restart
+    std::vector<std::unique_ptr<Shard>> shards_;
+    int shard_count_;             // SO_REUSEPORT shards requested (0 = unsharded)
+    int prefork_workers_;         // Size of the pre-forked worker pool (0 = disabled)
+    int max_sessions_per_worker_; // Sessions a worker serves before it is recycled (0 = unlimited)
+    std::vector<pid_t> worker_pids_;  // Live pool workers (supervisor only)
+    int session_threads_;         // Threads running session commands (0 = run inline)
+    std::unique_ptr<ThreadPool> session_pool_;
+    int auth_threads_;            // Threads verifying passwords off the event loops (0 = inline)
+    std::unique_ptr<ThreadPool> auth_pool_;
+    std::atomic<size_t> logins_pending_;  // Logins queued on or running in auth_pool_
+    int compression_level_;       // zlib level offered to clients that accept compression (0 = off)
+    bool persistent_shell_;       // Plain commands run in one long-lived shell per session
 
     
-    // Handle single client connection 
-    void handleClientEcho(Socket& client_socket);
+    // Create a shard with listeners on every configured port
+    std::unique_ptr<Shard> createShard(int index, bool reuse_port);
+    
+    // Register the shard's listeners and dispatch events until it is done
+    // exclusive_accept asks for one wakeup per connection across processes sharing the listeners
+    void runShard(Shard& shard, bool exclusive_accept);
+    
+    // Accept loop of a shard (coroutine)
+    Task acceptClients(Shard& shard);
+    
+    // Register an accepted client with the shard's event loop and start its session
+    void openConnection(Shard& shard, Socket client_socket, const std::string& peer);
+    
+    // Session body (coroutine): auth handshake, then reads frames and dispatches commands
+    // to channels until the client leaves, then waits for its channels to finish
+    Task runSession(Connection& conn);
+    
+    // Queue a command frame on a new channel; false if it was refused (reply already built in out)
+    bool openChannel(Connection& conn, const Protocol::Frame& frame, std::string& out);
+    
+    // Channel body (coroutine): runs one command, streaming OUTPUT frames and a closing EXIT frame
+    Task runChannel(Connection& conn, Channel& channel);
+    
+    // Channel body for GET (coroutine): FILE, DATA sent from the page cache, DIGEST, EXIT
+    Task runDownload(Connection& conn, Channel& channel);
+    
+    // Channel body for ARCHIVE (coroutine): the directory as tar in DATA frames, then EXIT. File
+    // bodies go out through sendfile(), or through an Archive::GzipPipeline when compressed
+    Task runArchive(Connection& conn, Channel& channel);
+    
+    // Start a PUT; nullptr if it was refused (reply built in out)
+    Upload* openUpload(Connection& conn, const Protocol::Frame& frame, std::string& out);
+    
+    // Write a DATA frame of a PUT; true once the file is complete (any error reply built in out)
+    bool writeUpload(Connection& conn, const Protocol::Frame& frame, std::string& out);
+    
+    // Start a SYNC: open the current copy and a temporary file beside it; nullptr if it was
+    // refused (reply built in out)
+    Upload* openSync(Connection& conn, const Protocol::Frame& frame, std::string& out);
+    
+    // Drop an upload: close its files and remove an unfinished SYNC's temporary file
+    void closeUpload(Connection& conn, uint32_t request_id);
+    
+    // Stop a channel: kill its command, or drop it if it has not started
+    void cancelChannel(Connection& conn, Channel& channel);
     
-    // Handle client with command execution 
-    void handleClientCommand(Socket& client_socket);
+    // Free a finished channel once its coroutine has fully suspended
+    void retireChannel(Connection& conn, Channel& channel);
     
-    // Authenticate a client
-    std::string authenticateClient(Socket& client_socket);
+    // Append an OUTPUT frame, compressed if the session negotiated it and that makes it smaller
+    void appendOutput(const Connection& conn, std::string& out, uint32_t request_id, std::string_view payload);
+    
+    // Handle client data in echo mode
+    std::string handleClientEcho(const std::string& data);
+    
+    // Handle a built-in command (cd, pwd, remoot); false if the command is not built in
+    // in_shell leaves cd and pwd to the session's persistent shell
+    bool handleBuiltinCommand(Connection& conn, const std::string& command, bool in_shell,
+                              std::string& response, int& exit_code);
+    
+    // Authenticate a client from its AUTH payload ("username:password"); reply is sent back either way
+    bool authenticateClient(Connection& conn, const std::string& credentials, std::string& reply);
+    
+    // Take a client back into its earlier session from a RESUME token, restoring its working
+    // directory; no password check. reply is sent back either way
+    bool resumeClient(Connection& conn, const std::string& token, std::string& reply);
     
     // Handle cd command
-    std::string handleCdCommand(const std::string& path);
+    std::string handleCdCommand(Connection& conn, const std::string& path);
+    
+    // Make an absolute, canonical directory the session's working directory; false (errno set)
+    // if it cannot be opened
+    bool enterDirectory(Connection& conn, const std::string& dir);
+    
+    // Unregister and close a client connection
+    void closeConnection(Shard& shard, int fd);
+    
+    // Serve a single connection in a forked child process
+    void serveForkedClient(Shard& shard, Socket client_socket, const std::string& peer);
+    
+    // Reap a forked session child from the shard's loop once it exits
+    void watchForkedClient(Shard& shard, pid_t pid);
+    
+    // Sweep expired sessions once a second on shard's loop
+    void startExpiryTimer(Shard& shard);
+    
+    // Stop every shard (callable from any shard thread)
+    void requestShutdown();
+    
+    // Run every shard on its own pinned thread and wait for them
+    void runShards();
+    
+    // Fork one pool worker
+    void spawnWorker();
+    
+    // Worker body: accept from the shared listener until recycled
+    void runWorker();
+    
+    // Keep the worker pool at full size until the server stops
+    void runPreforkSupervisor();
 
     
 public:
@@ -47,6 +243,29 @@ public:
     // Enable/disable fork 
     void setUseFork(bool use_fork);
     
+    // Enable a pre-forked worker pool (workers <= 0 disables it)
+    void setPrefork(int workers, int max_sessions_per_worker);
+    
+    // Run session commands on a pool of threads (threads <= 0 runs them inline)
+    void setSessionThreads(int threads);
+    
+    // Run one SO_REUSEPORT listener and event loop per shard (shards <= 0 disables it)
+    void setShards(int shards);
+    
+    // Address and ports to listen on (must be called before start())
+    void setListenAddress(const std::string& address, const std::vector<int>& ports);
+    
+    // Password hashing: PBKDF2 cost, threads verifying logins (<= 0 runs them on the event
+    // loop) and how long a successful login is remembered
+    void setAuthOptions(int kdf_iterations, int threads, int cache_seconds);
+    
+    // Compress command output for clients that support it (level 1-9, <= 0 disables it)
+    void setCompressionLevel(int level);
+    
+    // Run each session's plain commands in one persistent shell, so variables, functions and
+    // the directory carry over between them
+    void setPersistentShell(bool enable);
+    
     // Enable/disable command execution mode
     void setCommandMode(bool enable);
     
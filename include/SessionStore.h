@@ -0,0 +1,91 @@
+#ifndef SESSION_STORE_H
+#define SESSION_STORE_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Session table shared by every server process
+ * The table lives in a MAP_SHARED mapping of a file (data/sessions.db), so
+ * forked and pre-forked workers see each other's sessions and logins survive
+ * a restart. Tokens hash to one of SHARDS shards, each with its own
+ * process-shared robust mutex. A process that dies holding one does not
+ * wedge the others: the next locker takes over and rebuilds the shard from
+ * its records, as the dead process may have left it half changed. Without a usable file the
+ * table falls back to anonymous shared memory, still shared with children
+ * forked afterwards.
+ *
+ * Each shard is an open-addressing table (linear probing, backward-shift
+ * deletion) keyed by the token's 32 raw bytes, so a lookup touches a
+ * record or two whatever the number of sessions. Expiry runs on a
+ * hierarchical timer wheel per shard (4 levels of 64 one-second slots): a
+ * shard's wheel is advanced whenever a session is added or swept (the
+ * server sweeps once a second), and it only visits sessions that are due,
+ * never the whole table. Empty shards are skipped without taking their lock.
+ */
+class SessionStore {
+public:
+    static constexpr size_t SHARDS = 64;
+    static constexpr size_t SLOTS_PER_SHARD = 4096;  // Records per shard (a power of two)
+    static constexpr size_t MAX_LIVE = SLOTS_PER_SHARD / 8 * 7;  // Sessions per shard; at this load the one
+                                                                 // closest to expiring gives way
+    static constexpr size_t TOKEN_SIZE = 64;       // Hex characters (32 bytes)
+    static constexpr size_t MAX_USERNAME = 31;
+    static constexpr size_t MAX_WORKING_DIR = 255;  // Longer directories are not remembered
+
+    struct Session {
+        std::string username;
+        std::string token;
+        std::chrono::system_clock::time_point created_at;
+        std::chrono::system_clock::time_point last_activity;
+        std::string working_dir;
+    };
+
+private:
+    struct Header;
+    struct Shard;
+
+    void* base_;                   // Mapping: Header, then SHARDS Shards
+    size_t size_;
+    bool persistent_;              // Backed by the file (false: anonymous fallback)
+    std::chrono::seconds max_idle_;
+
+    // Shard of a decoded token; nullptr if token is not TOKEN_SIZE hex characters
+    Shard* shardFor(const std::string& token, uint8_t* key) const;
+    Shard* shard(size_t index) const;
+
+public:
+    // Map path, creating or resetting it if needed; falls back to anonymous memory with a warning.
+    // Sessions expire once idle for max_idle
+    SessionStore(const std::string& path, std::chrono::seconds max_idle);
+    ~SessionStore();
+    SessionStore(const SessionStore&) = delete;
+    SessionStore& operator=(const SessionStore&) = delete;
+
+    // Add a session (token must be TOKEN_SIZE hex characters)
+    void insert(const std::string& token, const std::string& username);
+
+    // Copy a session out; false if there is none
+    bool find(const std::string& token, Session& session) const;
+
+    // Mark a session active now, pushing its expiry back; false if there is none
+    bool touch(const std::string& token);
+
+    bool setWorkingDirectory(const std::string& token, const std::string& dir);
+
+    // Remove a session; false if there was none
+    bool erase(const std::string& token);
+
+    // Remove every session that has been idle for max_idle; returns their usernames.
+    // Costs O(expired) plus one lock per non-empty shard when called regularly
+    std::vector<std::string> sweep();
+
+    size_t count() const;
+
+    bool persistent() const;
+};
+
+#endif // SESSION_STORE_H
@@ -0,0 +1,70 @@
+#ifndef SHELL_SESSION_H
+#define SHELL_SESSION_H
+
+#include "CommandExecutor.h"
+#include <cstddef>
+#include <string>
+#include <sys/types.h>
+
+/**
+ * Long-lived /bin/sh coprocess of one session
+ * Commands are written to the shell's stdin by the caller's event loop, each wrapped in `command eval`
+ * (so a syntax error cannot end the shell) with stdin from /dev/null,
+ * followed by a line printing a sentinel, the exit status and $PWD. The
+ * sentinel is random per shell, so no command output can fake the end of a
+ * command. Variables, functions, aliases and the directory persist between
+ * commands as in an interactive shell.
+ */
+class ShellSession {
+private:
+    CommandExecutor::Child child_; // The shell; pid 0 once detached
+    int input_fd_;                 // Shell's stdin
+    int output_fd_;                // Shell's stdout and stderr
+    std::string marker_;           // "<sentinel>:" that starts the status line
+    std::string pending_;          // Output read but not yet handed out
+    int status_;                   // Of the last command that finished
+    std::string directory_;
+
+public:
+    // Start a shell in dir_fd (-1: the server's cwd); throws std::runtime_error.
+    // With deferred the shell may still be starting: see startFd()
+    explicit ShellSession(int dir_fd, bool deferred = false);
+
+    // Kills the shell's process group and reaps it, unless detached
+    ~ShellSession();
+
+    ShellSession(const ShellSession&) = delete;
+    ShellSession& operator=(const ShellSession&) = delete;
+
+    // While the Spawner has yet to fork the shell, a descriptor that turns readable once it has
+    // (not to be closed), else -1. finishStart() then takes the pid; throws std::runtime_error
+    int startFd() const;
+    void finishStart();
+
+    // Text that runs command in the shell and then reports its end, for writing to input()
+    std::string script(const std::string& command) const;
+
+    // Shell's stdin (non-blocking): a shell busy with something else may not take a script at once
+    int input() const;
+
+    // Duplicate of the shell's output pipe for one command's reader (close-on-exec, caller closes it)
+    int duplicateOutput() const;
+
+    // Take length bytes of shell output. Appends to output what belongs to the command and
+    // returns true once its status line arrived; bytes that may start the line are held back
+    bool collect(const char* data, size_t length, std::string& output);
+
+    // Output collect() held back, for when the shell ends without a status line
+    std::string drain();
+
+    // Exit status and working directory reported by the last finished command
+    int status() const;
+    const std::string& directory() const;
+
+    pid_t pid() const;
+
+    // Give up the shell after it died or was killed: the caller reaps the returned child
+    CommandExecutor::Child detach();
+};
+
+#endif // SHELL_SESSION_H
@@ -45,26 +45,32 @@ public:
     // Create a new TCP socket
     void create();
     
-    // Bind socket to address and port
+    // Bind socket to port on all interfaces
     void bind(int port);
     
+    // Bind socket to a specific IPv4 address and port
+    void bind(const std::string& address, int port);
+    
     // Listen for incoming connections
     void listen(int backlog = 5);
     
     // Accept incoming connection (returns new Socket for client)
+    // Returns an invalid Socket if the listener is non-blocking and nothing is pending
     Socket accept(sockaddr_in& client_addr);
     
     // Connect to server
     void connect(const std::string& host, int port);
 
-    // Send data
+    // Send data (returns -1 instead of throwing if a non-blocking send would block)
     ssize_t send(const void* buffer, size_t length, int flags = 0);
     
-    // Receive data
+    // Receive data (returns -1 instead of throwing if a non-blocking recv would block)
     ssize_t recv(void* buffer, size_t length, int flags = 0);
     
     // Set socket options
     void setReuseAddr(bool reuse);
+    void setReusePort(bool reuse);
+    void setNoDelay(bool nodelay);
     void setNonBlocking(bool nonblocking);
 };
 
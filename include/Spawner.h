@@ -0,0 +1,81 @@
+#ifndef SPAWNER_H
+#define SPAWNER_H
+
+#include <cstddef>
+#include <sys/resource.h>
+#include <sys/types.h>
+
+/**
+ * Zygote that starts commands for every server process
+ * server_main forks it before the server maps its session table, opens
+ * listeners or starts threads, so it is single-threaded and small, and a
+ * fork from it costs the same whatever the server grows to. Server processes
+ * (forked clients and pool workers inherit the socket) send it requests on a
+ * SOCK_SEQPACKET socket: path, argv, environment and resource limits, with
+ * the command's output, stdin and directory fds passed by SCM_RIGHTS along
+ * with one end of a socket pair. On that pair the spawner answers with the
+ * pid (or the exec error) and, once it has reaped the command, its wait
+ * status and resource usage; the pair turning readable is the caller's exit
+ * notification. The spawner exits when the last server process closes its
+ * socket.
+ */
+class Spawner {
+public:
+    // Applied to every command, by the spawner or not; 0 leaves a limit as inherited
+    struct Limits {
+        rlim_t cpu_seconds = 0;    // RLIMIT_CPU
+        rlim_t memory_bytes = 0;   // RLIMIT_AS
+        rlim_t open_files = 0;     // RLIMIT_NOFILE
+    };
+
+    static constexpr size_t MAX_REQUEST = 128 * 1024;  // Larger requests are started by the caller
+
+    // Fork the spawner; call before any thread exists. false (after a warning) if it could not start
+    static bool start();
+
+    // Set the limits for commands started from now on (call before any thread exists), and get them
+    static void setLimits(const Limits& limits);
+    static const Limits& limits();
+
+    // Whether requests go to the spawner (false before start(), while disabled, or once it has gone away)
+    static bool running();
+
+    // Stop (false) or resume (true) sending requests to a started spawner; commands started
+    // meanwhile are launched by the caller
+    static void setEnabled(bool enabled);
+
+    // Start path in its own process group with stdout and stderr on output_fd, stdin on input_fd
+    // (-1: inherited), dir_fd as cwd (-1: inherited) and envp as environment (nullptr: inherited).
+    // exit_fd receives the reply socket (close-on-exec, owned by the caller), readable once the
+    // command has exited. Returns 0 if the spawner cannot take the request, so the caller starts
+    // it itself; throws std::runtime_error if the command cannot be started
+    static pid_t launch(const char* path, char* const argv[], char* const envp[], int dir_fd, int input_fd,
+                        int output_fd, int& exit_fd);
+
+    // launch() in two steps, so an event loop need not block while the spawner forks: submit()
+    // sends the request and returns the reply socket (close-on-exec, owned by the caller), or -1
+    // if the spawner cannot take it. The socket turns readable once the spawner has answered;
+    // collect() then takes the pid, 0 if the spawner went away (reply_fd is closed then), and
+    // throws std::runtime_error (closing reply_fd) if the command could not be started. After
+    // that the socket is the command's exit_fd
+    static int submit(const char* path, char* const argv[], char* const envp[], int dir_fd, int input_fd,
+                      int output_fd);
+    static pid_t collect(int reply_fd);
+
+    // Start a command as launch() does, but by fork() from the calling process, with the limits set
+    // between fork and exec. For commands the spawner cannot take while limits are set: posix_spawn
+    // could only apply them after the command had started. Returns the pid (the caller reaps it);
+    // throws std::runtime_error if the command cannot be started or limited
+    static pid_t startLimited(const char* path, char* const argv[], char* const envp[], int dir_fd, int input_fd,
+                              int output_fd);
+
+    // Take the wait status and resource usage the spawner sends on exit_fd, blocking until they
+    // arrive; false if the spawner went away first
+    static bool wait(int exit_fd, int& status, struct rusage& usage);
+
+private:
+    // Spawner body: serve requests on socket until every server process has closed it
+    [[noreturn]] static void serve(int socket);
+};
+
+#endif // SPAWNER_H
@@ -0,0 +1,42 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed-size pool of worker threads consuming a FIFO task queue
+ */
+class ThreadPool {
+private:
+    std::vector<std::thread> threads_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_;
+
+    // Worker thread body
+    void workerLoop();
+
+public:
+    explicit ThreadPool(size_t thread_count);
+
+    // Finishes queued tasks, then joins all threads
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Queue a task for execution on a pool thread
+    void submit(std::function<void()> task);
+
+    // Number of worker threads
+    size_t size() const;
+};
+
+#endif // THREADPOOL_H
@@ -1,30 +1,57 @@
 #include "Client.h"
+#include "Compression.h"
+#include "FileTransfer.h"
 #include "Colors.h"
 #include <iostream>
 #include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <iomanip>
+#include <map>
+#include <mutex>
 #include <sstream>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 
-constexpr size_t BUFFER_SIZE = 4096;
+constexpr size_t BUFFER_SIZE = 64 * 1024;  // Read in large batches; the parser splits frames
+constexpr size_t MAX_IN_FLIGHT = 4096;     // Batch commands sent but not yet answered
 
 
 Client::Client(const std::string& host, int port)
-    : server_host_(host), server_port_(port), connected_(false) {
+    : server_host_(host), server_port_(port), connected_(false), next_request_id_(1), quiet_(false),
+      streams_(1), range_size_(FileTransfer::DEFAULT_RANGE_SIZE) {
 }
 
 // Connect to server
 bool Client::connect() {
     try {
-        std::cout << Color::GRAY << "Connecting to " << server_host_ << ":" << server_port_ << "..." << Color::RESET << std::endl;
+        if (!quiet_) {
+            std::cout << Color::GRAY << "Connecting to " << server_host_ << ":" << server_port_ << "..." << Color::RESET << std::endl;
+        }
         
         // Create socket
         socket_.create();
         
         // Connect to server
         socket_.connect(server_host_, server_port_);
+        socket_.setNoDelay(true);
         
         connected_ = true;
 
-        std::cout << Color::PURPLE << "Connected to " << Color::BG_PURPLE << " " << server_host_ << ":" << server_port_ << " " << Color::RESET << std::endl;
+        if (!quiet_) {
+            std::cout << Color::PURPLE << "Connected to " << Color::BG_PURPLE << " " << server_host_ << ":" << server_port_ << " " << Color::RESET << std::endl;
+        }
         if (!performAuthentication()) {
             std::cerr << "Authentication failed" << std::endl;
             disconnect();
@@ -44,36 +71,698 @@ void Client::disconnect() {
     if (connected_) {
         socket_.close();
         connected_ = false;
-        std::cout << Color::GRAY << "\nDisconnected from server." << Color::RESET << std::endl;
+        if (!quiet_) {
+            std::cout << Color::GRAY << "\nDisconnected from server." << Color::RESET << std::endl;
+        }
+    }
+}
+
+
+// A fresh socket and parser; connect() presents auth_token_ instead of the password
+bool Client::reconnect() {
+    if (connected_) {
+        socket_.close();
+        connected_ = false;
     }
+    parser_ = Protocol::FrameParser();
+    return connect();
+}
+
+
+// Send a whole buffer; a blocking send may still accept only part of it
+void Client::sendAll(const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = socket_.send(data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            throw std::runtime_error("Failed to send data");
+        }
+        sent += static_cast<size_t>(n);
+    }
+}
+
+// Next buffered frame, with a compressed payload already expanded
+bool Client::nextFrame(Protocol::Frame& frame) {
+    if (!parser_.next(frame)) {
+        return false;
+    }
+    if (frame.type == Protocol::FrameType::Output && (frame.flags & Protocol::FLAG_COMPRESSED)) {
+        frame.payload = Compression::decompress(frame.payload);
+        frame.flags &= static_cast<uint16_t>(~Protocol::FLAG_COMPRESSED);
+    }
+    return true;
+}
+
+// Read until the parser yields a complete frame; receives straight into the parser's buffer
+bool Client::readFrame(Protocol::Frame& frame) {
+    std::string& input = parser_.buffer();
+    
+    while (!nextFrame(frame)) {
+        size_t offset = input.size();
+        input.resize(offset + BUFFER_SIZE);
+        ssize_t bytes_received = socket_.recv(&input[offset], BUFFER_SIZE, 0);
+        input.resize(offset + static_cast<size_t>(std::max<ssize_t>(bytes_received, 0)));
+        if (bytes_received <= 0) {
+            return false;
+        }
+    }
+    return true;
 }
 
 
 std::string Client::sendCommand(const std::string& command) {
+    std::string response;
+    int exit_code = streamCommand(command, [&response](const std::string& chunk) { response += chunk; });
+    
+    // Add exit code if command failed
+    if (exit_code > 0) {
+        response += "[Exit code: " + std::to_string(exit_code) + "]\n";
+    }
+    return response;
+}
+
+// Output arrives as any number of OUTPUT frames, closed by one EXIT frame
+int Client::streamCommand(const std::string& command, const std::function<void(const std::string&)>& on_output) {
     if (!connected_) {
         throw std::runtime_error("Not connected to server");
     }
     
-   
-    socket_.send(command.c_str(), command.length(), 0);
+    uint32_t request_id = next_request_id_++;
+    sendAll(Protocol::encodeFrame(Protocol::FrameType::Command, request_id, command));
     
+    Protocol::Frame frame;
+    while (readFrame(frame)) {
+        if (frame.type == Protocol::FrameType::Error) {
+            throw std::runtime_error("Server error: " + frame.payload);
+        }
+        if (frame.request_id != request_id) {
+            continue;
+        }
+        if (frame.type == Protocol::FrameType::Output) {
+            on_output(frame.payload);
+        } else if (frame.type == Protocol::FrameType::Exit) {
+            return std::atoi(frame.payload.c_str());
+        }
+    }
     
-    char buffer[BUFFER_SIZE];
-    std::memset(buffer, 0, BUFFER_SIZE);
+    std::cout << "Server closed connection." << std::endl;
+    connected_ = false;
+    return -1;
+}
+
+
+// Send file bytes straight from the page cache; the socket is blocking, so this paces itself
+void Client::sendFileRange(int fd, uint64_t offset, uint64_t length) {
+    off_t position = static_cast<off_t>(offset);
+    while (length > 0) {
+        ssize_t sent = sendfile(socket_.get(), fd, &position, static_cast<size_t>(length));
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            throw std::runtime_error(sent < 0 ? std::string("Failed to send file: ") + strerror(errno) : "File shrank while sending");
+        }
+        length -= static_cast<uint64_t>(sent);
+    }
+}
+
+// DATA is written where it belongs as it arrives, so memory use does not depend on file size;
+// a PUT's payload goes straight from the page cache
+std::string Client::finishTransfer(bool get, uint32_t request_id, int fd, uint64_t offset, uint64_t end,
+                                   FileTransfer::Sha256& hash, uint64_t& reported, std::string& error) {
+    std::string digest;
+    std::string message;
+    int exit_code = -1;
+    bool sent = false;
+    Protocol::Frame frame;
+    while (exit_code < 0 && readFrame(frame)) {
+        if (frame.type == Protocol::FrameType::Error) {
+            throw std::runtime_error("Server error: " + frame.payload);
+        }
+        if (frame.request_id != request_id) {
+            continue;
+        }
+        switch (frame.type) {
+            case Protocol::FrameType::File:
+                reported = std::strtoull(frame.payload.c_str(), nullptr, 10);
+                if (get && end == UINT64_MAX) {
+                    end = reported;
+                } else if (!get && !sent) {
+                    // A header, then its payload with sendfile()
+                    char header[Protocol::HEADER_SIZE];
+                    for (uint64_t position = reported; position < end; ) {
+                        size_t length = static_cast<size_t>(std::min<uint64_t>(end - position, FileTransfer::DATA_CHUNK_SIZE));
+                        Protocol::encodeHeader(header, Protocol::FrameType::Data, request_id, static_cast<uint32_t>(length));
+                        if (socket_.send(header, sizeof(header), MSG_NOSIGNAL | MSG_MORE) != static_cast<ssize_t>(sizeof(header))) {
+                            throw std::runtime_error("Failed to send data");
+                        }
+                        sendFileRange(fd, position, length);
+                        position += length;
+                    }
+                    sent = true;
+                    
+                    // Hash our copy while the server writes the last chunks and finishes its own
+                    try {
+                        hash.updateFromFile(fd, offset, end - offset);
+                    } catch (const std::exception& e) {
+                        error = std::string("Cannot read local file: ") + e.what();
+                    }
+                }
+                break;
+            case Protocol::FrameType::Data: {
+                size_t written = 0;
+                while (written < frame.payload.size() && error.empty()) {
+                    ssize_t count = pwrite(fd, frame.payload.data() + written, frame.payload.size() - written,
+                                           static_cast<off_t>(offset + written));
+                    if (count < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (count <= 0) {
+                        error = std::string("Cannot write local file: ") + strerror(count < 0 ? errno : ENOSPC);
+                    } else {
+                        written += static_cast<size_t>(count);
+                    }
+                }
+                hash.update(frame.payload.data(), written);
+                offset += written;
+                break;
+            }
+            case Protocol::FrameType::Digest:
+                digest = frame.payload;
+                break;
+            case Protocol::FrameType::Output:
+                message += frame.payload;
+                break;
+            case Protocol::FrameType::Exit:
+                exit_code = std::atoi(frame.payload.c_str());
+                break;
+            default:
+                break;
+        }
+    }
+    if (exit_code < 0) {
+        connected_ = false;
+        error = "Server closed connection";
+    } else if (error.empty() && exit_code != 0) {
+        error = message.empty() ? (get ? "Download failed" : "Upload failed") : message.substr(0, message.find_last_not_of('\n') + 1);
+    } else if (error.empty() && get && offset != end) {
+        error = "Transfer ended after " + std::to_string(offset) + " of " + std::to_string(end) + " bytes";
+    } else if (error.empty() && digest.empty()) {
+        error = "No SHA-256 from the server";
+    }
+    return error.empty() ? digest : "";
+}
+
+bool Client::download(const std::string& remote, const std::string& local, bool resume, std::string& error) {
+    if (!connected_) {
+        throw std::runtime_error("Not connected to server");
+    }
     
-    ssize_t bytes_received = socket_.recv(buffer, BUFFER_SIZE - 1, 0);
+    // A parallel transfer needs the size up front: an empty range reports it
+    uint64_t size = 0;
+    if (streams_ > 1 && !resume) {
+        FileTransfer::Sha256 nothing;
+        uint32_t request_id = next_request_id_++;
+        sendAll(Protocol::encodeFrame(Protocol::FrameType::Get, request_id, FileTransfer::formatRequest({0, 0}, remote),
+                                      Protocol::FLAG_CHUNK));
+        if (finishTransfer(true, request_id, -1, 0, 0, nothing, size, error).empty()) {
+            return false;
+        }
+    }
     
-    if (bytes_received <= 0) {
-        if (bytes_received == 0) {
-            std::cout << "Server closed connection." << std::endl;
-            connected_ = false;
+    int fd = open(local.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        error = local + ": " + strerror(errno);
+        return false;
+    }
+    
+    if (size > range_size_) {
+        bool ok = ftruncate(fd, static_cast<off_t>(size)) == 0;
+        if (!ok) {
+            error = local + ": " + strerror(errno);
+        }
+        ok = ok && transferParallel(true, fd, remote, size, error);
+        close(fd);
+        return ok;
+    }
+    
+    struct stat st;
+    uint64_t offset = 0;
+    if (fstat(fd, &st) == 0 && resume) {
+        offset = static_cast<uint64_t>(st.st_size);
+    } else if (ftruncate(fd, 0) < 0) {
+        error = local + ": " + strerror(errno);
+        close(fd);
+        return false;
+    }
+    
+    // Hash what is already here, then each DATA payload as it is written
+    FileTransfer::Sha256 hash;
+    try {
+        hash.updateFromFile(fd, 0, offset);
+    } catch (const std::exception& e) {
+        error = local + ": " + e.what();
+        close(fd);
+        return false;
+    }
+    
+    uint32_t request_id = next_request_id_++;
+    sendAll(Protocol::encodeFrame(Protocol::FrameType::Get, request_id, FileTransfer::formatRequest({offset}, remote)));
+    
+    std::string digest;
+    try {
+        digest = finishTransfer(true, request_id, fd, offset, UINT64_MAX, hash, size, error);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    if (!digest.empty() && hash.finish() != digest) {
+        error = "SHA-256 mismatch; download again without resuming";
+    }
+    close(fd);
+    return error.empty();
+}
+
+// The server says where to start (it may already hold part of the file), then DATA follows
+bool Client::upload(const std::string& local, const std::string& remote, bool resume, std::string& error) {
+    if (!connected_) {
+        throw std::runtime_error("Not connected to server");
+    }
+    
+    int fd = open(local.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        error = local + ": " + strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        error = local + ": Not a regular file";
+        close(fd);
+        return false;
+    }
+    uint64_t size = static_cast<uint64_t>(st.st_size);
+    
+    if (streams_ > 1 && !resume && size > range_size_) {
+        bool ok = transferParallel(false, fd, remote, size, error);
+        close(fd);
+        return ok;
+    }
+    
+    uint32_t request_id = next_request_id_++;
+    sendAll(Protocol::encodeFrame(Protocol::FrameType::Put, request_id, FileTransfer::formatRequest({size}, remote),
+                                  resume ? Protocol::FLAG_RESUME : Protocol::FLAG_NONE));
+    
+    FileTransfer::Sha256 hash;
+    uint64_t offset = 0;
+    std::string digest;
+    try {
+        digest = finishTransfer(false, request_id, fd, 0, size, hash, offset, error);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+    if (!digest.empty() && hash.finish() != digest) {
+        error = "SHA-256 mismatch; upload again without resuming";
+    }
+    close(fd);
+    return error.empty();
+}
+
+bool Client::transferRange(bool get, int fd, const std::string& remote, uint64_t offset, uint64_t length,
+                           uint64_t size, std::string& error) {
+    uint32_t request_id = next_request_id_++;
+    std::string request = get ? FileTransfer::formatRequest({offset, length}, remote)
+                              : FileTransfer::formatRequest({offset, length, size}, remote);
+    sendAll(Protocol::encodeFrame(get ? Protocol::FrameType::Get : Protocol::FrameType::Put, request_id, request,
+                                  Protocol::FLAG_CHUNK));
+    
+    FileTransfer::Sha256 hash;
+    uint64_t reported = 0;
+    std::string digest = finishTransfer(get, request_id, fd, offset, offset + length, hash, reported, error);
+    if (!digest.empty() && hash.finish() != digest) {
+        error = "SHA-256 mismatch";
+    }
+    return error.empty();
+}
+
+// Each stream takes the next range off a shared queue. A range that fails is queued again,
+// up to MAX_RANGE_ATTEMPTS tries; a stream whose connection breaks stops, and the rest carry on
+bool Client::transferParallel(bool get, int fd, const std::string& remote, uint64_t size, std::string& error) {
+    struct Range {
+        uint64_t offset;
+        uint64_t length;
+        int attempts;
+    };
+    std::deque<Range> queue;
+    for (uint64_t offset = 0; offset < size; offset += range_size_) {
+        queue.push_back(Range{offset, std::min(range_size_, size - offset), 0});
+    }
+    size_t streams = std::min(streams_, queue.size());
+    
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t busy = 0;               // Ranges taken but not yet finished
+    std::string failure;
+    
+    // Take ranges until none are left (or one has failed for good); false if the connection broke
+    auto work = [&](Client& stream) {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            changed.wait(lock, [&]() { return !queue.empty() || busy == 0 || !failure.empty(); });
+            if (queue.empty() || !failure.empty()) {
+                return;
+            }
+            Range range = queue.front();
+            queue.pop_front();
+            busy++;
+            lock.unlock();
+            
+            std::string reason;
+            bool ok = false;
+            try {
+                ok = stream.transferRange(get, fd, remote, range.offset, range.length, size, reason);
+            } catch (const std::exception& e) {
+                stream.connected_ = false;
+                reason = e.what();
+            }
+            
+            lock.lock();
+            busy--;
+            if (!ok && ++range.attempts < FileTransfer::MAX_RANGE_ATTEMPTS) {
+                queue.push_back(range);
+            } else if (!ok && failure.empty()) {
+                failure = "Bytes " + std::to_string(range.offset) + "-" + std::to_string(range.offset + range.length) +
+                          " failed " + std::to_string(range.attempts) + " times: " + reason;
+            }
+            changed.notify_all();
+            if (!stream.connected_) {
+                return;
+            }
+        }
+    };
+    
+    // The extra streams join this session by its token (same working directory, no password
+    // check), or log in with the same credentials; one that cannot connect just sits out
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < streams; i++) {
+        workers.emplace_back([&]() {
+            Client stream(server_host_, server_port_);
+            stream.quiet_ = true;
+            stream.setCredentials(username_, password_);
+            stream.auth_token_ = auth_token_;
+            if (stream.connect()) {
+                work(stream);
+                stream.disconnect();
+            }
+        });
+    }
+    work(*this);
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    
+    if (failure.empty() && !queue.empty()) {
+        failure = "Every connection to the server broke";
+    }
+    error = failure;
+    return error.empty();
+}
+bool Client::sync(const std::string& local, const std::string& remote, Delta::Stats& stats, std::string& error) {
+    if (!connected_) {
+        throw std::runtime_error("Not connected to server");
+    }
+    
+    std::error_code code;
+    if (!std::filesystem::is_directory(local, code)) {
+        return syncFile(local, remote, stats, error);
+    }
+    
+    // Files in a stable order, each to the same relative path under remote
+    std::vector<std::filesystem::path> files;
+    for (auto it = std::filesystem::recursive_directory_iterator(local, code);
+         !code && it != std::filesystem::recursive_directory_iterator(); it.increment(code)) {
+        if (it->is_regular_file(code)) {
+            files.push_back(it->path());
+        }
+    }
+    if (code) {
+        error = local + ": " + code.message();
+        return false;
+    }
+    std::sort(files.begin(), files.end());
+    
+    std::string base = remote.empty() || remote.back() == '/' ? remote : remote + "/";
+    for (const std::filesystem::path& file : files) {
+        std::string relative = std::filesystem::relative(file, local).generic_string();
+        if (!syncFile(file.string(), base + relative, stats, error)) {
+            error = relative + ": " + error;
+            return false;
+        }
+    }
+    return true;
+}
+
+// The signature of the server's copy comes first; the delta goes out while another thread
+// hashes the whole local file for the closing DIGEST
+bool Client::syncFile(const std::string& local, const std::string& remote, Delta::Stats& stats, std::string& error) {
+    int fd = open(local.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        error = local + ": " + strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        error = local + ": Not a regular file";
+        close(fd);
+        return false;
+    }
+    uint64_t size = static_cast<uint64_t>(st.st_size);
+    const char* data = nullptr;
+    if (size > 0) {
+        void* mapping = mmap(nullptr, static_cast<size_t>(size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping == MAP_FAILED) {
+            error = local + ": " + strerror(errno);
+            close(fd);
+            return false;
         }
-        return "";
+        madvise(mapping, static_cast<size_t>(size), MADV_SEQUENTIAL);
+        data = static_cast<const char*>(mapping);
     }
+    auto release = [&]() {
+        if (data) {
+            munmap(const_cast<char*>(data), static_cast<size_t>(size));
+        }
+        close(fd);
+    };
     
-    return std::string(buffer, bytes_received);
+    uint32_t request_id = next_request_id_++;
+    std::string signature;
+    std::string message;
+    std::string digest;
+    size_t block_size = 0;
+    uint64_t base_size = 0;
+    uint64_t blocks = 0;
+    bool have_file = false;
+    int exit_code = -1;
+    Protocol::Frame frame;
+    try {
+        sendAll(Protocol::encodeFrame(Protocol::FrameType::Sync, request_id,
+                                      FileTransfer::formatRequest({size, static_cast<uint64_t>(st.st_mode & 07777)}, remote)));
+        
+        while (exit_code < 0 && !(have_file && signature.size() == blocks * Delta::ENTRY_SIZE) && readFrame(frame)) {
+            if (frame.type == Protocol::FrameType::Error) {
+                throw std::runtime_error("Server error: " + frame.payload);
+            }
+            if (frame.request_id != request_id) {
+                continue;
+            }
+            if (frame.type == Protocol::FrameType::File) {
+                std::istringstream numbers(frame.payload);
+                numbers >> block_size >> base_size;
+                have_file = block_size > 0;
+                blocks = have_file ? (base_size + block_size - 1) / block_size : 0;
+            } else if (frame.type == Protocol::FrameType::Data) {
+                signature += frame.payload;
+            } else if (frame.type == Protocol::FrameType::Output) {
+                message += frame.payload;
+            } else if (frame.type == Protocol::FrameType::Exit) {
+                exit_code = std::atoi(frame.payload.c_str());
+            }
+        }
+        
+        if (exit_code < 0 && have_file && signature.size() == blocks * Delta::ENTRY_SIZE) {
+            std::string local_digest;
+            std::thread hasher([&]() {
+                FileTransfer::Sha256 hash;
+                hash.update(data, static_cast<size_t>(size));
+                local_digest = hash.finish();
+            });
+            try {
+                Delta::encode(data, size, block_size, base_size, signature, [&](const std::string& instructions) {
+                    sendAll(Protocol::encodeFrame(Protocol::FrameType::Data, request_id, instructions));
+                }, stats);
+            } catch (...) {
+                hasher.join();
+                throw;
+            }
+            hasher.join();
+            sendAll(Protocol::encodeFrame(Protocol::FrameType::Digest, request_id, local_digest));
+            
+            while (exit_code < 0 && readFrame(frame)) {
+                if (frame.type == Protocol::FrameType::Error) {
+                    throw std::runtime_error("Server error: " + frame.payload);
+                }
+                if (frame.request_id != request_id) {
+                    continue;
+                }
+                if (frame.type == Protocol::FrameType::Digest) {
+                    digest = frame.payload;
+                } else if (frame.type == Protocol::FrameType::Output) {
+                    message += frame.payload;
+                } else if (frame.type == Protocol::FrameType::Exit) {
+                    exit_code = std::atoi(frame.payload.c_str());
+                }
+            }
+            if (exit_code == 0 && digest != local_digest) {
+                error = "SHA-256 mismatch";
+            }
+        }
+    } catch (...) {
+        release();
+        throw;
+    }
+    release();
+    
+    if (exit_code < 0) {
+        connected_ = false;
+        error = "Server closed connection";
+    } else if (exit_code != 0) {
+        error = message.empty() ? "Sync failed" : message.substr(0, message.find_last_not_of('\n') + 1);
+    }
+    return error.empty();
 }
 
+// The server streams the tar as DATA frames; they are written out as they come
+bool Client::archive(const std::string& remote, const std::string& local, bool gzip, std::string& error) {
+    if (!connected_) {
+        throw std::runtime_error("Not connected to server");
+    }
+    
+    int fd = open(local.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        error = local + ": " + strerror(errno);
+        return false;
+    }
+    
+    uint32_t request_id = next_request_id_++;
+    std::string message;
+    int exit_code = -1;
+    try {
+        sendAll(Protocol::encodeFrame(Protocol::FrameType::Archive, request_id, remote,
+                                      gzip ? Protocol::FLAG_COMPRESSED : Protocol::FLAG_NONE));
+        Protocol::Frame frame;
+        while (exit_code < 0 && readFrame(frame)) {
+            if (frame.type == Protocol::FrameType::Error) {
+                throw std::runtime_error("Server error: " + frame.payload);
+            }
+            if (frame.request_id != request_id) {
+                continue;
+            }
+            if (frame.type == Protocol::FrameType::Data && error.empty()) {
+                size_t written = 0;
+                while (written < frame.payload.size()) {
+                    ssize_t count = write(fd, frame.payload.data() + written, frame.payload.size() - written);
+                    if (count < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (count <= 0) {
+                        error = std::string("Cannot write local file: ") + strerror(count < 0 ? errno : ENOSPC);
+                        break;
+                    }
+                    written += static_cast<size_t>(count);
+                }
+            } else if (frame.type == Protocol::FrameType::Output) {
+                message += frame.payload;
+            } else if (frame.type == Protocol::FrameType::Exit) {
+                exit_code = std::atoi(frame.payload.c_str());
+            }
+        }
+    } catch (...) {
+        close(fd);
+        unlink(local.c_str());
+        throw;
+    }
+    close(fd);
+    
+    if (exit_code < 0) {
+        connected_ = false;
+        error = "Server closed connection";
+    } else if (error.empty() && exit_code != 0) {
+        error = message.empty() ? "Archive failed" : message.substr(0, message.find_last_not_of('\n') + 1);
+    }
+    if (!error.empty()) {
+        unlink(local.c_str());
+    }
+    return error.empty();
+}
+
+// get [-c] REMOTE [LOCAL] / put [-c] LOCAL [REMOTE] / archive [-z] REMOTE [LOCAL]; the second
+// path defaults to the first's name (plus .tar or .tar.gz for an archive)
+void Client::runTransfer(const std::string& input) {
+    std::istringstream words(input);
+    std::vector<std::string> args;
+    std::string word;
+    while (words >> word) {
+        args.push_back(word);
+    }
+    
+    bool sync = args[0] == "sync";
+    bool archiving = args[0] == "archive";
+    bool get = args[0] == "get" || archiving;
+    bool resume = !sync && !archiving && args.size() > 1 && args[1] == "-c";
+    bool gzip = archiving && args.size() > 1 && args[1] == "-z";
+    size_t first = resume || gzip ? 2 : 1;
+    if (args.size() <= first || args.size() > first + 2) {
+        std::cout << Color::GRAY << "  │ " << Color::RESET << "Usage: " << args[0] << (sync ? " " : archiving ? " [-z] " : " [-c] ")
+                  << (get ? "REMOTE [LOCAL]" : "LOCAL [REMOTE]") << std::endl;
+        return;
+    }
+    std::string source = args[first];
+    std::string name = source.substr(0, source.find_last_not_of('/') + 1);
+    std::string target = args.size() > first + 1 ? args[first + 1] : name.substr(name.find_last_of('/') + 1);
+    if (archiving && args.size() == first + 1) {
+        target = (target.empty() || target == "." || target == ".." ? "archive" : target) + (gzip ? ".tar.gz" : ".tar");
+    }
+    
+    auto started = std::chrono::steady_clock::now();
+    std::string error;
+    Delta::Stats stats;
+    bool ok = sync ? this->sync(source, target, stats, error)
+            : archiving ? archive(source, target, gzip, error)
+            : get ? download(source, target, resume, error) : upload(source, target, resume, error);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    
+    if (!ok) {
+        std::cout << Color::GRAY << "  │ " << Color::RESET << Color::ROSE << error << Color::RESET << std::endl;
+        return;
+    }
+    if (sync) {
+        std::cout << Color::GRAY << "  │ " << Color::RESET << source << " -> " << target << ": " << stats.describe()
+                  << " in " << std::fixed << std::setprecision(1) << seconds << " s, SHA-256 verified" << std::endl;
+        return;
+    }
+    struct stat st;
+    double megabytes = stat(get ? target.c_str() : source.c_str(), &st) == 0 ? static_cast<double>(st.st_size) / (1024 * 1024) : 0;
+    std::cout << Color::GRAY << "  │ " << Color::RESET << source << " -> " << target << ": "
+              << std::fixed << std::setprecision(1) << megabytes << " MB in " << seconds << " s"
+              << (archiving ? "" : ", SHA-256 verified") << std::endl;
+}
+
+// The command that was running is lost; the session (and its directory) usually is not
+bool Client::resumeShell() {
+    std::cout << Color::GRAY << "Connection lost, reconnecting..." << Color::RESET << std::endl;
+    return reconnect();
+}
 
 void Client::runInteractiveShell() {
     if (!connected_) {
@@ -117,24 +806,57 @@ void Client::runInteractiveShell() {
         }
         
         try {
+            if (input == "get" || input == "put" || input == "sync" || input == "archive" ||
+                input.rfind("get ", 0) == 0 || input.rfind("put ", 0) == 0 || input.rfind("sync ", 0) == 0 ||
+                input.rfind("archive ", 0) == 0) {
+                runTransfer(input);
+                if (!connected_ && !resumeShell()) {
+                    break;
+                }
+                continue;
+            }
             
-            std::string command = input + "\n";
-            
-           
-            std::string response = sendCommand(command);
+            // Print lines as they stream in, with a left margin for visual separation
+            bool any_output = false;
+            bool at_line_start = true;
+            int exit_code = streamCommand(input, [&](const std::string& chunk) {
+                size_t pos = 0;
+                while (pos < chunk.size()) {
+                    if (at_line_start) {
+                        std::cout << Color::GRAY << "  │ " << Color::RESET;
+                    }
+                    size_t newline = chunk.find('\n', pos);
+                    size_t end = newline == std::string::npos ? chunk.size() : newline + 1;
+                    std::cout.write(chunk.data() + pos, static_cast<std::streamsize>(end - pos));
+                    at_line_start = newline != std::string::npos;
+                    pos = end;
+                }
+                std::cout << std::flush;
+                any_output = any_output || !chunk.empty();
+            });
             
-            if (!response.empty()) {
-                // Add left margin to output for visual separation
-                std::string line;
-                std::istringstream stream(response);
-                while (std::getline(stream, line)) {
-                    std::cout << Color::GRAY << "  │ " << Color::RESET << line << std::endl;
+            if (!at_line_start) {
+                std::cout << std::endl;
+            }
+            if (!connected_) {
+                if (!resumeShell()) {
+                    break;
                 }
+                continue;
+            }
+            if (!any_output) {
+                std::cout << Color::GRAY << "  │ " << Color::RESET << "(no output)" << std::endl;
+            }
+            if (exit_code > 0) {
+                std::cout << Color::GRAY << "  │ " << Color::RESET << "[Exit code: " << exit_code << "]" << std::endl;
             }
             
         } catch (const std::exception& e) {
+            // Send / receive failures: the connection is unusable, but the session may not be
             std::cerr << Color::ROSE << "Error: " << e.what() << Color::RESET << std::endl;
-            break;
+            if (!resumeShell()) {
+                break;
+            }
         }
     }
     
@@ -142,6 +864,139 @@ void Client::runInteractiveShell() {
 }
 
 
+// Sending and receiving are interleaved with poll(): a client that only wrote would
+// stop the server once its output filled our receive buffer, and both sides would block
+int Client::runBatch(std::istream& input, size_t jobs) {
+    if (!connected_) {
+        throw std::runtime_error("Not connected to server");
+    }
+    
+    // Responses are printed in request order; a later request's output waits here.
+    // With jobs, commands run concurrently on channels, and a channel only gets more
+    // window once its output has been printed, so held output stays bounded
+    struct Pending {
+        std::string output;
+        bool done;
+        int exit_code;
+        size_t unacked;            // Printed channel output not yet returned as window
+    };
+    std::map<uint32_t, Pending> in_flight;
+    std::string outgoing;          // Encoded frames not yet accepted by the kernel
+    bool input_done = false;
+    int failed = 0;
+    char buffer[BUFFER_SIZE];
+    size_t limit = jobs > 0 ? std::min(jobs, Protocol::MAX_CHANNELS) : MAX_IN_FLIGHT;
+    uint16_t flags = jobs > 0 ? Protocol::FLAG_CHANNEL : Protocol::FLAG_NONE;
+    
+    auto print = [&](uint32_t request_id, Pending& pending, const std::string& data) {
+        std::cout.write(data.data(), static_cast<std::streamsize>(data.size()));
+        if (jobs == 0 || pending.done) {
+            return;
+        }
+        pending.unacked += data.size();
+        if (pending.unacked >= Protocol::CHANNEL_WINDOW / 2) {
+            Protocol::appendFrame(outgoing, Protocol::FrameType::Window, request_id, std::to_string(pending.unacked));
+            pending.unacked = 0;
+        }
+    };
+    
+    while (true) {
+        // Keep the pipeline full
+        std::string line;
+        while (!input_done && in_flight.size() < limit && outgoing.size() < BUFFER_SIZE) {
+            if (!std::getline(input, line)) {
+                input_done = true;
+                break;
+            }
+            size_t start = line.find_first_not_of(" \t\r");
+            if (start == std::string::npos) {
+                continue;
+            }
+            uint32_t request_id = next_request_id_++;
+            Protocol::appendFrame(outgoing, Protocol::FrameType::Command, request_id, line.substr(start), flags);
+            in_flight[request_id] = Pending{"", false, -1, 0};
+        }
+        
+        if (input_done && in_flight.empty() && outgoing.empty()) {
+            break;
+        }
+        
+        pollfd pfd;
+        pfd.fd = socket_.get();
+        pfd.events = POLLIN | (outgoing.empty() ? 0 : POLLOUT);
+        pfd.revents = 0;
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("poll failed: ") + strerror(errno));
+        }
+        
+        if (pfd.revents & POLLOUT) {
+            ssize_t sent = socket_.send(outgoing.data(), outgoing.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sent > 0) {
+                outgoing.erase(0, static_cast<size_t>(sent));
+            }
+        }
+        
+        if (!(pfd.revents & (POLLIN | POLLHUP | POLLERR))) {
+            continue;
+        }
+        
+        ssize_t bytes_received = socket_.recv(buffer, BUFFER_SIZE, MSG_DONTWAIT);
+        if (bytes_received == 0) {
+            std::cerr << "Server closed connection." << std::endl;
+            connected_ = false;
+            return failed + static_cast<int>(in_flight.size());
+        }
+        if (bytes_received < 0) {
+            continue;
+        }
+        parser_.feed(buffer, static_cast<size_t>(bytes_received));
+        
+        Protocol::Frame frame;
+        while (nextFrame(frame)) {
+            if (frame.type == Protocol::FrameType::Error) {
+                throw std::runtime_error("Server error: " + frame.payload);
+            }
+            
+            auto it = in_flight.find(frame.request_id);
+            if (it == in_flight.end()) {
+                continue;
+            }
+            
+            if (frame.type == Protocol::FrameType::Output) {
+                if (it == in_flight.begin()) {
+                    print(it->first, it->second, frame.payload);
+                } else {
+                    it->second.output += frame.payload;
+                }
+            } else if (frame.type == Protocol::FrameType::Exit) {
+                it->second.done = true;
+                it->second.exit_code = std::atoi(frame.payload.c_str());
+            }
+            
+            // Retire finished requests from the front; the next one's held output goes out now
+            while (!in_flight.empty() && in_flight.begin()->second.done) {
+                if (in_flight.begin()->second.exit_code != 0) {
+                    failed++;
+                }
+                in_flight.erase(in_flight.begin());
+                if (!in_flight.empty()) {
+                    Pending& next = in_flight.begin()->second;
+                    std::string held = std::move(next.output);
+                    next.output.clear();
+                    print(in_flight.begin()->first, next, held);
+                }
+            }
+        }
+        std::cout << std::flush;
+    }
+    
+    return failed;
+}
+
+
 bool Client::isConnected() const {
     return connected_;
 }
@@ -152,29 +1007,56 @@ void Client::setCredentials(const std::string& username, const std::string& pass
     password_ = password;
 }
 
+void Client::setParallelism(size_t streams, uint64_t range_size) {
+    streams_ = std::max<size_t>(1, std::min(streams, FileTransfer::MAX_STREAMS));
+    range_size_ = std::max<uint64_t>(1, range_size);
+}
+
 // Perform authentication handshake
 bool Client::performAuthentication() {
-    char buffer[BUFFER_SIZE];
-    
-    // Wait for AUTH_REQUIRED message
-    std::memset(buffer, 0, BUFFER_SIZE);
-    ssize_t bytes_received = socket_.recv(buffer, BUFFER_SIZE - 1, 0);
+    Protocol::Frame frame;
     
-    if (bytes_received <= 0) {
+    // Wait for the server greeting
+    if (!readFrame(frame) || frame.type != Protocol::FrameType::Hello) {
         std::cerr << "Failed to receive authentication prompt" << std::endl;
         return false;
     }
     
-    std::string prompt(buffer, bytes_received);
-    
     // Check if server requires authentication
-    if (prompt.find("AUTH_REQUIRED") == std::string::npos) {
+    if (frame.payload != "AUTH_REQUIRED") {
         // Server doesn't require auth, we're good
-        std::cout << "Server does not require authentication" << std::endl;
+        if (!quiet_) {
+            std::cout << "Server does not require authentication" << std::endl;
+        }
         return true;
     }
     
-    std::cout << "Server requires authentication" << std::endl;
+    if (!quiet_) {
+        std::cout << "Server requires authentication" << std::endl;
+    }
+    
+    // A session we already hold skips the password (and its hashing on the server)
+    if (!auth_token_.empty()) {
+        sendAll(Protocol::encodeFrame(Protocol::FrameType::Resume, 0, auth_token_, Protocol::FLAG_COMPRESSED));
+        if (!readFrame(frame)) {
+            std::cerr << "Failed to receive authentication response" << std::endl;
+            return false;
+        }
+        if (frame.type == Protocol::FrameType::AuthOk) {
+            auth_token_ = frame.payload;
+            if (!quiet_) {
+                std::cout << "Session resumed" << std::endl;
+            }
+            if ((frame.flags & Protocol::FLAG_COMPRESSED) && !quiet_) {
+                std::cout << "Output compression enabled" << std::endl;
+            }
+            return true;
+        }
+        auth_token_.clear();
+        if (!quiet_) {
+            std::cout << "Session not resumed, logging in again" << std::endl;
+        }
+    }
     
     // Prompt for credentials if not set
     if (username_.empty()) {
@@ -188,35 +1070,26 @@ bool Client::performAuthentication() {
         std::getline(std::cin, password_);
     }
     
-    // Send credentials
-    std::string auth_msg = "AUTH " + username_ + ":" + password_ + "\n";
-    socket_.send(auth_msg.c_str(), auth_msg.length(), 0);
+    // Send credentials, offering to take compressed output
+    sendAll(Protocol::encodeFrame(Protocol::FrameType::Auth, 0, username_ + ":" + password_, Protocol::FLAG_COMPRESSED));
     
     // Receive authentication response
-    std::memset(buffer, 0, BUFFER_SIZE);
-    bytes_received = socket_.recv(buffer, BUFFER_SIZE - 1, 0);
-    
-    if (bytes_received <= 0) {
+    if (!readFrame(frame)) {
         std::cerr << "Failed to receive authentication response" << std::endl;
         return false;
     }
     
-    std::string response(buffer, bytes_received);
-    
-    if (response.find("AUTH_SUCCESS") == 0) {
-        // Extract token
-        size_t space_pos = response.find(' ');
-        if (space_pos != std::string::npos) {
-            auth_token_ = response.substr(space_pos + 1);
-            // Remove trailing newline
-            if (!auth_token_.empty() && auth_token_.back() == '\n') {
-                auth_token_.pop_back();
-            }
+    if (frame.type == Protocol::FrameType::AuthOk) {
+        auth_token_ = frame.payload;
+        if (!quiet_) {
+            std::cout << "Authentication successful!" << std::endl;
+        }
+        if ((frame.flags & Protocol::FLAG_COMPRESSED) && !quiet_) {
+            std::cout << "Output compression enabled" << std::endl;
         }
-        std::cout << "Authentication successful!" << std::endl;
         return true;
     } else {
-        std::cerr << "Authentication failed: " << response;
+        std::cerr << "Authentication failed: " << frame.payload << std::endl;
         return false;
     }
 }
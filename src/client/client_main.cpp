@@ -1,6 +1,8 @@
 #include "Client.h"
 #include "Colors.h"
 #include <iostream>
+#include <fstream>
+#include <algorithm>
 #include <cstdlib>
 
 // ASCII Banner
@@ -22,6 +24,15 @@ int main(int argc, char* argv[]) {
         
         std::string host = "127.0.0.1";
         int port = 8080;
+        std::string batch_file;   // Pipeline commands from this file ("-" for stdin) instead of a shell
+        int jobs = 0;             // Batch commands run concurrently on channels (0 = one after another)
+        std::string transfer;     // "get", "put", "sync" or "archive" to move files instead of a shell
+        std::string source;
+        std::string target;
+        bool resume = false;      // Continue a partial transfer
+        bool gzip = false;        // Compress an archive
+        int streams = 1;          // Connections a large transfer is split across
+        uint64_t chunk_mb = FileTransfer::DEFAULT_RANGE_SIZE / (1024 * 1024);
         
         for (int i = 1; i < argc; i++) {
             std::string arg = argv[i];
@@ -34,11 +45,51 @@ int main(int argc, char* argv[]) {
                 if (i + 1 < argc) {
                     port = std::atoi(argv[++i]);
                 }
+            } else if (arg == "-b" || arg == "--batch") {
+                if (i + 1 < argc) {
+                    batch_file = argv[++i];
+                }
+            } else if (arg == "-j" || arg == "--jobs") {
+                if (i + 1 < argc) {
+                    jobs = std::atoi(argv[++i]);
+                }
+            } else if (arg == "--get" || arg == "--put" || arg == "--sync" || arg == "--archive") {
+                if (i + 2 < argc) {
+                    transfer = arg.substr(2);
+                    source = argv[++i];
+                    target = argv[++i];
+                }
+            } else if (arg == "-c" || arg == "--continue") {
+                resume = true;
+            } else if (arg == "-z" || arg == "--gzip") {
+                gzip = true;
+            } else if (arg == "-s" || arg == "--streams") {
+                if (i + 1 < argc) {
+                    streams = std::atoi(argv[++i]);
+                }
+            } else if (arg == "--chunk-size") {
+                if (i + 1 < argc) {
+                    chunk_mb = std::strtoull(argv[++i], nullptr, 10);
+                }
             } else if (arg == "--help") {
                 std::cout << "Usage: " << argv[0] << " [options]\n"
                           << "Options:\n"
                           << "  -h, --host HOST     Server host (default: 127.0.0.1)\n"
                           << "  -p, --port PORT     Server port (default: 8080)\n"
+                          << "  -b, --batch FILE    Run the commands in FILE (one per line, - for stdin)\n"
+                          << "                      pipelined on one connection, then exit\n"
+                          << "  -j, --jobs N        With --batch, run up to N commands at once (max 64)\n"
+                          << "  --get REMOTE LOCAL  Download one file, verify its SHA-256, then exit\n"
+                          << "  --put LOCAL REMOTE  Upload one file, verify its SHA-256, then exit\n"
+                          << "  --sync LOCAL REMOTE Update REMOTE (a file or directory tree) to match LOCAL,\n"
+                          << "                      sending only changed blocks, then exit\n"
+                          << "  --archive REMOTE LOCAL\n"
+                          << "                      Save the REMOTE directory as a tar file, then exit\n"
+                          << "  -z, --gzip          With --archive, have the server gzip it\n"
+                          << "  -c, --continue      With --get / --put, resume a partial transfer\n"
+                          << "  -s, --streams N     Split files larger than one chunk over N connections\n"
+                          << "                      (max 16; ignored when resuming)\n"
+                          << "  --chunk-size MB     Bytes per chunk of a split transfer (default: 64)\n"
                           << "  --help              Show this help message\n";
                 return 0;
             } else if (i == 1 && arg.find('-') != 0) {
@@ -50,11 +101,23 @@ int main(int argc, char* argv[]) {
             }
         }
         
-        // Display banner
-        printBanner();
+        std::ifstream file;
+        if (!batch_file.empty() && batch_file != "-") {
+            file.open(batch_file);
+            if (!file) {
+                std::cerr << Color::ROSE << "Cannot open batch file: " << batch_file << Color::RESET << std::endl;
+                return 1;
+            }
+        }
+        
+        // Display banner (batch output is meant for scripts)
+        if (batch_file.empty() && transfer.empty()) {
+            printBanner();
+        }
         
         // Create client
         Client client(host, port);
+        client.setParallelism(streams > 0 ? static_cast<size_t>(streams) : 1, std::max<uint64_t>(chunk_mb, 1) * 1024 * 1024);
         
         // Connect to server
         if (!client.connect()) {
@@ -62,6 +125,27 @@ int main(int argc, char* argv[]) {
             return 1;
         }
         
+        if (!transfer.empty()) {
+            std::string error;
+            Delta::Stats stats;
+            bool ok = transfer == "sync" ? client.sync(source, target, stats, error)
+                    : transfer == "archive" ? client.archive(source, target, gzip, error)
+                    : transfer == "get" ? client.download(source, target, resume, error)
+                                        : client.upload(source, target, resume, error);
+            if (!ok) {
+                std::cerr << Color::ROSE << "Transfer failed: " << error << Color::RESET << std::endl;
+            } else if (transfer == "sync") {
+                std::cout << "Synced " << source << " -> " << target << ": " << stats.describe() << std::endl;
+            }
+            client.disconnect();
+            return ok ? 0 : 1;
+        }
+        
+        if (!batch_file.empty()) {
+            int failed = client.runBatch(batch_file == "-" ? std::cin : file, jobs > 0 ? static_cast<size_t>(jobs) : 0);
+            client.disconnect();
+            return failed > 0 ? 1 : 0;
+        }
         
         client.runInteractiveShell();
         
@@ -0,0 +1,419 @@
+#include "Archive.h"
+#include "Compression.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+namespace Archive {
+
+namespace {
+
+constexpr size_t DIRENT_BUFFER = 32 * 1024;  // getdents64() bytes read per call
+constexpr size_t NAME_FIELD = 100;
+constexpr size_t PREFIX_FIELD = 155;
+
+// Layout of the records getdents64() returns (glibc has no declaration for it)
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    // NUL-terminated name follows
+};
+constexpr size_t DIRENT_NAME = offsetof(LinuxDirent64, d_type) + 1;
+
+void fillEntry(Entry& entry, const struct stat& st, Type type, std::string name) {
+    entry.name = std::move(name);
+    entry.type = type;
+    entry.mode = st.st_mode & 07777;
+    entry.uid = st.st_uid;
+    entry.gid = st.st_gid;
+    entry.size = type == Type::File ? static_cast<uint64_t>(st.st_size) : 0;
+    entry.mtime = st.st_mtime;
+    entry.link.clear();
+    entry.fd = -1;
+}
+
+// Archive name of the walk's root: the last component of path, or "." for "." and "/"
+std::string rootName(const std::string& path) {
+    size_t end = path.find_last_not_of('/');
+    if (end == std::string::npos) {
+        return ".";
+    }
+    size_t slash = path.rfind('/', end);
+    size_t begin = slash == std::string::npos ? 0 : slash + 1;
+    std::string name = path.substr(begin, end + 1 - begin);
+    return name == ".." ? "." : name;
+}
+
+// Write value as a NUL-terminated octal number filling field; base-256 (GNU) when it does not fit
+void putNumber(char* field, size_t width, uint64_t value) {
+    uint64_t limit = width - 1 >= 22 ? UINT64_MAX : (uint64_t(1) << (3 * (width - 1)));
+    if (value < limit) {
+        field[width - 1] = '\0';
+        for (size_t i = width - 1; i-- > 0;) {
+            field[i] = static_cast<char>('0' + (value & 7));
+            value >>= 3;
+        }
+        return;
+    }
+    std::memset(field, 0, width);
+    for (size_t i = width; i-- > 1;) {
+        field[i] = static_cast<char>(value & 0xff);
+        value >>= 8;
+    }
+    field[0] = static_cast<char>(0x80);
+}
+
+void putString(char* field, size_t width, const std::string& value) {
+    std::memcpy(field, value.data(), std::min(value.size(), width));
+}
+
+// One 512-byte header block with its checksum
+std::string block(const std::string& name, const std::string& prefix, char type, mode_t mode,
+                  uid_t uid, gid_t gid, uint64_t size, time_t mtime, const std::string& link, bool gnu) {
+    std::string header(BLOCK_SIZE, '\0');
+    char* h = header.data();
+    putString(h, NAME_FIELD, name);
+    putNumber(h + 100, 8, mode);
+    putNumber(h + 108, 8, uid);
+    putNumber(h + 116, 8, gid);
+    putNumber(h + 124, 12, size);
+    putNumber(h + 136, 12, mtime > 0 ? static_cast<uint64_t>(mtime) : 0);
+    h[156] = type;
+    putString(h + 157, NAME_FIELD, link);
+    // GNU long-name records need the GNU magic for every tar to recognise them
+    std::memcpy(h + 257, gnu ? "ustar  " : "ustar\0" "00", 8);
+    putString(h + 345, PREFIX_FIELD, prefix);
+
+    std::memset(h + 148, ' ', 8);
+    unsigned sum = 0;
+    for (unsigned char c : header) {
+        sum += c;
+    }
+    putNumber(h + 148, 7, sum);
+    h[155] = ' ';
+    return header;
+}
+
+// A GNU 'L' or 'K' record carrying a name too long for the header that follows it
+std::string longName(char type, const std::string& name) {
+    std::string record = block("././@LongLink", "", type, 0, 0, 0, name.size() + 1, 0, "", true);
+    record += name;
+    record.append(1 + padding(name.size() + 1), '\0');
+    return record;
+}
+
+} // namespace
+
+Walker::Walker(int dir_fd, const std::string& path) : root_pending_(true) {
+    int fd = openat(dir_fd, path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error(path + ": " + std::strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        int error = errno;
+        close(fd);
+        throw std::runtime_error(path + ": " + std::strerror(error));
+    }
+    std::string name = rootName(path) + "/";
+    fillEntry(root_, st, Type::Directory, name);
+    descend(fd, name);
+}
+
+Walker::~Walker() {
+    for (Level& level : stack_) {
+        close(level.fd);
+    }
+}
+
+void Walker::descend(int fd, const std::string& prefix) {
+    stack_.push_back(Level{fd, prefix, std::vector<char>(DIRENT_BUFFER), 0, 0});
+}
+
+bool Walker::next(Entry& entry) {
+    if (root_pending_) {
+        root_pending_ = false;
+        entry = root_;
+        return true;
+    }
+    while (!stack_.empty()) {
+        Level& level = stack_.back();
+        if (level.position >= level.length) {
+            long n = syscall(SYS_getdents64, level.fd, level.buffer.data(), level.buffer.size());
+            if (n <= 0) {
+                // End of the directory, or it went away under us: either way nothing more from it
+                close(level.fd);
+                stack_.pop_back();
+                continue;
+            }
+            level.position = 0;
+            level.length = static_cast<size_t>(n);
+        }
+        const char* record = level.buffer.data() + level.position;
+        level.position += reinterpret_cast<const LinuxDirent64*>(record)->d_reclen;
+        const char* name = record + DIRENT_NAME;
+        if (std::strcmp(name, ".") == 0 || std::strcmp(name, "..") == 0) {
+            continue;
+        }
+
+        struct stat st;
+        if (fstatat(level.fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            continue;
+        }
+        std::string path = level.prefix + name;
+        if (S_ISDIR(st.st_mode)) {
+            int fd = openat(level.fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) {
+                continue;
+            }
+            fillEntry(entry, st, Type::Directory, path + "/");
+            descend(fd, entry.name);  // Invalidates level
+            return true;
+        }
+        if (S_ISREG(st.st_mode)) {
+            int fd = openat(level.fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0 || fstat(fd, &st) < 0) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+                continue;
+            }
+            fillEntry(entry, st, Type::File, std::move(path));
+            entry.fd = fd;
+            return true;
+        }
+        if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t length = readlinkat(level.fd, name, target, sizeof(target));
+            if (length < 0) {
+                continue;
+            }
+            fillEntry(entry, st, Type::Symlink, std::move(path));
+            entry.link.assign(target, static_cast<size_t>(length));
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string header(const Entry& entry) {
+    std::string out;
+    std::string name = entry.name;
+    std::string prefix;
+    if (name.size() > NAME_FIELD) {
+        // ustar splits long paths at a '/' into prefix and name
+        size_t slash = name.find('/', name.size() - NAME_FIELD - 1);
+        if (slash != std::string::npos && slash <= PREFIX_FIELD && slash + 1 < name.size()) {
+            prefix = name.substr(0, slash);
+            name = name.substr(slash + 1);
+        } else {
+            out += longName('L', entry.name);
+            name.resize(NAME_FIELD);
+        }
+    }
+    bool gnu = !out.empty();
+    if (entry.link.size() > NAME_FIELD) {
+        out += longName('K', entry.link);
+        gnu = true;
+    }
+    out += block(name, prefix, static_cast<char>(entry.type), entry.mode, entry.uid, entry.gid,
+                 entry.size, entry.mtime, entry.link, gnu);
+    return out;
+}
+
+size_t padding(uint64_t size) {
+    return static_cast<size_t>((BLOCK_SIZE - size % BLOCK_SIZE) % BLOCK_SIZE);
+}
+
+std::string trailer() {
+    return std::string(2 * BLOCK_SIZE, '\0');
+}
+
+bool readPadded(int fd, uint64_t offset, size_t length, std::string& out) {
+    size_t base = out.size();
+    out.resize(base + length);
+    size_t done = 0;
+    while (done < length) {
+        ssize_t count = pread(fd, &out[base + done], length - done, static_cast<off_t>(offset + done));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0) {
+            out.resize(base);
+            return false;
+        }
+        if (count == 0) {
+            std::memset(&out[base + done], 0, length - done);
+            break;
+        }
+        done += static_cast<size_t>(count);
+    }
+    return true;
+}
+
+GzipPipeline::GzipPipeline(std::unique_ptr<Walker> walker, int level, std::function<void()> notify)
+    : walker_(std::move(walker)), level_(level), notify_(std::move(notify)) {
+    reader_ = std::thread(&GzipPipeline::read, this);
+    compressor_ = std::thread(&GzipPipeline::compress, this);
+}
+
+GzipPipeline::~GzipPipeline() {
+    stop();
+    reader_.join();
+    compressor_.join();
+}
+
+// Queue chunk once there is room; false if the pipeline stopped meanwhile
+bool GzipPipeline::push(std::deque<std::string>& queue, std::string& chunk) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [&]() { return queue.size() < PIPELINE_DEPTH || stopped_; });
+    if (stopped_) {
+        return false;
+    }
+    queue.push_back(std::move(chunk));
+    chunk.clear();
+    changed_.notify_all();
+    return true;
+}
+
+void GzipPipeline::fail(const std::string& error) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (error_.empty()) {
+            error_ = error;
+        }
+        stopped_ = true;
+    }
+    changed_.notify_all();
+}
+
+void GzipPipeline::read() {
+    Entry entry;
+    entry.fd = -1;
+    try {
+        std::string chunk;
+        bool open = true;
+        while (open && walker_->next(entry)) {
+            chunk += header(entry);
+            for (uint64_t offset = 0; open && offset < entry.size; ) {
+                if (chunk.size() >= PIPELINE_CHUNK) {
+                    open = push(raw_, chunk);
+                    continue;
+                }
+                size_t length = static_cast<size_t>(std::min<uint64_t>(entry.size - offset, PIPELINE_CHUNK - chunk.size()));
+                if (!readPadded(entry.fd, offset, length, chunk)) {
+                    throw std::runtime_error(entry.name + ": " + std::strerror(errno));
+                }
+                offset += length;
+            }
+            chunk.append(padding(entry.size), '\0');
+            if (entry.fd >= 0) {
+                close(entry.fd);
+                entry.fd = -1;
+            }
+            if (open && chunk.size() >= PIPELINE_CHUNK) {
+                open = push(raw_, chunk);
+            }
+        }
+        if (open) {
+            chunk += trailer();
+            push(raw_, chunk);
+        }
+    } catch (const std::exception& e) {
+        fail(e.what());
+    }
+    if (entry.fd >= 0) {
+        close(entry.fd);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        read_ = true;
+    }
+    changed_.notify_all();
+}
+
+void GzipPipeline::compress() {
+    try {
+        Compression::GzipStream gzip(level_);
+        std::string packed;
+        while (true) {
+            std::string chunk;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                changed_.wait(lock, [this]() { return !raw_.empty() || read_ || stopped_; });
+                if (stopped_ || raw_.empty()) {
+                    break;
+                }
+                chunk = std::move(raw_.front());
+                raw_.pop_front();
+            }
+            changed_.notify_all();
+            
+            gzip.write(chunk, packed);
+            if (!packed.empty()) {
+                if (!push(packed_, packed)) {
+                    break;
+                }
+                notify_();
+            }
+        }
+        
+        bool stopped;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopped = stopped_;
+        }
+        if (!stopped) {
+            gzip.finish(packed);
+            if (push(packed_, packed)) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                compressed_ = true;
+            }
+        }
+    } catch (const std::exception& e) {
+        fail(e.what());
+    }
+    notify_();
+}
+
+bool GzipPipeline::take(std::string& chunk) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (packed_.empty()) {
+            return false;
+        }
+        chunk = std::move(packed_.front());
+        packed_.pop_front();
+    }
+    changed_.notify_all();
+    return true;
+}
+
+bool GzipPipeline::finished() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return (compressed_ && packed_.empty()) || stopped_;
+}
+
+void GzipPipeline::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopped_ = true;
+    }
+    changed_.notify_all();
+}
+
+std::string GzipPipeline::error() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return error_;
+}
+
+} // namespace Archive
@@ -0,0 +1,530 @@
+#include "AsyncSocket.h"
+#include "Colors.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <utility>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+
+AsyncSocket::AsyncSocket(EventLoop& loop, Socket socket)
+    : loop_(loop), socket_(std::move(socket)), splice_fd_(-1), splice_offset_(-1), splice_left_(0),
+      closed_(false), read_paused_(false), error_(0),
+      writer_(nullptr) {
+    socket_.setNonBlocking(true);
+    // Frames are coalesced before sending, so a trailing EXIT frame must not wait on Nagle
+    socket_.setNoDelay(true);
+    loop_.addStream(socket_.get(),
+        [this](const char* data, ssize_t length) { onData(data, length); },
+        [this](uint32_t) { onWritable(); });
+}
+
+AsyncSocket::~AsyncSocket() {
+    loop_.remove(socket_.get());
+}
+
+int AsyncSocket::fd() const {
+    return socket_.get();
+}
+
+bool AsyncSocket::isOpen() const {
+    return !closed_;
+}
+
+// Buffer incoming bytes and wake the reader
+void AsyncSocket::onData(const char* data, ssize_t length) {
+    if (length <= 0) {
+        fail(length < 0 ? static_cast<int>(-length) : 0);
+        return;
+    }
+
+    input_.append(data, length);
+    if (input_.size() >= MAX_BUFFERED_INPUT && !read_paused_) {
+        read_paused_ = true;
+        loop_.setReadPaused(socket_.get(), true);
+    }
+    if (reader_) {
+        loop_.schedule(std::exchange(reader_, nullptr));
+    }
+}
+
+// Continue the current send, then start the next ones
+void AsyncSocket::onWritable() {
+    flush();
+    if (closed_ || sending()) {
+        return;
+    }
+
+    if (writer_) {
+        loop_.schedule(std::exchange(writer_, nullptr)->handle_);
+    }
+    startQueued();
+    if (!sending()) {
+        loop_.setWantWrite(socket_.get(), false);
+    }
+}
+
+bool AsyncSocket::sending() const {
+    return !output_.empty() || splice_left_ > 0;
+}
+
+void AsyncSocket::begin(SendAwaiter& send) {
+    send.started_ = true;
+    output_.append(send.data_);
+    splice_fd_ = send.splice_fd_;
+    splice_offset_ = send.splice_offset_;
+    splice_left_ = send.splice_length_;
+    flush();
+}
+
+// Sends the kernel takes at once complete without waiting for writability
+void AsyncSocket::startQueued() {
+    while (!queued_.empty() && !sending() && !closed_) {
+        SendAwaiter* send = queued_.front();
+        queued_.pop_front();
+        begin(*send);
+        if (sending()) {
+            writer_ = send;
+        } else {
+            loop_.schedule(send->handle_);
+        }
+    }
+}
+
+// Send as much as the socket accepts: queued bytes first, then any pending splice / sendfile
+void AsyncSocket::flush() {
+    while (!closed_) {
+        if (!output_.empty()) {
+            // MSG_MORE lets a frame header share a segment with the spliced payload behind it
+            int flags = MSG_NOSIGNAL | (splice_left_ > 0 ? MSG_MORE : 0);
+            ssize_t sent;
+            try {
+                sent = socket_.send(output_.data(), output_.size(), flags);
+            } catch (const std::exception&) {
+                fail(errno);
+                return;
+            }
+            if (sent < 0) {
+                return;  // Socket buffer full, wait for writability
+            }
+            output_.erase(0, sent);
+            continue;
+        }
+
+        if (splice_left_ == 0) {
+            return;
+        }
+
+        ssize_t moved = splice_offset_ >= 0
+            ? sendfile(socket_.get(), splice_fd_, &splice_offset_, splice_left_)
+            : splice(splice_fd_, nullptr, socket_.get(), nullptr, splice_left_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved > 0) {
+            splice_left_ -= static_cast<size_t>(moved);
+        } else if (moved < 0 && errno == EAGAIN) {
+            return;  // The pipe / file holds the bytes, so the socket is full
+        } else if (moved < 0 && errno == EINVAL) {
+            if (!copySplice()) {
+                return;
+            }
+        } else if (moved < 0 && errno != EINTR) {
+            fail(errno);
+            return;
+        } else if (moved == 0) {
+            fail(EPIPE);  // Pipe ran dry (or the file shrank) before the promised length
+            return;
+        }
+    }
+}
+
+// The header already promised these bytes, so move them the slow way
+bool AsyncSocket::copySplice() {
+    size_t offset = output_.size();
+    output_.resize(offset + splice_left_);
+
+    ssize_t count;
+    do {
+        count = splice_offset_ >= 0
+            ? ::pread(splice_fd_, &output_[offset], splice_left_, splice_offset_)
+            : ::read(splice_fd_, &output_[offset], splice_left_);
+    } while (count < 0 && errno == EINTR);
+
+    if (count <= 0) {
+        output_.resize(offset);
+        fail(count < 0 ? errno : EPIPE);
+        return false;
+    }
+    output_.resize(offset + static_cast<size_t>(count));
+    splice_left_ -= static_cast<size_t>(count);
+    if (splice_offset_ >= 0) {
+        splice_offset_ += count;
+    }
+    return true;
+}
+
+// Peer is gone: nothing more to deliver in either direction
+void AsyncSocket::fail(int error) {
+    if (closed_) {
+        return;
+    }
+    closed_ = true;
+    error_ = error;
+    output_.clear();
+    splice_left_ = 0;
+
+    if (reader_) {
+        loop_.schedule(std::exchange(reader_, nullptr));
+    }
+    if (writer_) {
+        loop_.schedule(std::exchange(writer_, nullptr)->handle_);
+    }
+    for (SendAwaiter* send : queued_) {
+        loop_.schedule(send->handle_);
+    }
+    queued_.clear();
+}
+
+AsyncSocket::RecvAwaiter AsyncSocket::async_recv(std::string& buffer) {
+    return RecvAwaiter(*this, buffer);
+}
+
+AsyncSocket::SendAwaiter AsyncSocket::async_send(std::string_view data) {
+    return SendAwaiter(*this, data, -1, -1, 0);
+}
+
+AsyncSocket::SendAwaiter AsyncSocket::async_splice(std::string_view header, int pipe_fd, size_t length) {
+    return SendAwaiter(*this, header, pipe_fd, -1, length);
+}
+
+AsyncSocket::SendAwaiter AsyncSocket::async_sendfile(std::string_view header, int file_fd, off_t offset, size_t length) {
+    return SendAwaiter(*this, header, file_fd, offset, length);
+}
+
+bool AsyncSocket::RecvAwaiter::await_ready() const {
+    return !socket_.input_.empty() || socket_.closed_;
+}
+
+void AsyncSocket::RecvAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    socket_.reader_ = handle;
+}
+
+ssize_t AsyncSocket::RecvAwaiter::await_resume() {
+    if (socket_.input_.empty()) {
+        return socket_.error_ != 0 ? -socket_.error_ : 0;
+    }
+
+    ssize_t count = static_cast<ssize_t>(socket_.input_.size());
+    buffer_.append(socket_.input_);
+    socket_.input_.clear();
+    if (socket_.read_paused_) {
+        socket_.read_paused_ = false;
+        socket_.loop_.setReadPaused(socket_.fd(), false);
+    }
+    return count;
+}
+
+// An idle socket starts the send right away; it only suspends if the kernel is full
+bool AsyncSocket::SendAwaiter::await_ready() {
+    if (socket_.closed_) {
+        return true;
+    }
+    if (socket_.sending() || !socket_.queued_.empty()) {
+        return false;
+    }
+    socket_.begin(*this);
+    return !socket_.sending() || socket_.closed_;
+}
+
+void AsyncSocket::SendAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    handle_ = handle;
+    if (started_) {
+        socket_.writer_ = this;
+        socket_.loop_.setWantWrite(socket_.socket_.get(), true);
+    } else {
+        socket_.queued_.push_back(this);
+    }
+}
+
+bool AsyncSocket::SendAwaiter::await_resume() const {
+    return !socket_.closed_;
+}
+
+AsyncAcceptor::AsyncAcceptor(EventLoop& loop) : loop_(loop), closed_(false) {}
+
+// Owners destroy suspended waiters themselves, so nobody is woken here
+AsyncAcceptor::~AsyncAcceptor() {
+    for (Socket& listener : listeners_) {
+        loop_.remove(listener.get());
+    }
+    abandon();
+}
+
+void AsyncAcceptor::listen(Socket listener, bool exclusive) {
+    listener.setNonBlocking(true);
+    loop_.addAcceptor(listener.get(), exclusive, [this](int fd) { onAccept(fd); });
+    listeners_.push_back(std::move(listener));
+}
+
+// Queue a client and wake the acceptor coroutine
+void AsyncAcceptor::onAccept(int fd) {
+    if (fd < 0) {
+        // Transient (EMFILE, ENOBUFS, ...): keep listening
+        std::cerr << Color::ROSE << "Accept failed: " << strerror(-fd) << Color::RESET << std::endl;
+        return;
+    }
+    if (closed_) {
+        ::close(fd);
+        return;
+    }
+
+    pending_.push_back(fd);
+    if (waiter_) {
+        loop_.schedule(std::exchange(waiter_, nullptr));
+    }
+}
+
+// Clients the loop already accepted are still handed out
+void AsyncAcceptor::close() {
+    for (Socket& listener : listeners_) {
+        loop_.remove(listener.get());
+    }
+    listeners_.clear();
+    closed_ = true;
+
+    if (waiter_) {
+        loop_.schedule(std::exchange(waiter_, nullptr));
+    }
+}
+
+void AsyncAcceptor::abandon() {
+    listeners_.clear();
+    for (int fd : pending_) {
+        ::close(fd);
+    }
+    pending_.clear();
+    closed_ = true;
+}
+
+bool AsyncAcceptor::isOpen() const {
+    return !closed_;
+}
+
+AsyncAcceptor::AcceptAwaiter AsyncAcceptor::async_accept() {
+    return AcceptAwaiter(*this);
+}
+
+bool AsyncAcceptor::AcceptAwaiter::await_ready() const {
+    return !acceptor_.pending_.empty() || acceptor_.closed_;
+}
+
+void AsyncAcceptor::AcceptAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    acceptor_.waiter_ = handle;
+}
+
+Socket AsyncAcceptor::AcceptAwaiter::await_resume() {
+    if (acceptor_.pending_.empty()) {
+        return Socket();
+    }
+
+    int fd = acceptor_.pending_.front();
+    acceptor_.pending_.pop_front();
+    return Socket(fd);
+}
+
+AsyncPipe::AsyncPipe(EventLoop& loop, int fd) : loop_(loop), fd_(fd), reader_(nullptr) {
+    int flags = fcntl(fd_, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd_, F_SETFL, flags | O_NONBLOCK) < 0) {
+        ::close(fd_);
+        throw std::runtime_error(std::string("Failed to set pipe non-blocking: ") + strerror(errno));
+    }
+}
+
+AsyncPipe::~AsyncPipe() {
+    if (reader_) {
+        loop_.remove(fd_);
+    }
+    ::close(fd_);
+}
+
+// Read straight into the caller's buffer
+ssize_t AsyncPipe::readInto(std::string& buffer, size_t max) {
+    size_t offset = buffer.size();
+    buffer.resize(offset + max);
+
+    ssize_t count;
+    do {
+        count = ::read(fd_, &buffer[offset], max);
+    } while (count < 0 && errno == EINTR);
+
+    buffer.resize(offset + (count > 0 ? static_cast<size_t>(count) : 0));
+    return count >= 0 ? count : -errno;
+}
+
+// FIONREAD cannot tell an empty pipe from a closed one; poll can
+ssize_t AsyncPipe::available() {
+    int count = 0;
+    if (ioctl(fd_, FIONREAD, &count) < 0) {
+        return -errno;
+    }
+    if (count > 0) {
+        return count;
+    }
+
+    pollfd pfd;
+    pfd.fd = fd_;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (::poll(&pfd, 1, 0) > 0) {
+        // Data may have landed just before the writer closed
+        if (ioctl(fd_, FIONREAD, &count) == 0 && count > 0) {
+            return count;
+        }
+        if (pfd.revents & (POLLHUP | POLLERR)) {
+            return 0;
+        }
+    }
+    return -EAGAIN;
+}
+
+ssize_t AsyncPipe::attempt(ReadAwaiter& reader) {
+    return reader.buffer_ ? readInto(*reader.buffer_, reader.max_) : available();
+}
+
+// Complete the suspended operation, unless the wakeup was spurious
+void AsyncPipe::onReadable() {
+    if (!reader_) {
+        return;
+    }
+
+    ssize_t count = attempt(*reader_);
+    if (count == -EAGAIN) {
+        return;
+    }
+
+    ReadAwaiter* reader = std::exchange(reader_, nullptr);
+    reader->result_ = count;
+    loop_.remove(fd_);
+    loop_.schedule(reader->handle_);
+}
+
+int AsyncPipe::fd() const {
+    return fd_;
+}
+
+AsyncPipe::ReadAwaiter AsyncPipe::async_read(std::string& buffer, size_t max) {
+    return ReadAwaiter(*this, &buffer, max);
+}
+
+AsyncPipe::ReadAwaiter AsyncPipe::async_wait() {
+    return ReadAwaiter(*this, nullptr, 0);
+}
+
+// Data already buffered in the pipe is handled without touching the loop
+bool AsyncPipe::ReadAwaiter::await_ready() {
+    result_ = pipe_.attempt(*this);
+    return result_ != -EAGAIN;
+}
+
+void AsyncPipe::ReadAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    handle_ = handle;
+    pipe_.reader_ = this;
+    pipe_.loop_.add(pipe_.fd_, EPOLLIN, [pipe = &pipe_](uint32_t) { pipe->onReadable(); });
+}
+
+ssize_t AsyncPipe::ReadAwaiter::await_resume() const {
+    return result_;
+}
+
+AsyncPipeWriter::AsyncPipeWriter(EventLoop& loop, int fd) : loop_(loop), fd_(fd), writer_(nullptr) {}
+
+AsyncPipeWriter::~AsyncPipeWriter() {
+    if (writer_) {
+        loop_.remove(fd_);
+    }
+}
+
+bool AsyncPipeWriter::attempt(WriteAwaiter& writer) {
+    while (!writer.data_.empty()) {
+        ssize_t count = ::write(fd_, writer.data_.data(), writer.data_.size());
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return false;
+        }
+        if (count <= 0) {
+            writer.result_ = false;
+            return true;
+        }
+        writer.data_.remove_prefix(static_cast<size_t>(count));
+    }
+    writer.result_ = true;
+    return true;
+}
+
+// Continue the suspended write, and resume the writer once it is done
+void AsyncPipeWriter::onWritable() {
+    if (!writer_ || !attempt(*writer_)) {
+        return;
+    }
+
+    WriteAwaiter* writer = std::exchange(writer_, nullptr);
+    loop_.remove(fd_);
+    loop_.schedule(writer->handle_);
+}
+
+AsyncPipeWriter::WriteAwaiter AsyncPipeWriter::async_write(std::string_view data) {
+    return WriteAwaiter(*this, data);
+}
+
+// Data the pipe takes at once is written without touching the loop
+bool AsyncPipeWriter::WriteAwaiter::await_ready() {
+    return pipe_.attempt(*this);
+}
+
+void AsyncPipeWriter::WriteAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    handle_ = handle;
+    pipe_.writer_ = this;
+    pipe_.loop_.add(pipe_.fd_, EPOLLOUT, [pipe = &pipe_](uint32_t) { pipe->onWritable(); });
+}
+
+bool AsyncPipeWriter::WriteAwaiter::await_resume() const {
+    return result_;
+}
+
+AsyncExit::AsyncExit(EventLoop& loop, int fd) : loop_(loop), fd_(fd) {}
+
+AsyncExit::~AsyncExit() {
+    if (waiter_) {
+        loop_.remove(fd_);
+    }
+}
+
+void AsyncExit::onReadable() {
+    if (!waiter_) {
+        return;
+    }
+    loop_.remove(fd_);
+    loop_.schedule(std::exchange(waiter_, nullptr));
+}
+
+AsyncExit::ExitAwaiter AsyncExit::async_wait() {
+    return ExitAwaiter(*this);
+}
+
+// A program that has already exited is reaped without touching the loop
+bool AsyncExit::ExitAwaiter::await_ready() {
+    pollfd pfd;
+    pfd.fd = exit_.fd_;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return ::poll(&pfd, 1, 0) > 0;
+}
+
+void AsyncExit::ExitAwaiter::await_suspend(std::coroutine_handle<> handle) {
+    exit_.waiter_ = handle;
+    exit_.loop_.add(exit_.fd_, EPOLLIN, [exit = &exit_](uint32_t) { exit->onReadable(); });
+}
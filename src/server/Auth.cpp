@@ -4,16 +4,112 @@
 #include <sstream>
 #include <iomanip>
 #include <random>
+#include <cstdio>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/sha.h>
 #include <openssl/rand.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 
+namespace {
+
+const std::string KDF_PREFIX = "pbkdf2-sha256$";
+constexpr size_t KDF_LENGTH = 32;
+
+std::string hexString(const unsigned char* bytes, size_t length) {
+    std::ostringstream oss;
+    for (size_t i = 0; i < length; i++) {
+        oss << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(bytes[i]);
+    }
+    return oss.str();
+}
+
+// PBKDF2-HMAC-SHA256 of password, as hex
+std::string pbkdf2(const std::string& password, const std::string& salt, int iterations) {
+    unsigned char key[KDF_LENGTH];
+    if (PKCS5_PBKDF2_HMAC(password.data(), static_cast<int>(password.size()),
+                          reinterpret_cast<const unsigned char*>(salt.data()), static_cast<int>(salt.size()),
+                          iterations, EVP_sha256(), sizeof(key), key) != 1) {
+        throw std::runtime_error("PBKDF2 failed");
+    }
+    return hexString(key, sizeof(key));
+}
+
+// Parse "username:entry" lines, skipping blanks and comments
+void parseUsers(std::istream& in, std::map<std::string, std::string>& users) {
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::istringstream iss(line);
+        std::string username, salt_and_hash;
+        if (std::getline(iss, username, ':') && std::getline(iss, salt_and_hash)) {
+            users[username] = salt_and_hash;
+        }
+    }
+}
+
+// Write all of data to fd
+bool writeAll(int fd, const std::string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t count = ::write(fd, data.data() + written, data.size() - written);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        written += static_cast<size_t>(count);
+    }
+    return true;
+}
+
+// Comparison whose time does not depend on where the hashes differ
+bool sameHash(const std::string& a, const std::string& b) {
+    return a.size() == b.size() && CRYPTO_memcmp(a.data(), b.data(), a.size()) == 0;
+}
+
+} // namespace
+
 // Constructor
 Auth::Auth(const std::string& users_file, int timeout_minutes)
-    : users_file_(users_file), session_timeout_minutes_(timeout_minutes) {
+    : users_file_(users_file), session_timeout_minutes_(timeout_minutes),
+      kdf_iterations_(DEFAULT_KDF_ITERATIONS), cache_lifetime_(DEFAULT_CACHE_SECONDS) {
+    if (RAND_bytes(cache_key_, sizeof(cache_key_)) != 1) {
+        throw std::runtime_error("Failed to generate login cache key");
+    }
     loadUsers();
 }
 
+// Set the PBKDF2 cost
+void Auth::setKdfIterations(int iterations) {
+    kdf_iterations_ = std::max(iterations, MIN_KDF_ITERATIONS);
+}
+
+// Set how long verified logins are cached
+void Auth::setCacheLifetime(std::chrono::seconds lifetime) {
+    cache_lifetime_ = std::max(lifetime, std::chrono::seconds(0));
+}
+
+// Tools that only manage users never create the session file
+SessionStore& Auth::sessions() const {
+    std::call_once(sessions_opened_, [this]() {
+        size_t slash = users_file_.find_last_of('/');
+        std::string dir = slash == std::string::npos ? "." : users_file_.substr(0, slash);
+        sessions_ = std::make_unique<SessionStore>(dir + "/sessions.db", std::chrono::minutes(session_timeout_minutes_));
+    });
+    return *sessions_;
+}
+
 // Load users from file
 void Auth::loadUsers() {
     std::ifstream file(users_file_);
@@ -24,24 +120,85 @@ void Auth::loadUsers() {
         return;
     }
 
-    std::string line;
-    while (std::getline(file, line)) {
-        // Skip empty lines and comments
-        if (line.empty() || line[0] == '#') {
-            continue;
+    // Parse lines: username:salt:hash
+    parseUsers(file, users_);
+
+    file.close();
+    std::cout << "Loaded " << users_.size() << " users from " << users_file_ << std::endl;
+}
+
+// Lock, re-read, update and replace the users file
+bool Auth::rewriteUsers(const std::function<bool(std::map<std::string, std::string>&)>& update) {
+    // The lock must be on the file that is current once we hold it: a writer that held it
+    // before us has renamed a new file over the one we opened
+    int fd = -1;
+    struct stat held;
+    for (;;) {
+        fd = open(users_file_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            std::cerr << "Error: Could not open users file: " << users_file_ << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        int locked;
+        do {
+            locked = flock(fd, LOCK_EX);
+        } while (locked < 0 && errno == EINTR);
+
+        struct stat named;
+        if (locked == 0 && fstat(fd, &held) == 0 && stat(users_file_.c_str(), &named) == 0 &&
+            held.st_dev == named.st_dev && held.st_ino == named.st_ino) {
+            break;
         }
+        ::close(fd);
+        if (locked < 0) {
+            std::cerr << "Error: Could not lock users file: " << users_file_ << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+    }
 
-        // Parse line: username:salt:hash
-        std::istringstream iss(line);
-        std::string username, salt_and_hash;
-        
-        if (std::getline(iss, username, ':') && std::getline(iss, salt_and_hash)) {
-            users_[username] = salt_and_hash;
+    std::string contents;
+    char chunk[4096];
+    ssize_t count;
+    while ((count = ::read(fd, chunk, sizeof(chunk))) > 0 || (count < 0 && errno == EINTR)) {
+        if (count > 0) {
+            contents.append(chunk, static_cast<size_t>(count));
         }
     }
 
-    file.close();
-    std::cout << "Loaded " << users_.size() << " users from " << users_file_ << std::endl;
+    std::map<std::string, std::string> entries;
+    std::istringstream in(contents);
+    parseUsers(in, entries);
+    if (count < 0 || !update(entries)) {
+        ::close(fd);  // Releases the lock
+        return count == 0;
+    }
+
+    std::string out = "# User authentication file\n"
+                      "# Format: username:pbkdf2-sha256$iterations$salt$hash (or legacy username:salt:hash)\n"
+                      "# DO NOT EDIT MANUALLY\n\n";
+    for (const auto& [username, salt_and_hash] : entries) {
+        out += username + ":" + salt_and_hash + "\n";
+    }
+
+    // Written aside in the same directory and renamed over, so readers see the old file or the new one
+    std::string temp_file = users_file_ + ".XXXXXX";
+    int temp_fd = mkostemp(&temp_file[0], O_CLOEXEC);
+    bool saved = temp_fd >= 0 && fchmod(temp_fd, held.st_mode & 07777) == 0 && writeAll(temp_fd, out) &&
+                 fsync(temp_fd) == 0;
+    if (temp_fd >= 0 && ::close(temp_fd) != 0) {
+        saved = false;
+    }
+    if (saved) {
+        saved = std::rename(temp_file.c_str(), users_file_.c_str()) == 0;
+    }
+    if (!saved) {
+        std::cerr << "Error: Could not write users file: " << users_file_ << ": " << strerror(errno) << std::endl;
+        if (temp_fd >= 0) {
+            std::remove(temp_file.c_str());
+        }
+    }
+    ::close(fd);
+    return saved;
 }
 
 // Save users to file
@@ -49,24 +206,18 @@ void Auth::saveUsers() {
     // Create data directory if it doesn't exist
     mkdir("data", 0755);
 
-    std::ofstream file(users_file_);
-    
-    if (!file.is_open()) {
-        std::cerr << "Error: Could not open users file for writing: " << users_file_ << std::endl;
-        return;
-    }
-
-    file << "# User authentication file" << std::endl;
-    file << "# Format: username:salt:hash" << std::endl;
-    file << "# DO NOT EDIT MANUALLY" << std::endl;
-    file << std::endl;
-
-    for (const auto& [username, salt_and_hash] : users_) {
-        file << username << ":" << salt_and_hash << std::endl;
+    // Users another process added since we loaded the file are kept
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool saved = rewriteUsers([this](std::map<std::string, std::string>& entries) {
+        for (const auto& [username, salt_and_hash] : users_) {
+            entries[username] = salt_and_hash;
+        }
+        users_ = entries;
+        return true;
+    });
+    if (saved) {
+        std::cout << "Saved " << users_.size() << " users to " << users_file_ << std::endl;
     }
-
-    file.close();
-    std::cout << "Saved " << users_.size() << " users to " << users_file_ << std::endl;
 }
 
 // Generate random salt (16 bytes)
@@ -86,21 +237,92 @@ std::string Auth::generateSalt() {
     return oss.str();
 }
 
-// Hash password with salt using SHA-256
-std::string Auth::hashPassword(const std::string& password, const std::string& salt) {
-    std::string salted = salt + password;
+// Hash password with a fresh salt using PBKDF2
+std::string Auth::hashPassword(const std::string& password) const {
+    std::string salt = generateSalt();
+    return KDF_PREFIX + std::to_string(kdf_iterations_) + "$" + salt + "$" + pbkdf2(password, salt, kdf_iterations_);
+}
+
+// Verify password against a stored entry
+bool Auth::verifyPassword(const std::string& password, const std::string& stored, int& iterations) {
+    iterations = 0;
+    
+    // Current format: pbkdf2-sha256$iterations$salt$hash
+    if (stored.compare(0, KDF_PREFIX.size(), KDF_PREFIX) == 0) {
+        size_t salt_pos = stored.find('$', KDF_PREFIX.size());
+        size_t hash_pos = salt_pos == std::string::npos ? std::string::npos : stored.find('$', salt_pos + 1);
+        if (hash_pos == std::string::npos) {
+            return false;
+        }
+        try {
+            iterations = std::stoi(stored.substr(KDF_PREFIX.size(), salt_pos - KDF_PREFIX.size()));
+        } catch (const std::exception&) {
+            return false;
+        }
+        if (iterations < 1) {
+            return false;
+        }
+        std::string salt = stored.substr(salt_pos + 1, hash_pos - salt_pos - 1);
+        return sameHash(pbkdf2(password, salt, iterations), stored.substr(hash_pos + 1));
+    }
     
+    // Legacy format: salt:hash with hash = SHA256(salt + password)
+    size_t delimiter_pos = stored.find(':');
+    if (delimiter_pos == std::string::npos) {
+        return false;
+    }
+    std::string salted = stored.substr(0, delimiter_pos) + password;
     unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256(reinterpret_cast<const unsigned char*>(salted.c_str()), 
-           salted.length(), hash);
+    SHA256(reinterpret_cast<const unsigned char*>(salted.c_str()), salted.length(), hash);
+    return sameHash(hexString(hash, sizeof(hash)), stored.substr(delimiter_pos + 1));
+}
 
-    // Convert to hex string
-    std::ostringstream oss;
-    for (unsigned char byte : hash) {
-        oss << std::hex << std::setw(2) << std::setfill('0') << static_cast<int>(byte);
+// Keyed hash of a login; the password itself is never kept
+std::string Auth::cacheKey(const std::string& username, const std::string& stored, const std::string& password) const {
+    std::string material = username + '\0' + stored + '\0' + password;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    if (!HMAC(EVP_sha256(), cache_key_, sizeof(cache_key_), reinterpret_cast<const unsigned char*>(material.data()),
+              material.size(), digest, &length)) {
+        throw std::runtime_error("HMAC failed");
     }
+    OPENSSL_cleanse(material.data(), material.size());
+    return std::string(reinterpret_cast<const char*>(digest), length);
+}
 
-    return oss.str();
+// Check the login cache
+bool Auth::recentlyVerified(const std::string& key) {
+    if (cache_lifetime_.count() == 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    auto it = verified_.find(key);
+    if (it == verified_.end()) {
+        return false;
+    }
+    if (it->second <= std::chrono::steady_clock::now()) {
+        verified_.erase(it);
+        return false;
+    }
+    return true;
+}
+
+// Add a successful login to the cache
+void Auth::rememberVerified(const std::string& key) {
+    if (cache_lifetime_.count() == 0) {
+        return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    if (verified_.size() >= MAX_CACHED_LOGINS) {
+        for (auto it = verified_.begin(); it != verified_.end();) {
+            it = it->second <= now ? verified_.erase(it) : std::next(it);
+        }
+        if (verified_.size() >= MAX_CACHED_LOGINS) {
+            verified_.erase(verified_.begin());
+        }
+    }
+    verified_[key] = now + cache_lifetime_;
 }
 
 // Generate random session token
@@ -122,42 +344,65 @@ std::string Auth::generateToken() {
 
 // Authenticate user with username and password
 std::string Auth::authenticate(const std::string& username, const std::string& password) {
-    // Check if user exists
-    auto it = users_.find(username);
-    if (it == users_.end()) {
-        return "";
-    }
-
-    // Parse stored salt:hash
-    std::string stored = it->second;
-    size_t delimiter_pos = stored.find(':');
-    
-    if (delimiter_pos == std::string::npos) {
-        return "";
+    // Copy the entry out; the KDF runs unlocked so logins verify in parallel
+    std::string stored;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = users_.find(username);
+        if (it == users_.end()) {
+            return "";
+        }
+        stored = it->second;
     }
 
-    std::string salt = stored.substr(0, delimiter_pos);
-    std::string stored_hash = stored.substr(delimiter_pos + 1);
-
-    // Hash provided password with stored salt
-    std::string computed_hash = hashPassword(password, salt);
-
-    // Compare hashes
-    if (computed_hash != stored_hash) {
-        return "";
+    // A login that succeeded moments ago skips the KDF
+    if (!recentlyVerified(cacheKey(username, stored, password))) {
+        int iterations = 0;
+        if (!verifyPassword(password, stored, iterations)) {
+            return "";
+        }
+        
+        // Legacy SHA-256 entry, or one hashed at another cost: rehash while the password is at hand.
+        // Only an entry still as we verified it is replaced; one another process has already
+        // upgraded (a forked client's parent never sees its children's upgrades) is adopted instead
+        if (iterations != kdf_iterations_) {
+            std::string current;
+            bool upgraded = false;
+            bool written = rewriteUsers([&](std::map<std::string, std::string>& entries) {
+                auto it = entries.find(username);
+                if (it == entries.end()) {
+                    return false;
+                }
+                if (it->second != stored) {
+                    current = it->second;
+                    return false;
+                }
+                current = it->second = hashPassword(password);
+                upgraded = true;
+                return true;
+            });
+            if (upgraded && !written) {
+                current.clear();
+                upgraded = false;
+            }
+            if (!current.empty()) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = users_.find(username);
+                if (it != users_.end() && it->second == stored) {
+                    it->second = current;
+                }
+            }
+            if (upgraded) {
+                stored = current;
+                std::cout << "Upgraded password hash for user: " << username << std::endl;
+            }
+        }
+        rememberVerified(cacheKey(username, stored, password));
     }
 
     // Authentication successful - create session
     std::string token = generateToken();
-    
-    Session session;
-    session.username = username;
-    session.token = token;
-    session.created_at = std::chrono::system_clock::now();
-    session.last_activity = session.created_at;
-    session.is_valid = true;
-
-    sessions_[token] = session;
+    sessions().insert(token, username);
     
     return token;
 }
@@ -173,21 +418,14 @@ bool Auth::isSessionExpired(const Session& session) const {
 
 // Validate a session token
 bool Auth::validateToken(const std::string& token) {
-    auto it = sessions_.find(token);
-    
-    if (it == sessions_.end()) {
-        return false;
-    }
-
-    Session& session = it->second;
-
-    if (!session.is_valid) {
+    Session session;
+    if (!sessions().find(token, session)) {
         return false;
     }
 
     if (isSessionExpired(session)) {
         std::cout << "Session expired for user: " << session.username << std::endl;
-        session.is_valid = false;
+        sessions().erase(token);
         return false;
     }
 
@@ -196,10 +434,10 @@ bool Auth::validateToken(const std::string& token) {
 
 // Get username from session token
 std::string Auth::getUsernameFromToken(const std::string& token) {
-    auto it = sessions_.find(token);
+    Session session;
     
-    if (it != sessions_.end()) {
-        return it->second.username;
+    if (sessions().find(token, session)) {
+        return session.username;
     }
     
     return "";
@@ -207,51 +445,53 @@ std::string Auth::getUsernameFromToken(const std::string& token) {
 
 // Revoke/logout a session
 void Auth::revokeToken(const std::string& token) {
-    auto it = sessions_.find(token);
+    std::string username = getUsernameFromToken(token);
     
-    if (it != sessions_.end()) {
-        std::cout << "Session revoked for user: " << it->second.username << std::endl;
-        sessions_.erase(it);
+    if (sessions().erase(token)) {
+        std::cout << "Session revoked for user: " << username << std::endl;
     }
 }
 
 // Update session activity timestamp
 void Auth::updateActivity(const std::string& token) {
-    auto it = sessions_.find(token);
+    sessions().touch(token);
+}
+
+// Remember where the session is, for a later resume
+void Auth::setWorkingDirectory(const std::string& token, const std::string& dir) {
+    sessions().setWorkingDirectory(token, dir);
+}
+
+// Get the session's working directory
+std::string Auth::getWorkingDirectory(const std::string& token) {
+    Session session;
     
-    if (it != sessions_.end()) {
-        it->second.last_activity = std::chrono::system_clock::now();
+    if (sessions().find(token, session)) {
+        return session.working_dir;
     }
+    
+    return "";
 }
 
 // Clean up expired sessions
 void Auth::cleanupExpiredSessions() {
-    auto it = sessions_.begin();
-    
-    while (it != sessions_.end()) {
-        if (isSessionExpired(it->second)) {
-            std::cout << "Cleaning up expired session for user: " << it->second.username << std::endl;
-            it = sessions_.erase(it);
-        } else {
-            ++it;
-        }
+    for (const std::string& username : sessions().sweep()) {
+        std::cout << "Cleaning up expired session for user: " << username << std::endl;
     }
 }
 
 // Add a new user
 bool Auth::addUser(const std::string& username, const std::string& password) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
     // Check if user already exists
     if (users_.find(username) != users_.end()) {
         std::cerr << "Error: User '" << username << "' already exists" << std::endl;
         return false;
     }
 
-    // Generate salt and hash password
-    std::string salt = generateSalt();
-    std::string hash = hashPassword(password, salt);
-
-    // Store as salt:hash
-    users_[username] = salt + ":" + hash;
+    // Store as pbkdf2-sha256$iterations$salt$hash
+    users_[username] = hashPassword(password);
 
     std::cout << "User '" << username << "' added successfully" << std::endl;
     
@@ -260,5 +500,5 @@ bool Auth::addUser(const std::string& username, const std::string& password) {
 
 // Get active session count
 size_t Auth::getActiveSessionCount() const {
-    return sessions_.size();
+    return sessions().count();
 }
@@ -1,24 +1,172 @@
 #include "CommandExecutor.h"
-#include <iostream>
-#include <sstream>
+#include "Spawner.h"
 #include <cstring>
+#include <stdexcept>
+#include <unordered_set>
 #include <unistd.h>
+#include <spawn.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <signal.h>
 
 constexpr size_t PIPE_BUFFER_SIZE = 4096;
+constexpr int PIPE_CAPACITY = 1024 * 1024;
 
-// Tokanize the command stroing
-std::vector<std::string> CommandExecutor::parseCommand(const std::string& command) {
-    std::vector<std::string> tokens;
-    std::istringstream iss(command);
-    std::string token;
+namespace {
+
+// Builtins that change the shell's state; the shell finds them even when the name is quoted
+const std::unordered_set<std::string> SHELL_BUILTINS = {
+    ".", ":", "alias", "bg", "break", "cd", "command", "continue", "eval", "exec", "exit", "export",
+    "fc", "fg", "getopts", "hash", "jobs", "local", "read", "readonly", "return", "set", "shift",
+    "source", "times", "trap", "type", "ulimit", "umask", "unalias", "unset", "wait"
+};
+
+// Reserved words; quoted, they are ordinary command names
+const std::unordered_set<std::string> RESERVED_WORDS = {
+    "!", "{", "}", "[[", "case", "do", "done", "elif", "else", "esac", "fi", "for", "function",
+    "if", "in", "select", "then", "until", "while"
+};
+
+} // namespace
+
+// Tokenize the command string
+bool CommandExecutor::parseCommand(const std::string& command, std::vector<std::string>& words) {
+    words.clear();
+    std::string word;
+    bool in_word = false;      // Also true for a word that is just "" or ''
+    bool first_quoted = false; // The command name had quotes, so it cannot be an assignment or reserved word
+    
+    for (size_t i = 0; i < command.size(); i++) {
+        char c = command[i];
+        switch (c) {
+            case ' ':
+            case '\t':
+                if (in_word) {
+                    words.push_back(std::move(word));
+                    word.clear();
+                    in_word = false;
+                }
+                continue;
+            
+            case '\\':
+                // Escapes the next character; a trailing backslash or line continuation is the shell's
+                if (i + 1 >= command.size() || command[i + 1] == '\n') {
+                    return false;
+                }
+                word += command[++i];
+                break;
+            
+            case '\'': {
+                size_t close = command.find('\'', i + 1);
+                if (close == std::string::npos) {
+                    return false;
+                }
+                word.append(command, i + 1, close - i - 1);
+                i = close;
+                break;
+            }
+            
+            case '"':
+                // Literal apart from backslash escapes; expansions need the shell
+                for (i++; i < command.size() && command[i] != '"'; i++) {
+                    if (command[i] == '$' || command[i] == '`') {
+                        return false;
+                    }
+                    if (command[i] == '\\' && i + 1 < command.size() &&
+                        (command[i + 1] == '"' || command[i + 1] == '\\' || command[i + 1] == '$' || command[i + 1] == '`')) {
+                        i++;
+                    } else if (command[i] == '\\' && i + 1 < command.size() && command[i + 1] == '\n') {
+                        return false;
+                    }
+                    word += command[i];
+                }
+                if (i >= command.size()) {
+                    return false;
+                }
+                break;
+            
+            // Operators, redirections, expansions and globs
+            case '|': case '&': case ';': case '<': case '>': case '(': case ')':
+            case '$': case '`': case '*': case '?': case '[': case '\n': case '\r':
+                return false;
+            
+            case '#':
+            case '~':
+                // Comment or tilde expansion at the start of a word
+                if (!in_word) {
+                    return false;
+                }
+                word += c;
+                break;
+            
+            case '=':
+                // NAME=value before the command is an assignment
+                if (words.empty() && !first_quoted) {
+                    return false;
+                }
+                word += c;
+                break;
+            
+            default:
+                word += c;
+                break;
+        }
+        if (c == '\\' || c == '\'' || c == '"') {
+            if (words.empty()) {
+                first_quoted = true;
+            }
+        }
+        in_word = true;
+    }
+    if (in_word) {
+        words.push_back(std::move(word));
+    }
+    
+    return !words.empty() && SHELL_BUILTINS.count(words.front()) == 0 &&
+           (first_quoted || RESERVED_WORDS.count(words.front()) == 0);
+}
+
+// Find name on PATH, reusing an earlier answer while it still holds
+std::string CommandExecutor::PathCache::resolve(const std::string& name) {
+    const char* env = getenv("PATH");
+    std::string path = env ? env : "/usr/local/bin:/usr/bin:/bin";
+    if (path != path_) {
+        entries_.clear();
+        path_ = path;
+    }
     
-    while (iss >> token) {
-        tokens.push_back(token);
+    struct stat st;
+    auto it = entries_.find(name);
+    if (it != entries_.end()) {
+        if (stat(it->second.file.c_str(), &st) == 0 && st.st_dev == it->second.device && st.st_ino == it->second.inode) {
+            return it->second.file;
+        }
+        entries_.erase(it);
     }
     
-    return tokens;
+    size_t start = 0;
+    while (start <= path.size()) {
+        size_t end = path.find(':', start);
+        if (end == std::string::npos) {
+            end = path.size();
+        }
+        std::string dir = path.substr(start, end - start);
+        start = end + 1;
+        
+        // A relative entry depends on the session directory; leave the search to the shell
+        if (dir.empty() || dir[0] != '/') {
+            return "";
+        }
+        std::string file = dir + "/" + name;
+        if (stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(file.c_str(), X_OK) == 0) {
+            entries_[name] = Entry{file, st.st_dev, st.st_ino};
+            return file;
+        }
+    }
+    return "";
 }
 
 // Read all data from pipe
@@ -35,119 +183,253 @@ std::string CommandExecutor::readFromPipe(int fd) {
 }
 
 // Execute command 
-CommandExecutor::Result CommandExecutor::execute(const std::string& command) {
-    Result result;
-    result.success = false;
-    result.exit_code = -1;
+CommandExecutor::Result CommandExecutor::execute(const std::string& command, int dir_fd) {
+    Process process;
+    try {
+        process = spawn(command, dir_fd);
+    } catch (const std::exception& e) {
+        Result result;
+        result.output = std::string("Error: ") + e.what() + "\n";
+        result.exit_code = -1;
+        result.success = false;
+        return result;
+    }
+    
+    // Read output from pipe
+    std::string output = readFromPipe(process.output_fd);
+    close(process.output_fd);
     
+    // Wait for grandchild to finish
+    Result result = wait(process);
+    result.output = output + result.output;
+    return result;
+}
+
+// Start the command with its output on a pipe
+CommandExecutor::Process CommandExecutor::spawn(const std::string& command, int dir_fd, PathCache* paths,
+                                                bool deferred) {
     // Trim command
     std::string trimmed = command;
     size_t start = trimmed.find_first_not_of(" \t\n\r");
     size_t end = trimmed.find_last_not_of(" \t\n\r");
     
     if (start == std::string::npos) {
-        result.output = "Error: Empty command\n";
-        return result;
+        throw std::runtime_error("Empty command");
     }
     
     trimmed = trimmed.substr(start, end - start + 1);
     
-    // Tokanize command
-    std::vector<std::string> tokens = parseCommand(trimmed);
-    
-    if (tokens.empty()) {
-        result.output = "Error: Empty command\n";
-        return result;
+    // A plain program with arguments is exec'd directly, saving the shell's own exec
+    std::vector<std::string> words;
+    std::string executable;
+    if (parseCommand(trimmed, words)) {
+        if (words.front().find('/') != std::string::npos) {
+            // Relative to the session directory, as the shell would take it
+            int base = dir_fd >= 0 ? dir_fd : AT_FDCWD;
+            struct stat st;
+            if (fstatat(base, words.front().c_str(), &st, 0) == 0 && S_ISREG(st.st_mode) &&
+                faccessat(base, words.front().c_str(), X_OK, 0) == 0) {
+                executable = words.front();
+            }
+        } else if (paths) {
+            executable = paths->resolve(words.front());
+        } else {
+            executable = PathCache().resolve(words.front());
+        }
     }
     
     // Create pipe for capturing output
+    // Close-on-exec, so commands of other sessions never hold this pipe open
     int pipefd[2];
-    if (pipe(pipefd) < 0) {
-        result.output = "Error: Failed to create pipe: ";
-        result.output += strerror(errno);
-        result.output += "\n";
-        return result;
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        throw std::runtime_error(std::string("Failed to create pipe: ") + strerror(errno));
     }
     
-    // Fork to create grandchild process
-    pid_t pid = fork();
+    // A deeper pipe lets bulk output move in fewer, larger chunks (best effort: capped by pipe-max-size)
+    fcntl(pipefd[0], F_SETPIPE_SZ, PIPE_CAPACITY);
+    
+    // Anything else (and a name not found, so the shell reports it) goes through the shell
+    std::vector<char*> argv;
+    if (executable.empty()) {
+        executable = "/bin/sh";
+        argv = {const_cast<char*>("sh"), const_cast<char*>("-c"), trimmed.data()};
+    } else {
+        for (std::string& word : words) {
+            argv.push_back(word.data());
+        }
+    }
+    argv.push_back(nullptr);
     
-    if (pid < 0) {
-        // Fork failed
+    Process process;
+    try {
+        static_cast<Child&>(process) = launch(executable.c_str(), argv.data(), dir_fd, -1, pipefd[1], deferred);
+    } catch (const std::exception&) {
         close(pipefd[0]);
         close(pipefd[1]);
-        result.output = "Error: Fork failed: ";
-        result.output += strerror(errno);
-        result.output += "\n";
-        return result;
+        throw;
     }
     
-    if (pid == 0) {
-        /* Grandchild process */
-        
-        // Close read end of pipe
-        close(pipefd[0]);
-        
-        // Redirect stdout to pipe write end
-        if (dup2(pipefd[1], STDOUT_FILENO) < 0) {
-            std::cerr << "Error: dup2 failed for stdout: " << strerror(errno) << std::endl;
-            exit(1);
+    // Close write end of pipe; only the command holds it now
+    close(pipefd[1]);
+    
+    process.output_fd = pipefd[0];
+    return process;
+}
+
+// Pid of a command the spawner has forked
+void CommandExecutor::finishLaunch(Child& child) {
+    if (!child.starting) {
+        return;
+    }
+    child.starting = false;
+    
+    // collect() closes the reply socket unless it returns a pid
+    int reply = child.exit_fd;
+    child.exit_fd = -1;
+    child.pid = Spawner::collect(reply);
+    if (child.pid == 0) {
+        // Too late to fall back here: the command's pipes are already set up by the caller
+        throw std::runtime_error("Failed to start command: spawner exited");
+    }
+    child.exit_fd = reply;
+}
+
+// Start a program in its own process group
+CommandExecutor::Child CommandExecutor::launch(const char* path, char* const argv[], int dir_fd, int input_fd,
+                                               int output_fd, bool deferred) {
+    // The spawner forks from its own small, single-threaded image; it declines only when it
+    // is not running or the request is too large
+    Child child;
+    child.exit_fd = Spawner::submit(path, argv, nullptr, dir_fd, input_fd, output_fd);
+    if (child.exit_fd >= 0) {
+        child.spawned = true;
+        if (deferred) {
+            child.starting = true;
+            return child;
         }
-        
-        // Redirect stderr to pipe write end
-        if (dup2(pipefd[1], STDERR_FILENO) < 0) {
-            std::cerr << "Error: dup2 failed for stderr: " << strerror(errno) << std::endl;
-            exit(1);
+        child.pid = Spawner::collect(child.exit_fd);
+        if (child.pid > 0) {
+            return child;
         }
-        
-        // Close original pipe write end (now duplicated to stdout/stderr)
-        close(pipefd[1]);
-        
-        // Execute command through shell to support built-ins like cd
-        execl("/bin/sh", "sh", "-c", trimmed.c_str(), nullptr);
-        
-        // If execl returns, it failed
-        std::cerr << "Error: execl failed: " << strerror(errno) << std::endl;
-        exit(127);  // Command not found exit code
-    } else {
+        // The spawner went away before forking; start the command here instead
+        child = Child();
+    }
+    
+    // posix_spawn has no attribute for resource limits, and setting them once the command runs is
+    // too late, so with limits configured the command is forked and limited before exec
+    const Spawner::Limits& limits = Spawner::limits();
+    if (limits.cpu_seconds > 0 || limits.memory_bytes > 0 || limits.open_files > 0) {
+        return adopt(Spawner::startLimited(path, argv, nullptr, dir_fd, input_fd, output_fd));
+    }
+    
+    // posix_spawn (clone with CLONE_VM | CLONE_VFORK in glibc) borrows the server's address space
+    // until exec instead of copying its page tables, so launch cost does not grow with the server.
+    // Everything the child used to do between fork and exec is described up front instead
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+    
+    // Output on the pipe (dup2 clears close-on-exec on 0, 1 and 2; the originals close at exec)
+    if (input_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, input_fd, STDIN_FILENO);
+    }
+    posix_spawn_file_actions_adddup2(&actions, output_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, output_fd, STDERR_FILENO);
+    
+    // Start in the session's directory (only the child changes cwd)
+    if (dir_fd >= 0) {
+        posix_spawn_file_actions_addfchdir_np(&actions, dir_fd);
+    }
+    
+    // Own process group, so the whole command (sh and whatever it forks) can be stopped at once.
+    // The server ignores SIGPIPE; commands expect the default (e.g. `yes | head` must stop).
+    // Pool threads may block signals, which the command must not inherit
+    sigset_t defaults;
+    sigset_t no_signals;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    sigemptyset(&no_signals);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &no_signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+    
+    pid_t pid = -1;
+    int error = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    
+    if (error != 0) {
+        // Failures up to and including exec are reported here, not as an exit status
+        throw std::runtime_error(std::string("Failed to start command: ") + strerror(error));
+    }
+    
+    return adopt(pid);
+}
 
-        /* Parent process */
-        
-        // Close write end of pipe
-        close(pipefd[1]);
-        
-        // Read output from pipe
-        result.output = readFromPipe(pipefd[0]);
-        
-        // Close read end of pipe
-        close(pipefd[0]);
-        
-        // Wait for grandchild to finish
-        int status;
-        if (waitpid(pid, &status, 0) < 0) {
-            // If ECHILD, the process was already reaped by SIGCHLD handler
-            // This is OK - the command executed successfully
-            if (errno == ECHILD) {
-                result.success = true;
-                result.exit_code = 0;
-            } else {
-                result.output += "\nError: waitpid failed: ";
-                result.output += strerror(errno);
-                result.output += "\n";
-            }
+// Nothing else reaps our children, so the pid cannot be reused before the pidfd is open
+CommandExecutor::Child CommandExecutor::adopt(pid_t pid) {
+    Child child;
+    child.pid = pid;
+    child.exit_fd = pidfd(pid);
+    if (child.exit_fd < 0) {
+        int error = errno;
+        kill(-pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        throw std::runtime_error(std::string("Failed to start command: pidfd_open: ") + strerror(error));
+    }
+    return child;
+}
+
+// Through syscall(), so the build does not depend on glibc 2.36 headers for pidfd_open()
+int CommandExecutor::pidfd(pid_t pid) {
+    return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+}
+
+// Wait for a spawned command and decode its status and resource usage
+CommandExecutor::Result CommandExecutor::wait(const Child& child) {
+    Result result;
+    result.success = false;
+    result.exit_code = -1;
+    
+    int status;
+    struct rusage usage;
+    if (child.spawned) {
+        bool reported = Spawner::wait(child.exit_fd, status, usage);
+        close(child.exit_fd);
+        if (!reported) {
+            result.output += "\nError: Spawner exited before the command finished\n";
             return result;
         }
-        
-        // Check exit status
-        if (WIFEXITED(status)) {
-            result.exit_code = WEXITSTATUS(status);
-            result.success = (result.exit_code == 0);
-        } else if (WIFSIGNALED(status)) {
-            result.output += "\nCommand terminated by signal ";
-            result.output += std::to_string(WTERMSIG(status));
+    } else {
+        pid_t reaped;
+        do {
+            reaped = wait4(child.pid, &status, 0, &usage);
+        } while (reaped < 0 && errno == EINTR);
+        int error = errno;
+        close(child.exit_fd);
+        if (reaped < 0) {
+            result.output += "\nError: wait4 failed: ";
+            result.output += strerror(error);
             result.output += "\n";
+            return result;
         }
     }
+    result.user_us = usage.ru_utime.tv_sec * 1000000LL + usage.ru_utime.tv_usec;
+    result.system_us = usage.ru_stime.tv_sec * 1000000LL + usage.ru_stime.tv_usec;
+    result.max_rss_kb = usage.ru_maxrss;
+    
+    // Check exit status
+    if (WIFEXITED(status)) {
+        result.exit_code = WEXITSTATUS(status);
+        result.success = (result.exit_code == 0);
+    } else if (WIFSIGNALED(status)) {
+        result.output += "\nCommand terminated by signal ";
+        result.output += std::to_string(WTERMSIG(status));
+        result.output += "\n";
+        result.exit_code = 128 + WTERMSIG(status);  // Shell convention
+    }
     
     return result;
 }
@@ -0,0 +1,628 @@
+#include "EventLoop.h"
+#include "IoUring.h"
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+constexpr int MAX_EVENTS = 256;
+constexpr size_t READ_BUFFER_SIZE = 64 * 1024;
+
+// io_uring sizing: submission slots, and provided receive buffers (count must be a power of 2)
+constexpr unsigned RING_ENTRIES = 256;
+constexpr unsigned RECV_BUFFER_COUNT = 64;
+constexpr size_t RECV_BUFFER_SIZE = 16 * 1024;
+constexpr uint16_t RECV_BUFFER_GROUP = 1;
+
+// io_uring user_data layout: registration id | generation | operation
+enum : unsigned { OP_POLL = 1, OP_ACCEPT = 2, OP_RECV = 3, OP_WRITE_POLL = 4 };
+
+static uint64_t makeUserData(uint64_t id, uint16_t generation, unsigned op) {
+    return (id << 20) | (static_cast<uint64_t>(generation) << 4) | op;
+}
+
+EventLoop::Backend EventLoop::preferred_backend_ = EventLoop::Backend::Epoll;
+
+EventLoop::EventLoop()
+    : backend_(preferred_backend_), epoll_fd_(-1), running_(false), next_id_(1), wake_fd_(-1) {
+    if (backend_ == Backend::IoUring) {
+        try {
+            ring_ = std::make_unique<IoUring>(RING_ENTRIES);
+            ring_->setupBufferRing(RECV_BUFFER_GROUP, RECV_BUFFER_COUNT, RECV_BUFFER_SIZE);
+        } catch (const std::exception&) {
+            ring_.reset();
+            backend_ = Backend::Epoll;  // Kernel refused: keep serving on epoll
+        }
+    }
+
+    if (backend_ == Backend::Epoll) {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd_ < 0) {
+            throw std::runtime_error(std::string("Failed to create epoll instance: ") + strerror(errno));
+        }
+        read_buffer_.resize(READ_BUFFER_SIZE);
+    }
+
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd_ < 0) {
+        if (epoll_fd_ >= 0) {
+            ::close(epoll_fd_);
+        }
+        throw std::runtime_error(std::string("Failed to create eventfd: ") + strerror(errno));
+    }
+    add(wake_fd_, EPOLLIN, [this](uint32_t) { runPosted(); });
+}
+
+EventLoop::~EventLoop() {
+    if (wake_fd_ >= 0) {
+        ::close(wake_fd_);
+    }
+    if (epoll_fd_ >= 0) {
+        ::close(epoll_fd_);
+    }
+}
+
+void EventLoop::setPreferredBackend(Backend backend) {
+    preferred_backend_ = backend;
+}
+
+EventLoop::Backend EventLoop::preferredBackend() {
+    return preferred_backend_;
+}
+
+const char* EventLoop::backendName(Backend backend) {
+    return backend == Backend::IoUring ? "io_uring" : "epoll";
+}
+
+EventLoop::Backend EventLoop::backend() const {
+    return backend_;
+}
+
+// Epoll interest set for a watch
+uint32_t EventLoop::epollEvents(const Watch& watch) const {
+    switch (watch.kind) {
+        case Kind::Accept:
+            return EPOLLIN | (watch.exclusive ? static_cast<uint32_t>(EPOLLEXCLUSIVE) : 0u);
+        case Kind::Stream:
+            return (watch.read_paused ? 0u : static_cast<uint32_t>(EPOLLIN | EPOLLRDHUP)) |
+                   (watch.want_write ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+        default:
+            return watch.events;
+    }
+}
+
+// Hand a new watch to the backend
+void EventLoop::attach(const std::shared_ptr<Watch>& watch) {
+    if (ids_.count(watch->fd)) {
+        throw std::runtime_error("Descriptor is already watched");
+    }
+
+    if (backend_ == Backend::Epoll) {
+        epoll_event ev;
+        std::memset(&ev, 0, sizeof(ev));
+        ev.events = epollEvents(*watch);
+        ev.data.u64 = watch->id;
+
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, watch->fd, &ev) < 0) {
+            throw std::runtime_error(std::string("Failed to watch descriptor: ") + strerror(errno));
+        }
+    } else {
+        switch (watch->kind) {
+            case Kind::Ready:  arm(*watch, OP_POLL); break;
+            case Kind::Accept:
+                // A multishot accept keeps taking connections until its cancel lands; listeners
+                // shared with other processes poll instead, so a worker that stops accepting
+                // never swallows a client
+                arm(*watch, watch->exclusive ? OP_POLL : OP_ACCEPT);
+                break;
+            case Kind::Stream: arm(*watch, OP_RECV); break;
+        }
+    }
+
+    ids_[watch->fd] = watch->id;
+    watches_[watch->id] = watch;
+}
+
+// Register fd with a handler
+void EventLoop::add(int fd, uint32_t events, Handler handler) {
+    auto watch = std::make_shared<Watch>();
+    watch->fd = fd;
+    watch->kind = Kind::Ready;
+    watch->id = next_id_++;
+    watch->events = events;
+    watch->exclusive = false;
+    watch->want_write = false;
+    watch->write_armed = false;
+    watch->read_paused = false;
+    watch->recv_armed = false;
+    watch->unwatched = false;
+    watch->active = true;
+    watch->generation = 0;
+    watch->handler = std::move(handler);
+    attach(watch);
+}
+
+// Register a listening socket
+void EventLoop::addAcceptor(int fd, bool exclusive, AcceptHandler on_accept) {
+    auto watch = std::make_shared<Watch>();
+    watch->fd = fd;
+    watch->kind = Kind::Accept;
+    watch->id = next_id_++;
+    watch->events = EPOLLIN;
+    watch->exclusive = exclusive;
+    watch->want_write = false;
+    watch->write_armed = false;
+    watch->read_paused = false;
+    watch->recv_armed = false;
+    watch->unwatched = false;
+    watch->active = true;
+    watch->generation = 0;
+    watch->on_accept = std::move(on_accept);
+    attach(watch);
+}
+
+// Register a connected stream socket
+void EventLoop::addStream(int fd, DataHandler on_data, Handler on_writable) {
+    auto watch = std::make_shared<Watch>();
+    watch->fd = fd;
+    watch->kind = Kind::Stream;
+    watch->id = next_id_++;
+    watch->events = EPOLLIN;
+    watch->exclusive = false;
+    watch->want_write = false;
+    watch->write_armed = false;
+    watch->read_paused = false;
+    watch->recv_armed = false;
+    watch->unwatched = false;
+    watch->active = true;
+    watch->generation = 0;
+    watch->on_data = std::move(on_data);
+    watch->handler = std::move(on_writable);
+    attach(watch);
+}
+
+// Change watched events
+void EventLoop::modify(int fd, uint32_t events) {
+    auto it = ids_.find(fd);
+    if (it == ids_.end()) {
+        throw std::runtime_error("Cannot modify unwatched descriptor");
+    }
+
+    Watch& watch = *watches_[it->second];
+    if (watch.events == events) {
+        return;
+    }
+    watch.events = events;
+
+    if (backend_ == Backend::Epoll) {
+        epoll_event ev;
+        std::memset(&ev, 0, sizeof(ev));
+        ev.events = epollEvents(watch);
+        ev.data.u64 = watch.id;
+
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev) < 0) {
+            throw std::runtime_error(std::string("Failed to modify watch: ") + strerror(errno));
+        }
+    } else {
+        // Replace the multishot poll; completions of the old one carry the old generation
+        cancel(makeUserData(watch.id, watch.generation, OP_POLL));
+        watch.generation++;
+        arm(watch, OP_POLL);
+    }
+}
+
+// Toggle writability notifications for a stream
+void EventLoop::setWantWrite(int fd, bool want) {
+    auto it = ids_.find(fd);
+    if (it == ids_.end()) {
+        return;
+    }
+
+    Watch& watch = *watches_[it->second];
+    if (watch.want_write == want) {
+        return;
+    }
+    watch.want_write = want;
+
+    if (backend_ == Backend::Epoll && watch.unwatched) {
+        return;  // Out of the set until reads resume, which report the hangup
+    }
+
+    if (backend_ == Backend::Epoll) {
+        epoll_event ev;
+        std::memset(&ev, 0, sizeof(ev));
+        ev.events = epollEvents(watch);
+        ev.data.u64 = watch.id;
+
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev) < 0) {
+            throw std::runtime_error(std::string("Failed to modify watch: ") + strerror(errno));
+        }
+    } else if (want && !watch.write_armed) {
+        // One-shot POLLOUT; an unwanted completion just finds nothing to flush
+        arm(watch, OP_WRITE_POLL);
+    }
+}
+
+// Pause or resume receiving on a stream
+void EventLoop::setReadPaused(int fd, bool paused) {
+    auto it = ids_.find(fd);
+    if (it == ids_.end()) {
+        return;
+    }
+
+    Watch& watch = *watches_[it->second];
+    if (watch.kind != Kind::Stream || watch.read_paused == paused) {
+        return;
+    }
+    watch.read_paused = paused;
+
+    if (backend_ == Backend::Epoll) {
+        epoll_event ev;
+        std::memset(&ev, 0, sizeof(ev));
+        ev.events = epollEvents(watch);
+        ev.data.u64 = watch.id;
+
+        int op = watch.unwatched ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        watch.unwatched = false;
+        if (epoll_ctl(epoll_fd_, op, fd, &ev) < 0) {
+            throw std::runtime_error(std::string("Failed to modify watch: ") + strerror(errno));
+        }
+    } else if (paused && watch.recv_armed) {
+        // Data the recv already took still arrives; its last completion re-arms once resumed
+        cancel(makeUserData(watch.id, watch.generation, OP_RECV));
+    } else if (!paused && !watch.recv_armed) {
+        arm(watch, OP_RECV);
+    }
+}
+
+// Unregister fd
+void EventLoop::remove(int fd) {
+    auto it = ids_.find(fd);
+    if (it == ids_.end()) {
+        return;
+    }
+
+    auto watch_it = watches_.find(it->second);
+    Watch& watch = *watch_it->second;
+    watch.active = false;
+
+    if (backend_ == Backend::Epoll) {
+        // The fd may already be closed; the kernel drops it from the set in that case
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    } else {
+        // In-flight requests hold a file reference until cancelled
+        switch (watch.kind) {
+            case Kind::Ready:
+                cancel(makeUserData(watch.id, watch.generation, OP_POLL));
+                break;
+            case Kind::Accept:
+                cancel(makeUserData(watch.id, watch.generation, watch.exclusive ? OP_POLL : OP_ACCEPT));
+                break;
+            case Kind::Stream:
+                cancel(makeUserData(watch.id, watch.generation, OP_RECV));
+                if (watch.write_armed) {
+                    cancel(makeUserData(watch.id, watch.generation, OP_WRITE_POLL));
+                }
+                break;
+        }
+    }
+
+    watches_.erase(watch_it);
+    ids_.erase(it);
+}
+
+bool EventLoop::contains(int fd) const {
+    return ids_.find(fd) != ids_.end();
+}
+
+// Queue an io_uring request for a watch
+void EventLoop::arm(Watch& watch, unsigned op) {
+    io_uring_sqe* sqe = ring_->getSqe();
+    sqe->fd = watch.fd;
+    sqe->user_data = makeUserData(watch.id, watch.generation, op);
+
+    switch (op) {
+        case OP_POLL:
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->len = IORING_POLL_ADD_MULTI;
+            sqe->poll32_events = watch.events & ~(EPOLLET | EPOLLEXCLUSIVE | EPOLLONESHOT);
+            break;
+        case OP_ACCEPT:
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+            break;
+        case OP_RECV:
+            sqe->opcode = IORING_OP_RECV;
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+            sqe->flags = IOSQE_BUFFER_SELECT;
+            sqe->buf_group = ring_->bufferGroup();
+            watch.recv_armed = true;
+            break;
+        case OP_WRITE_POLL:
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->poll32_events = POLLOUT;
+            watch.write_armed = true;
+            break;
+    }
+}
+
+// Queue cancellation of an in-flight request
+void EventLoop::cancel(uint64_t user_data) {
+    io_uring_sqe* sqe = ring_->getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+    sqe->user_data = 0;  // Cancel results are not interesting
+}
+
+// Accept the whole backlog of a ready listener
+void EventLoop::acceptPending(Watch& watch) {
+    while (watch.active) {
+        int client_fd = accept4(watch.fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            watch.on_accept(-errno);
+            return;
+        }
+        watch.on_accept(client_fd);
+    }
+}
+
+// Deliver one epoll event
+void EventLoop::dispatchEpoll(Watch& watch, uint32_t events) {
+    if (watch.kind == Kind::Ready) {
+        watch.handler(events);
+        return;
+    }
+
+    if (watch.kind == Kind::Accept) {
+        acceptPending(watch);
+        return;
+    }
+
+    // epoll reports a hangup or error even without EPOLLIN, and keeps reporting it: while paused,
+    // leave the set until reads resume and deliver the rest of the data, the EOF or the error.
+    // A pending send hears of it now
+    if (watch.read_paused && (events & (EPOLLHUP | EPOLLERR))) {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, watch.fd, nullptr);
+        watch.unwatched = true;
+        if (watch.want_write) {
+            watch.handler(EPOLLOUT);
+        }
+        return;
+    }
+
+    // Stream: read until the socket is drained, then report writability
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
+        while (watch.active && !watch.read_paused) {
+            ssize_t received = ::recv(watch.fd, read_buffer_.data(), read_buffer_.size(), 0);
+            if (received < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                watch.on_data(nullptr, -errno);
+                return;
+            }
+            watch.on_data(read_buffer_.data(), received);
+            if (received == 0) {
+                return;
+            }
+        }
+    }
+
+    if ((events & EPOLLOUT) && watch.active) {
+        watch.handler(EPOLLOUT);
+    }
+}
+
+// Deliver one io_uring completion
+void EventLoop::dispatchCompletion(uint64_t user_data, int32_t res, uint32_t flags) {
+    unsigned op = user_data & 0xF;
+    uint16_t generation = static_cast<uint16_t>((user_data >> 4) & 0xFFFF);
+    uint64_t id = user_data >> 20;
+    bool more = (flags & IORING_CQE_F_MORE) != 0;
+    bool has_buffer = (flags & IORING_CQE_F_BUFFER) != 0;
+    uint16_t bid = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+
+    auto it = watches_.find(id);
+    std::shared_ptr<Watch> watch = it != watches_.end() ? it->second : nullptr;
+
+    // Completion for a removed or replaced request: release what it carries
+    if (!watch || !watch->active || generation != watch->generation) {
+        if (op == OP_ACCEPT && res >= 0) {
+            ::close(res);
+        }
+        if (has_buffer) {
+            ring_->recycleBuffer(bid);
+        }
+        return;
+    }
+
+    switch (op) {
+        case OP_POLL:
+            if (res >= 0 && watch->kind == Kind::Accept) {
+                acceptPending(*watch);
+            } else if (res >= 0) {
+                watch->handler(static_cast<uint32_t>(res));
+            } else if (res != -ECANCELED) {
+                watch->handler(EPOLLERR);
+            }
+            if (!more && watch->active && generation == watch->generation) {
+                arm(*watch, OP_POLL);
+            }
+            break;
+
+        case OP_ACCEPT:
+            if (res != -ECANCELED) {
+                watch->on_accept(res);  // Client fd, or -errno
+            }
+            if (!more && watch->active) {
+                arm(*watch, OP_ACCEPT);
+            }
+            break;
+
+        case OP_RECV:
+            if (!more) {
+                watch->recv_armed = false;
+            }
+            if (res > 0) {
+                watch->on_data(ring_->buffer(bid), res);
+            } else if (res == 0) {
+                watch->on_data(nullptr, 0);
+            } else if (res != -ENOBUFS && res != -ECANCELED) {
+                watch->on_data(nullptr, res);
+            }
+            if (has_buffer) {
+                ring_->recycleBuffer(bid);
+            }
+            // Multishot recv stops on EOF/errors, when buffers run out and when a pause cancels it;
+            // re-arm for the last two unless reading is (still) paused
+            if (!more && watch->active && !watch->read_paused && !watch->recv_armed &&
+                (res > 0 || res == -ENOBUFS || res == -ECANCELED)) {
+                arm(*watch, OP_RECV);
+            }
+            break;
+
+        case OP_WRITE_POLL:
+            watch->write_armed = false;
+            if (watch->want_write) {
+                watch->handler(EPOLLOUT);
+            }
+            // Still full: the poll is one-shot, so ask again (epoll's level trigger does this itself)
+            if (watch->active && watch->want_write && !watch->write_armed) {
+                arm(*watch, OP_WRITE_POLL);
+            }
+            break;
+    }
+}
+
+// Wait for one batch of events and dispatch it
+void EventLoop::poll(int timeout_ms) {
+    if (backend_ == Backend::IoUring) {
+        // Everything queued since the last wait goes to the kernel in this one call
+        ring_->submitAndWait(timeout_ms);
+
+        while (io_uring_cqe* cqe = ring_->peekCqe()) {
+            uint64_t user_data = cqe->user_data;
+            int32_t res = cqe->res;
+            uint32_t flags = cqe->flags;
+            ring_->advance();
+
+            if (user_data != 0) {
+                dispatchCompletion(user_data, res, flags);
+            }
+        }
+        resumeReady();
+        return;
+    }
+
+    epoll_event events[MAX_EVENTS];
+
+    int count = epoll_wait(epoll_fd_, events, MAX_EVENTS, timeout_ms);
+    if (count < 0) {
+        if (errno == EINTR) {
+            return;
+        }
+        throw std::runtime_error(std::string("epoll_wait failed: ") + strerror(errno));
+    }
+
+    for (int i = 0; i < count; i++) {
+        // Look the watch up by id so handlers removed earlier in this batch are skipped
+        auto it = watches_.find(events[i].data.u64);
+        if (it == watches_.end()) {
+            continue;
+        }
+
+        std::shared_ptr<Watch> watch = it->second;  // Keep alive while the handler runs
+        dispatchEpoll(*watch, events[i].events);
+    }
+    resumeReady();
+}
+
+// Dispatch until stopped
+void EventLoop::run() {
+    running_ = true;
+    while (running_) {
+        poll(-1);
+    }
+}
+
+// Queue a task for the loop thread and wake it
+void EventLoop::post(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex_);
+        posted_.push_back(std::move(task));
+    }
+
+    uint64_t one = 1;
+    ssize_t written = write(wake_fd_, &one, sizeof(one));
+    (void)written;  // EAGAIN means a wakeup is already pending
+}
+
+// Run everything queued so far
+void EventLoop::runPosted() {
+    uint64_t count;
+    ssize_t bytes_read = read(wake_fd_, &count, sizeof(count));
+    (void)bytes_read;
+
+    std::vector<std::function<void()>> tasks;
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex_);
+        tasks.swap(posted_);
+        ready_.insert(ready_.end(), remote_ready_.begin(), remote_ready_.end());
+        remote_ready_.clear();
+    }
+
+    for (auto& task : tasks) {
+        task();
+    }
+}
+
+// Queue a coroutine for resumption after the current batch
+void EventLoop::schedule(std::coroutine_handle<> handle) {
+    ready_.push_back(handle);
+}
+
+// Queue a coroutine from another thread and wake the loop
+void EventLoop::scheduleRemote(std::coroutine_handle<> handle) {
+    {
+        std::lock_guard<std::mutex> lock(posted_mutex_);
+        remote_ready_.push_back(handle);
+    }
+
+    uint64_t one = 1;
+    ssize_t written = write(wake_fd_, &one, sizeof(one));
+    (void)written;
+}
+
+// Resume scheduled coroutines; swapping keeps both queues' capacity, so no allocation in steady state
+void EventLoop::resumeReady() {
+    while (!ready_.empty()) {
+        resuming_.swap(ready_);
+        for (std::coroutine_handle<> handle : resuming_) {
+            handle.resume();
+        }
+        resuming_.clear();
+    }
+}
+
+void EventLoop::stop() {
+    running_ = false;
+}
+
+bool EventLoop::isRunning() const {
+    return running_;
+}
@@ -0,0 +1,379 @@
+#include "IoUring.h"
+#include <stdexcept>
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <vector>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+
+// Raw syscall entry points (no liburing dependency)
+static int sysSetup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int sysEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void* arg, size_t arg_size) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size));
+}
+
+static int sysRegister(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+IoUring::IoUring(unsigned entries)
+    : ring_fd_(-1), sq_ptr_(MAP_FAILED), sq_size_(0), sq_head_(nullptr), sq_tail_(nullptr),
+      sq_mask_(nullptr), sq_array_(nullptr), sqes_(static_cast<io_uring_sqe*>(MAP_FAILED)), sqes_size_(0),
+      sq_local_tail_(0), cq_ptr_(MAP_FAILED), cq_size_(0), cq_head_(nullptr), cq_tail_(nullptr),
+      cq_mask_(nullptr), cqes_(nullptr), features_(0), buf_ring_(nullptr), buf_ring_size_(0),
+      buffers_(nullptr), buffers_size_(0), buf_count_(0), buf_size_(0), buf_group_(0), buf_tail_(0) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = entries * 4;  // Multishot requests post many completions per submission
+
+    ring_fd_ = sysSetup(entries, &params);
+    if (ring_fd_ < 0 && errno == EINVAL) {
+        // Older kernel: drop the optional setup flags
+        std::memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        ring_fd_ = sysSetup(entries, &params);
+    }
+    if (ring_fd_ < 0) {
+        throw std::runtime_error(std::string("io_uring_setup failed: ") + strerror(errno));
+    }
+    features_ = params.features;
+
+    sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (features_ & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+        sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+    }
+
+    sq_ptr_ = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ptr_ == MAP_FAILED) {
+        int err = errno;
+        ::close(ring_fd_);
+        throw std::runtime_error(std::string("Failed to map submission ring: ") + strerror(err));
+    }
+
+    if (single_mmap) {
+        cq_ptr_ = sq_ptr_;
+    } else {
+        cq_ptr_ = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+        if (cq_ptr_ == MAP_FAILED) {
+            int err = errno;
+            munmap(sq_ptr_, sq_size_);
+            ::close(ring_fd_);
+            throw std::runtime_error(std::string("Failed to map completion ring: ") + strerror(err));
+        }
+    }
+
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+    if (sqes_ == MAP_FAILED) {
+        int err = errno;
+        if (cq_ptr_ != sq_ptr_) {
+            munmap(cq_ptr_, cq_size_);
+        }
+        munmap(sq_ptr_, sq_size_);
+        ::close(ring_fd_);
+        throw std::runtime_error(std::string("Failed to map submission entries: ") + strerror(err));
+    }
+
+    char* sq = static_cast<char*>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sq_local_tail_ = *sq_tail_;
+
+    char* cq = static_cast<char*>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+}
+
+IoUring::~IoUring() {
+    if (buffers_) {
+        munmap(buffers_, buffers_size_);
+    }
+    if (buf_ring_) {
+        munmap(buf_ring_, buf_ring_size_);
+    }
+    if (sqes_ != MAP_FAILED) {
+        munmap(sqes_, sqes_size_);
+    }
+    if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_) {
+        munmap(cq_ptr_, cq_size_);
+    }
+    if (sq_ptr_ != MAP_FAILED) {
+        munmap(sq_ptr_, sq_size_);
+    }
+    if (ring_fd_ >= 0) {
+        ::close(ring_fd_);
+    }
+}
+
+// Probe for the opcodes, flags and registrations the backend relies on
+bool IoUring::isSupported() {
+    // Multishot recv needs 6.0; the opcode probe cannot see request flags
+    utsname info;
+    if (uname(&info) != 0 || std::atoi(info.release) < 6) {
+        return false;
+    }
+
+    try {
+        IoUring ring(8);
+
+        if (!(ring.features_ & IORING_FEAT_EXT_ARG)) {
+            return false;
+        }
+
+        // Opcode probe
+        size_t probe_size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+        std::vector<char> storage(probe_size, 0);
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(storage.data());
+        if (sysRegister(ring.ring_fd_, IORING_REGISTER_PROBE, probe, 256) < 0) {
+            return false;
+        }
+
+        const unsigned needed[] = {IORING_OP_POLL_ADD, IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_ASYNC_CANCEL};
+        for (unsigned op : needed) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                return false;
+            }
+        }
+
+        // Receive buffers (ring-mapped, or legacy provided buffers as a fallback)
+        ring.setupBufferRing(0, 2, 4096);
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+// Make filled entries visible to the kernel
+unsigned IoUring::publish() {
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    return sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+}
+
+// Grab the next submission slot
+io_uring_sqe* IoUring::getSqe() {
+    unsigned entries = *sq_mask_ + 1;
+
+    if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= entries) {
+        submit();  // Queue full: hand the batch to the kernel early
+        if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= entries) {
+            throw std::runtime_error("io_uring submission queue is full");
+        }
+    }
+
+    unsigned index = sq_local_tail_ & *sq_mask_;
+    sq_array_[index] = index;
+    sq_local_tail_++;
+
+    io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Submit without waiting
+void IoUring::submit() {
+    unsigned pending = publish();
+    if (pending == 0) {
+        return;
+    }
+
+    while (sysEnter(ring_fd_, pending, 0, 0, nullptr, 0) < 0) {
+        if (errno != EINTR) {
+            throw std::runtime_error(std::string("io_uring_enter failed: ") + strerror(errno));
+        }
+    }
+}
+
+// Submit the batch and wait for completions in one syscall
+void IoUring::submitAndWait(int timeout_ms) {
+    unsigned pending = publish();
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    int ret;
+
+    if (timeout_ms < 0) {
+        ret = sysEnter(ring_fd_, pending, 1, flags, nullptr, 0);
+    } else {
+        __kernel_timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000;
+
+        io_uring_getevents_arg arg;
+        std::memset(&arg, 0, sizeof(arg));
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+
+        ret = sysEnter(ring_fd_, pending, 1, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+
+    if (ret < 0 && errno != EINTR && errno != ETIME && errno != EBUSY) {
+        throw std::runtime_error(std::string("io_uring_enter failed: ") + strerror(errno));
+    }
+}
+
+io_uring_cqe* IoUring::peekCqe() {
+    unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+        return nullptr;
+    }
+    return &cqes_[head & *cq_mask_];
+}
+
+void IoUring::advance() {
+    __atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE);
+}
+
+// Register the receive buffers with the kernel
+void IoUring::setupBufferRing(uint16_t group, unsigned count, size_t size) {
+    if (count == 0 || (count & (count - 1)) != 0) {
+        throw std::runtime_error("Buffer ring size must be a power of 2");
+    }
+
+    // MAP_SHARED keeps the kernel's pinned pages and ours identical across fork (no COW split)
+    buffers_size_ = count * size;
+    void* buffers = mmap(nullptr, buffers_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (buffers == MAP_FAILED) {
+        throw std::runtime_error(std::string("Failed to allocate receive buffers: ") + strerror(errno));
+    }
+    buffers_ = static_cast<char*>(buffers);
+
+    buf_count_ = count;
+    buf_size_ = size;
+    buf_group_ = group;
+    buf_tail_ = 0;
+
+    if (!registerBufferRing(group, count) || !bufferRingWorks()) {
+        // Some kernels accept the registration but never hand out ring buffers;
+        // provide them with IORING_OP_PROVIDE_BUFFERS instead
+        if (buf_ring_) {
+            io_uring_buf_reg reg;
+            std::memset(&reg, 0, sizeof(reg));
+            reg.bgid = group;
+            sysRegister(ring_fd_, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+            munmap(buf_ring_, buf_ring_size_);
+            buf_ring_ = nullptr;
+        }
+
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = static_cast<int>(count);
+        sqe->addr = reinterpret_cast<uint64_t>(buffers_);
+        sqe->len = static_cast<uint32_t>(size);
+        sqe->buf_group = group;
+        submitAndWait(-1);
+
+        io_uring_cqe* cqe = peekCqe();
+        int res = cqe ? cqe->res : -EIO;
+        advance();
+        if (res < 0) {
+            throw std::runtime_error(std::string("Failed to provide receive buffers: ") + strerror(-res));
+        }
+    }
+}
+
+// Register a provided buffer ring and fill it
+bool IoUring::registerBufferRing(uint16_t group, unsigned count) {
+    long page = sysconf(_SC_PAGESIZE);
+    buf_ring_size_ = ((count * sizeof(io_uring_buf) + page - 1) / page) * page;
+    void* ring = mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        return false;
+    }
+    buf_ring_ = static_cast<io_uring_buf_ring*>(ring);
+
+    io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+    reg.ring_entries = count;
+    reg.bgid = group;
+
+    if (sysRegister(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(buf_ring_, buf_ring_size_);
+        buf_ring_ = nullptr;
+        return false;
+    }
+
+    for (unsigned bid = 0; bid < count; bid++) {
+        recycleBuffer(static_cast<uint16_t>(bid));
+    }
+    return true;
+}
+
+// Receive one byte through the ring to prove the kernel actually consumes it
+bool IoUring::bufferRingWorks() {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+        return false;
+    }
+
+    char byte = 0;
+    bool works = false;
+    if (::write(pair[1], &byte, 1) == 1) {
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = pair[0];
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = buf_group_;
+        submitAndWait(-1);
+
+        io_uring_cqe* cqe = peekCqe();
+        if (cqe) {
+            works = cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER);
+            if (works) {
+                recycleBuffer(static_cast<uint16_t>(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+            }
+            advance();
+        }
+    }
+
+    ::close(pair[0]);
+    ::close(pair[1]);
+    return works;
+}
+
+uint16_t IoUring::bufferGroup() const {
+    return buf_group_;
+}
+
+const char* IoUring::buffer(uint16_t bid) const {
+    return buffers_ + static_cast<size_t>(bid) * buf_size_;
+}
+
+// Hand a consumed buffer back to the kernel
+void IoUring::recycleBuffer(uint16_t bid) {
+    if (!buf_ring_) {
+        // Legacy provided buffers: goes out with the next submission batch
+        io_uring_sqe* sqe = getSqe();
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = 1;
+        sqe->addr = reinterpret_cast<uint64_t>(buffers_ + static_cast<size_t>(bid) * buf_size_);
+        sqe->len = static_cast<uint32_t>(buf_size_);
+        sqe->off = bid;
+        sqe->buf_group = buf_group_;
+        return;
+    }
+
+    io_uring_buf* buf = &buf_ring_->bufs[buf_tail_ & (buf_count_ - 1)];
+    buf->addr = reinterpret_cast<uint64_t>(buffers_ + static_cast<size_t>(bid) * buf_size_);
+    buf->len = static_cast<uint32_t>(buf_size_);
+    buf->bid = bid;
+
+    buf_tail_++;
+    __atomic_store_n(&buf_ring_->tail, buf_tail_, __ATOMIC_RELEASE);
+}
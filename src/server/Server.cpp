@@ -1,6 +1,13 @@
 #include "Server.h"
+#include "AsyncSocket.h"
+#include "Coroutine.h"
+#include "Protocol.h"
 #include "CommandExecutor.h"
 #include "Auth.h"
+#include "Compression.h"
+#include "FileTransfer.h"
+#include "Delta.h"
+#include "Archive.h"
 #include "Colors.h"
 #include <iostream>
 #include <cstring>
@@ -10,26 +17,28 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <vector>
-#include <thread>
-#include <chrono>
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sched.h>
+#include <pthread.h>
 
-constexpr size_t BUFFER_SIZE = 4096;
-
-// Signal handler for SIGCHLD to reap zombie processes
-void sigchldHandler(int sig) {
-    (void)sig;  
-    
-    // Use WNOHANG to make waitpid non-blocking
-    while (waitpid(-1, nullptr, WNOHANG) > 0) {
-        // Keep reaping until no more dead children
-    }
-}
+constexpr int RESTART_EXIT_CODE = 3;  // Worker exit status asking the supervisor to restart
+constexpr size_t OUTPUT_CHUNK_SIZE = 64 * 1024;  // Largest OUTPUT frame payload read from a command pipe
+constexpr size_t SPLICE_CHUNK_SIZE = 1024 * 1024;  // Largest OUTPUT frame payload spliced (never copied)
+constexpr size_t MAX_QUEUED_COMMANDS = 1024;  // Plain commands waiting their turn before a session stops reading
+constexpr size_t MAX_PENDING_LOGINS_PER_THREAD = 32;  // Logins waiting for the KDF before new ones are turned away
 
 Server::Server(int port) 
-    : port_(port), running_(false), use_fork_(false), 
+    : port_(port), bind_address_("0.0.0.0"), ports_{port}, running_(false), use_fork_(false), 
       auth_(std::make_shared<Auth>()), require_auth_(true), 
-      restart_requested_(false), command_mode_(false) {
+      restart_requested_(false), shard_count_(0),
+      prefork_workers_(0), max_sessions_per_worker_(0),
+      session_threads_(0), auth_threads_(0), logins_pending_(0), compression_level_(0), persistent_shell_(false), command_mode_(false) {
     // Initialize with current working directory
     char cwd[1024];
     if (getcwd(cwd, sizeof(cwd)) != nullptr) {
@@ -39,12 +48,64 @@ Server::Server(int port)
     }
 }
 
+Server::Channel::Channel()
+    : id(0), kind(Protocol::FrameType::Command), flags(0), ordered(true), window(SIZE_MAX), pid(0), cancelled(false) {}
+
+Server::Connection::Connection()
+    : shard(nullptr), state(State::Authenticating), dir_fd(-1), splice_output(true),
+      compression_level(0), concurrent(0) {}
+
+Server::Connection::~Connection() {
+    for (auto& entry : uploads) {
+        close(entry.second.fd);
+        if (entry.second.base_fd >= 0) {
+            close(entry.second.base_fd);
+        }
+        if (!entry.second.temp.empty()) {
+            unlinkat(dir_fd, entry.second.temp.c_str(), 0);
+        }
+    }
+    if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+}
+
+// Create a shard and bind its listeners
+std::unique_ptr<Server::Shard> Server::createShard(int index, bool reuse_port) {
+    auto shard = std::make_unique<Shard>();
+    shard->index = index;
+    shard->loop = std::make_unique<EventLoop>();
+    shard->sessions_served = 0;
+    shard->expiry_timer = -1;
+    
+    for (int port : ports_) {
+        Socket listener;
+        listener.create();
+        listener.setReuseAddr(true);
+        if (reuse_port) {
+            listener.setReusePort(true);  // Kernel load-balances accepts across shards
+        }
+        listener.bind(bind_address_, port);
+        listener.listen(SOMAXCONN);
+        shard->listeners.push_back(std::move(listener));
+    }
+    
+    return shard;
+}
+
 // Start server
 void Server::start() {
-    listen_socket_.create();
-    listen_socket_.setReuseAddr(true);
-    listen_socket_.bind(port_);
-    listen_socket_.listen(5);
+    // Map the session table before any worker forks, so all of them share it
+    auth_->cleanupExpiredSessions();
+    size_t restored = auth_->getActiveSessionCount();
+    
+    // Sharding only applies to in-process sessions
+    bool sharded = shard_count_ > 0 && !use_fork_ && prefork_workers_ == 0;
+    int shard_count = sharded ? shard_count_ : 1;
+    
+    for (int i = 0; i < shard_count; i++) {
+        shards_.push_back(createShard(i, sharded));
+    }
     
     // Get network IP
     struct ifaddrs *ifaddr, *ifa;
@@ -69,6 +130,23 @@ void Server::start() {
     // Simple server info
     std::cout << Color::PURPLE << "Server listening on port " << Color::BG_PURPLE << " " << port_ << " " << Color::RESET << std::endl;
     
+    if (ports_.size() > 1 || bind_address_ != "0.0.0.0") {
+        std::cout << Color::GRAY << "Bind:    " << bind_address_ << " ports";
+        for (int port : ports_) {
+            std::cout << " " << port;
+        }
+        std::cout << Color::RESET << std::endl;
+    }
+    if (shards_[0]->loop->backend() != EventLoop::Backend::Epoll) {
+        std::cout << Color::GRAY << "I/O:     " << EventLoop::backendName(shards_[0]->loop->backend()) << Color::RESET << std::endl;
+    }
+    if (sharded) {
+        std::cout << Color::GRAY << "Shards:  " << shard_count << " (SO_REUSEPORT)" << Color::RESET << std::endl;
+    }
+    if (restored > 0) {
+        std::cout << Color::GRAY << "Sessions: " << restored << " still logged in" << Color::RESET << std::endl;
+    }
+    
     if (!ip_addresses.empty()) {
         std::cout << Color::GRAY << "Network: " << ip_addresses[0] << ":" << port_ << Color::RESET << std::endl;
     }
@@ -80,50 +158,32 @@ void Server::start() {
     std::cout << std::endl;
 }
 
-// Handle single client - echo mode
-void Server::handleClientEcho(Socket& client_socket) {
-    char buffer[BUFFER_SIZE];
-    
-    std::cout << Color::DIM << "  Mode: Echo" << Color::RESET << std::endl;
-    
-    // Perform authentication if required
-    std::string auth_token;
-    if (require_auth_) {
-        std::cout << Color::DIM << "  ⏳ Authenticating..." << Color::RESET << std::flush;
-        auth_token = authenticateClient(client_socket);
-        std::cout << "\r\033[K";  // Clear line
-        
-        if (auth_token.empty()) {
-            std::cout << Color::ROSE << "  ✖ Authentication failed" << Color::RESET << std::endl;
+// Compressed payloads carry FLAG_COMPRESSED; small or incompressible ones go out as they are
+void Server::appendOutput(const Connection& conn, std::string& out, uint32_t request_id, std::string_view payload) {
+    if (conn.compression_level > 0) {
+        size_t offset = out.size();
+        out.resize(offset + Protocol::HEADER_SIZE);
+        if (Compression::compress(payload, out, conn.compression_level)) {
+            Protocol::encodeHeader(&out[offset], Protocol::FrameType::Output, request_id,
+                                   static_cast<uint32_t>(out.size() - offset - Protocol::HEADER_SIZE),
+                                   Protocol::FLAG_COMPRESSED);
             return;
         }
-        std::cout << Color::GREEN << "  ✔ Authenticated" << Color::RESET << std::endl;
+        out.resize(offset);
     }
+    Protocol::appendFrame(out, Protocol::FrameType::Output, request_id, payload);
+}
+
+// Handle client data - echo mode
+std::string Server::handleClientEcho(const std::string& data) {
+    std::cout << Color::GRAY << "Received: " << Color::RESET << data << std::endl; // Print received 
     
-    while (true) {
-       
-        std::memset(buffer, 0, BUFFER_SIZE);  // Clear buffer
-        // Receive data from client
-        ssize_t bytes_received = client_socket.recv(buffer, BUFFER_SIZE - 1, 0);
-        
-        if (bytes_received <= 0) {
-            if (bytes_received == 0) {
-                std::cout << Color::GRAY << "Client disconnected" << Color::RESET << std::endl;
-            } else {
-                std::cerr << Color::ROSE << "Error receiving data" << Color::RESET << std::endl;
-            }
-            break;
-        }
-        
-        
-        std::cout << Color::GRAY << "Received: " << Color::RESET << buffer; // Print received 
-      
-        client_socket.send(buffer, bytes_received, 0);   // Echo back to client
-    }
+    return data;   // Echo back to client
 }
 
 // Handle cd command specially
-std::string Server::handleCdCommand(const std::string& path) {
+// Resolves the target and swaps the session's directory fd; the process cwd is never changed
+std::string Server::handleCdCommand(Connection& conn, const std::string& path) {
     std::string target_path = path;
     
     // Trim whitespace
@@ -131,6 +191,8 @@ std::string Server::handleCdCommand(const std::string& path) {
     size_t end = target_path.find_last_not_of(" \t\n\r");
     if (start != std::string::npos) {
         target_path = target_path.substr(start, end - start + 1);
+    } else {
+        target_path.clear();
     }
     
     // Handle empty path (cd with no args goes to home)
@@ -153,187 +215,1274 @@ std::string Server::handleCdCommand(const std::string& path) {
     
     // Handle relative paths
     if (target_path[0] != '/') {
-        target_path = current_dir_ + "/" + target_path;
+        target_path = conn.current_dir + "/" + target_path;
     }
     
-    // Try to change directory
-    if (chdir(target_path.c_str()) == 0) {
-        // Update current directory
-        char cwd[1024];
-        if (getcwd(cwd, sizeof(cwd)) != nullptr) {
-            current_dir_ = cwd;
-            return "";  // Success, no output
-        } else {
-            return "cd: failed to get current directory\n";
-        }
-    } else {
+    // Canonicalise like getcwd() would after a chdir()
+    char resolved[PATH_MAX];
+    if (realpath(target_path.c_str(), resolved) == nullptr) {
+        return "cd: " + target_path + ": " + strerror(errno) + "\n";
+    }
+    
+    // Same permission rule as chdir(): search access is required
+    if (access(resolved, X_OK) != 0) {
         return "cd: " + target_path + ": " + strerror(errno) + "\n";
     }
+    
+    if (!enterDirectory(conn, resolved)) {
+        return "cd: " + target_path + ": " + strerror(errno) + "\n";
+    }
+    return "";  // Success, no output
 }
 
-// Handle client - command execution mode 
-void Server::handleClientCommand(Socket& client_socket) {
-    char buffer[BUFFER_SIZE];
+// Swap the session's directory fd and remember the directory for a resumed session
+bool Server::enterDirectory(Connection& conn, const std::string& dir) {
+    int dir_fd = open(dir.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        return false;
+    }
     
-    std::cout << Color::DIM << "  Mode: Command Execution" << Color::RESET << std::endl;
+    if (conn.dir_fd >= 0) {
+        close(conn.dir_fd);
+    }
+    conn.dir_fd = dir_fd;
+    conn.current_dir = dir;
+    if (!conn.auth_token.empty()) {
+        auth_->setWorkingDirectory(conn.auth_token, conn.current_dir);
+    }
+    return true;
+}
+
+// Handle a built-in command
+bool Server::handleBuiltinCommand(Connection& conn, const std::string& command, bool in_shell,
+                                  std::string& response, int& exit_code) {
+    // Check if it's a cd command
+    std::string trimmed = command;
+    size_t start = trimmed.find_first_not_of(" \t\n\r");
+    if (start != std::string::npos) {
+        trimmed = trimmed.substr(start);
+    }
     
-    // Perform authentication if required
-    std::string auth_token;
-    if (require_auth_) {
-        std::cout << Color::DIM << "  ⏳ Authenticating..." << Color::RESET << std::flush;
-        auth_token = authenticateClient(client_socket);
-        std::cout << "\r\033[K";  // Clear line
+    if (!in_shell && trimmed.substr(0, 2) == "cd" && (trimmed.length() == 2 || trimmed[2] == ' ' || trimmed[2] == '\t' || trimmed[2] == '\n')) {
+        // Handle cd command
+        std::string path = trimmed.substr(2);
+        std::string cd_result = handleCdCommand(conn, path);
         
-        if (auth_token.empty()) {
-            std::cout << Color::ROSE << "  ✖ Authentication failed" << Color::RESET << std::endl;
-            return;
+        if (cd_result.empty()) {
+            // Success - send current directory as confirmation
+            response = conn.current_dir + "\n";
+            exit_code = 0;
+        } else {
+            // Error
+            response = cd_result;
+            exit_code = 1;
         }
-        std::cout << Color::GREEN << "  ✔ Authenticated" << Color::RESET << std::endl;
+        return true;
     }
     
-    while (true) {
-        // Clear buffer
-        std::memset(buffer, 0, BUFFER_SIZE);
-        
-        // Receive command from client
-        ssize_t bytes_received = client_socket.recv(buffer, BUFFER_SIZE - 1, 0);
+    if (!in_shell && trimmed == "pwd") {
+        // Handle pwd command
+        response = conn.current_dir + "\n";
+        exit_code = 0;
+        return true;
+    }
+    
+    if (trimmed == "remoot") {
+        // Handle server restart command
+        response = "Server restart requested. Restarting...\n";
+        exit_code = 0;
+        std::cout << Color::PURPLE << "Restart requested by client. Shutting down for restart..." << Color::RESET << std::endl;
+        restart_requested_ = true;
+        return true;
+    }
+    
+    return false;
+}
+
+// Session body: suspends on the loop whenever it waits for the client or a pooled command
+Task Server::runSession(Connection& conn) {
+    Shard& shard = *conn.shard;
+    AsyncSocket& stream = *conn.stream;
+    int fd = stream.fd();
+    std::string out;
+    
+    try {
+        // Greeting tells the client whether to authenticate
+        out = Protocol::encodeFrame(Protocol::FrameType::Hello, 0, require_auth_ ? "AUTH_REQUIRED" : "READY");
+        co_await stream.async_send(out);
         
-        if (bytes_received <= 0) {
-            if (bytes_received == 0) {
-                std::cout << Color::GRAY << "Client disconnected" << Color::RESET << std::endl;
-            } else {
-                std::cerr << Color::ROSE << "Error receiving data" << Color::RESET << std::endl;
+        Protocol::Frame frame;
+        bool reading = true;
+        bool resume_tried = false;   // A RESUME was refused; the next attempt must be AUTH
+        while (running_ && reading) {
+            // Read in large batches until the parser holds a whole frame
+            bool have_frame = false;
+            std::string protocol_error;
+            try {
+                have_frame = conn.parser.next(frame);
+            } catch (const std::exception& e) {
+                protocol_error = e.what();
+            }
+            if (!protocol_error.empty()) {
+                std::cerr << Color::ROSE << "Protocol error from " << conn.peer << ": " << protocol_error << Color::RESET << std::endl;
+                out = Protocol::encodeFrame(Protocol::FrameType::Error, 0, protocol_error);
+                co_await stream.async_send(out);
+                break;
+            }
+            if (!have_frame) {
+                if (co_await stream.async_recv(conn.parser.buffer()) <= 0) {
+                    std::cout << Color::GRAY << "Client disconnected " << conn.peer << Color::RESET << std::endl;
+                    break;
+                }
+                continue;
+            }
+            
+            if (conn.state == Connection::State::Authenticating) {
+                // A client coming back presents its session token instead of the password
+                std::string reply;
+                bool resuming = frame.type == Protocol::FrameType::Resume && !resume_tried;
+                bool authenticated = false;
+                if (resuming) {
+                    authenticated = resumeClient(conn, frame.payload, reply);
+                } else if (frame.type != Protocol::FrameType::Auth) {
+                    reply = "Expected AUTH";
+                } else if (auth_pool_ && logins_pending_ >= MAX_PENDING_LOGINS_PER_THREAD * static_cast<size_t>(auth_threads_)) {
+                    // Login storm: refuse now rather than queue without bound
+                    reply = "Server busy, try again later";
+                } else {
+                    // The KDF takes milliseconds; run it on the auth pool so the loop keeps serving other sessions
+                    logins_pending_++;
+                    auto verifying = offload(auth_pool_.get(), *shard.loop, [this, &conn, &frame, &reply]() {
+                        return authenticateClient(conn, frame.payload, reply);
+                    });
+                    authenticated = co_await verifying;
+                    logins_pending_--;
+                }
+                
+                // Compression is on when both ends want it; output then has to pass through userspace
+                uint16_t flags = Protocol::FLAG_NONE;
+                if (authenticated && (frame.flags & Protocol::FLAG_COMPRESSED) && compression_level_ > 0) {
+                    conn.compression_level = compression_level_;
+                    conn.splice_output = false;
+                    flags = Protocol::FLAG_COMPRESSED;
+                }
+                out = Protocol::encodeFrame(authenticated ? Protocol::FrameType::AuthOk : Protocol::FrameType::AuthFailed,
+                                            frame.request_id, reply, flags);
+                co_await stream.async_send(out);
+                
+                // A stale token gets one answer; the client may still log in with its password
+                if (!authenticated && resuming) {
+                    resume_tried = true;
+                    std::cout << Color::GRAY << "  Session not resumed " << conn.peer << Color::RESET << std::endl;
+                    continue;
+                }
+                if (!authenticated) {
+                    std::cout << Color::ROSE << "  ✖ Authentication failed " << Color::RESET << Color::GRAY << conn.peer << Color::RESET << std::endl;
+                    break;
+                }
+                std::cout << Color::GREEN << (resuming ? "  ✔ Resumed session " : "  ✔ Authenticated ") << Color::RESET
+                          << Color::GRAY << conn.peer << Color::RESET << std::endl;
+                conn.state = Connection::State::Ready;
+                continue;
+            }
+            
+            switch (frame.type) {
+                case Protocol::FrameType::Command:
+                    if (!command_mode_) {
+                        out.clear();
+                        appendOutput(conn, out, frame.request_id, handleClientEcho(frame.payload));
+                        Protocol::appendFrame(out, Protocol::FrameType::Exit, frame.request_id, "0");
+                        co_await stream.async_send(out);
+                    } else if (!openChannel(conn, frame, out)) {
+                        co_await stream.async_send(out);
+                    }
+                    break;
+                
+                case Protocol::FrameType::Window: {
+                    auto it = conn.channels.find(frame.request_id);
+                    if (it != conn.channels.end() && it->second->window != SIZE_MAX) {
+                        Channel& channel = *it->second;
+                        size_t credit = std::strtoull(frame.payload.c_str(), nullptr, 10);
+                        channel.window = std::min(channel.window + credit, SIZE_MAX - 1);
+                        unpark(*shard.loop, channel.waiter);
+                    }
+                    break;
+                }
+                
+                case Protocol::FrameType::Cancel: {
+                    auto it = conn.channels.find(frame.request_id);
+                    if (it != conn.channels.end()) {
+                        cancelChannel(conn, *it->second);
+                    }
+                    if (conn.uploads.count(frame.request_id)) {
+                        closeUpload(conn, frame.request_id);
+                        out = Protocol::encodeFrame(Protocol::FrameType::Exit, frame.request_id, "1");
+                        co_await stream.async_send(out);
+                    }
+                    break;
+                }
+                
+                case Protocol::FrameType::Get:
+                case Protocol::FrameType::Archive:
+                    if (!command_mode_) {
+                        out.clear();
+                        appendOutput(conn, out, frame.request_id, "Error: File transfer requires command mode\n");
+                        Protocol::appendFrame(out, Protocol::FrameType::Exit, frame.request_id, "-1");
+                        co_await stream.async_send(out);
+                    } else if (!openChannel(conn, frame, out)) {
+                        co_await stream.async_send(out);
+                    }
+                    break;
+                
+                // Uploads are written as their DATA arrives; a complete file is hashed and confirmed
+                case Protocol::FrameType::Put:
+                case Protocol::FrameType::Data: {
+                    bool complete;
+                    if (!command_mode_) {
+                        out.clear();
+                        appendOutput(conn, out, frame.request_id, "Error: File transfer requires command mode\n");
+                        Protocol::appendFrame(out, Protocol::FrameType::Exit, frame.request_id, "-1");
+                        complete = false;
+                    } else if (frame.type == Protocol::FrameType::Put) {
+                        complete = false;
+                        Upload* upload = openUpload(conn, frame, out);
+                        if (upload) {
+                            // A resumed upload first hashes what the target already holds
+                            bool hashed = true;
+                            if (upload->offset > upload->start) {
+                                auto prefix = offload(session_pool_.get(), *shard.loop, [upload]() {
+                                    try {
+                                        upload->hash->updateFromFile(upload->fd, upload->start, upload->offset - upload->start);
+                                        return true;
+                                    } catch (const std::exception&) {
+                                        return false;
+                                    }
+                                });
+                                hashed = co_await prefix;
+                            }
+                            if (hashed) {
+                                out = Protocol::encodeFrame(Protocol::FrameType::File, frame.request_id, std::to_string(upload->offset));
+                                complete = upload->offset == upload->size;
+                            } else {
+                                closeUpload(conn, frame.request_id);
+                                out.clear();
+                                appendOutput(conn, out, frame.request_id, "Error: Cannot read the existing file\n");
+                                Protocol::appendFrame(out, Protocol::FrameType::Exit, frame.request_id, "1");
+                            }
+                        }
+                    } else if (auto it = conn.uploads.find(frame.request_id); it != conn.uploads.end() && it->second.block_size > 0) {
+                        // SYNC delta: copies read the old file, so apply it off the loop
+                        complete = false;
+                        out.clear();
+                        Upload* upload = &it->second;
+                        auto patch = offload(session_pool_.get(), *shard.loop, [upload, &frame]() {
+                            std::string error;
+                            Delta::apply(frame.payload, upload->base_fd, upload->block_size, upload->base_size,
+                                         upload->fd, upload->offset, upload->size, *upload->hash, error);
+                            return error;
+                        });
+                        std::string error = co_await patch;
+                        if (!error.empty()) {
+                            closeUpload(conn, frame.request_id);
+                            appendOutput(conn, out, frame.request_id, "Error: " + error + "\n");
+                            Protocol::appendFrame(out, Protocol::FrameType::Exit, frame.request_id, "1");
+                        }
+                    } else {
+                        complete = writeUpload(conn, frame, out);
+                    }
+                    
+                    // Everything is hashed as it is written, so the digest is ready now
+                    if (complete) {
+                        auto it = conn.uploads.find(frame.request_id);
+                        Protocol::appendFrame(out, Protocol::FrameType::Digest, frame.request_id, it->second.hash->finish());
+                        Protocol::appendFrame(out, Protocol::FrameType::Exit, frame.request_id, "0");
+                        closeUpload(conn, frame.request_id);
+                    }
+                    if (!out.empty()) {
+                        co_await stream.async_send(out);
+                    }
+                    break;
+                }
+                
+                // SYNC: send the signature of the current copy; the client's delta arrives as DATA
+                case Protocol::FrameType::Sync: {
+                    Upload* upload = nullptr;
+                    if (!command_mode_) {
+                        out.clear();
+                        appendOutput(conn, out, frame.request_id, "Error: File transfer requires command mode\n");
+                        Protocol::appendFrame(out, Protocol::FrameType::Exit, frame.request_id, "-1");
+                    } else {
+                        upload = openSync(conn, frame, out);
+                    }
+                    if (!upload) {
+                        co_await stream.async_send(out);
+                        break;
+                    }
+                    
+                    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+                    auto signing = offload(session_pool_.get(), *shard.loop, [upload, threads]() {
+                        try {
+                            return std::make_pair(true, Delta::signature(upload->base_fd, upload->base_size,
+                                                                         upload->block_size, threads));
+                        } catch (const std::exception& e) {
+                            return std::make_pair(false, std::string(e.what()));
+                        }
+                    });
+                    std::pair<bool, std::string> signature = co_await signing;
+                    if (!signature.first) {
+                        closeUpload(conn, frame.request_id);
+                        out.clear();
+                        appendOutput(conn, out, frame.request_id, "Error: " + signature.second + "\n");
+                        Protocol::appendFrame(out, Protocol::FrameType::Exit, frame.request_id, "1");
+                        co_await stream.async_send(out);
+                        break;
+                    }
+                    
+                    out = Protocol::encodeFrame(Protocol::FrameType::File, frame.request_id,
+                                                std::to_string(upload->block_size) + " " + std::to_string(upload->base_size));
+                    bool delivered = co_await stream.async_send(out);
+                    for (size_t sent = 0; delivered && sent < signature.second.size(); ) {
+                        size_t length = std::min(signature.second.size() - sent, FileTransfer::DATA_CHUNK_SIZE);
+                        out = Protocol::encodeFrame(Protocol::FrameType::Data, frame.request_id,
+                                                    std::string_view(signature.second).substr(sent, length));
+                        delivered = co_await stream.async_send(out);
+                        sent += length;
+                    }
+                    break;
+                }
+                
+                // SYNC: the client's digest ends its delta; a matching file replaces the old one in one rename
+                case Protocol::FrameType::Digest: {
+                    auto it = conn.uploads.find(frame.request_id);
+                    if (it == conn.uploads.end() || it->second.block_size == 0) {
+                        break;  // Failed or cancelled; the reply has gone out already
+                    }
+                    Upload* upload = &it->second;
+                    int dir_fd = conn.dir_fd;
+                    auto finishing = offload(session_pool_.get(), *shard.loop, [upload, dir_fd, &frame]() {
+                        if (upload->offset != upload->size) {
+                            return "Delta ended after " + std::to_string(upload->offset) + " of " +
+                                   std::to_string(upload->size) + " bytes";
+                        }
+                        std::string digest = upload->hash->finish();
+                        if (digest != frame.payload) {
+                            return std::string("SHA-256 mismatch; the file was left unchanged");
+                        }
+                        if (fchmod(upload->fd, upload->mode) < 0 || fsync(upload->fd) < 0 ||
+                            renameat(dir_fd, upload->temp.c_str(), dir_fd, upload->path.c_str()) < 0) {
+                            return upload->path + ": " + strerror(errno);
+                        }
+                        upload->temp.clear();
+                        return std::string();
+                    });
+                    std::string error = co_await finishing;
+                    
+                    out.clear();
+                    if (error.empty()) {
+                        Protocol::appendFrame(out, Protocol::FrameType::Digest, frame.request_id, frame.payload);
+                        Protocol::appendFrame(out, Protocol::FrameType::Exit, frame.request_id, "0");
+                    } else {
+                        appendOutput(conn, out, frame.request_id, "Error: " + error + "\n");
+                        Protocol::appendFrame(out, Protocol::FrameType::Exit, frame.request_id, "1");
+                    }
+                    closeUpload(conn, frame.request_id);
+                    co_await stream.async_send(out);
+                    break;
+                }
+                
+                default: {
+                    std::string message = std::string("Unexpected ") + Protocol::typeName(frame.type) + " frame";
+                    out = Protocol::encodeFrame(Protocol::FrameType::Error, frame.request_id, message);
+                    co_await stream.async_send(out);
+                    reading = false;
+                    break;
+                }
+            }
+            
+            // A client that pipelines faster than commands finish stops being read here; once
+            // AsyncSocket::MAX_BUFFERED_INPUT bytes back up the loop stops receiving, and TCP
+            // flow control holds the client
+            while (conn.turns.size() >= MAX_QUEUED_COMMANDS && stream.isOpen()) {
+                co_await park(conn.waiter);
             }
-            break;
         }
-        
-        std::string command(buffer, bytes_received);
-        std::cout << Color::GRAY << "Executing: " << Color::BG_PURPLE << " " << command.substr(0, command.length()-1) << " " << Color::RESET << std::endl;
-        
-        // Check if it's a cd command
-        std::string trimmed = command;
-        size_t start = trimmed.find_first_not_of(" \t\n\r");
-        if (start != std::string::npos) {
-            trimmed = trimmed.substr(start);
+    } catch (const std::exception& e) {
+        std::cerr << Color::ROSE << "Error: " << e.what() << Color::RESET << std::endl;
+    }
+    
+    // Channels use the connection until they finish; stop them and wait
+    for (auto& entry : conn.channels) {
+        cancelChannel(conn, *entry.second);
+    }
+    while (!conn.channels.empty()) {
+        co_await park(conn.waiter);
+    }
+    
+    // The idle timeout of a resumable session runs from when its client left
+    if (!conn.auth_token.empty()) {
+        auth_->updateActivity(conn.auth_token);
+    }
+    
+    // The frame is freed with the connection, once this coroutine has fully suspended
+    shard.loop->post([this, &shard, fd]() { closeConnection(shard, fd); });
+}
+
+// Create a channel for a COMMAND frame and start it
+bool Server::openChannel(Connection& conn, const Protocol::Frame& frame, std::string& out) {
+    bool concurrent = (frame.flags & Protocol::FLAG_CHANNEL) != 0;
+    
+    std::string refusal;
+    if (conn.channels.count(frame.request_id) || conn.uploads.count(frame.request_id)) {
+        refusal = "Error: Request id " + std::to_string(frame.request_id) + " is already running\n";
+    } else if (concurrent && conn.concurrent >= Protocol::MAX_CHANNELS) {
+        refusal = "Error: Too many channels\n";
+    }
+    if (!refusal.empty()) {
+        out.clear();
+        Protocol::appendFrame(out, Protocol::FrameType::Output, frame.request_id, refusal);
+        Protocol::appendFrame(out, Protocol::FrameType::Exit, frame.request_id, "-1");
+        return false;
+    }
+    
+    auto channel = std::make_unique<Channel>();
+    channel->id = frame.request_id;
+    channel->kind = frame.type;
+    channel->flags = frame.flags;
+    channel->command = frame.payload;
+    channel->ordered = !concurrent;
+    channel->window = concurrent ? Protocol::CHANNEL_WINDOW : SIZE_MAX;
+    
+    Channel& ref = *channel;
+    conn.channels[ref.id] = std::move(channel);
+    if (ref.ordered) {
+        conn.turns.push_back(ref.id);
+    } else {
+        conn.concurrent++;
+    }
+    
+    switch (ref.kind) {
+        case Protocol::FrameType::Get:     ref.task = runDownload(conn, ref); break;
+        case Protocol::FrameType::Archive: ref.task = runArchive(conn, ref); break;
+        default:                           ref.task = runChannel(conn, ref); break;
+    }
+    ref.task.start();
+    return true;
+}
+
+// Channel body: suspends on the loop whenever it waits for its turn, credit, the pipe or the client
+Task Server::runChannel(Connection& conn, Channel& channel) {
+    Shard& shard = *conn.shard;
+    AsyncSocket& stream = *conn.stream;
+    std::string out;
+    std::string packed;    // Compressed copy of the chunk in out
+    
+    try {
+        // Plain commands run one at a time, in the order they arrived
+        while (channel.ordered && conn.turns.front() != channel.id && !channel.cancelled) {
+            co_await park(channel.waiter);
         }
         
         std::string response;
+        int exit_code = -1;
+        bool delivered = stream.isOpen() && !channel.cancelled;
+        if (delivered) {
+            std::cout << Color::GRAY << "Executing: " << Color::BG_PURPLE << " " << channel.command << " " << Color::RESET << std::endl;
+        }
         
-        if (trimmed.substr(0, 2) == "cd" && (trimmed.length() == 2 || trimmed[2] == ' ' || trimmed[2] == '\t' || trimmed[2] == '\n')) {
-            // Handle cd command
-            std::string path = trimmed.substr(2);
-            std::string cd_result = handleCdCommand(path);
+        bool in_shell = persistent_shell_ && channel.ordered;
+        bool builtin = delivered && handleBuiltinCommand(conn, channel.command, in_shell, response, exit_code);
+        if (delivered && !builtin && in_shell) {
+            // The session's shell runs it, so its variables, functions and directory carry over.
+            // Its output ends at a status line rather than EOF, so it is read, split and
+            // re-framed here; it is never spliced
+            // The script goes in through the loop, since a shell still busy (e.g. with a job it
+            // left running) may leave the pipe full
+            try {
+                bool sent = false;
+                if (conn.shell) {
+                    std::string script = conn.shell->script(channel.command);
+                    AsyncPipeWriter input(*shard.loop, conn.shell->input());
+                    auto write = input.async_write(script);
+                    sent = co_await write;
+                }
+                if (!sent) {
+                    // First command, or the shell died since the last one: start another
+                    conn.shell.reset();
+                    conn.shell = std::make_unique<ShellSession>(conn.dir_fd, true);
+                    if (conn.shell->startFd() >= 0) {
+                        // The spawner answers once it has forked; the loop serves others meanwhile
+                        AsyncExit start(*shard.loop, conn.shell->startFd());
+                        auto forked = start.async_wait();
+                        co_await forked;
+                        conn.shell->finishStart();
+                    }
+                    std::string script = conn.shell->script(channel.command);
+                    AsyncPipeWriter input(*shard.loop, conn.shell->input());
+                    auto write = input.async_write(script);
+                    sent = co_await write;
+                    if (!sent) {
+                        throw std::runtime_error("Shell exited on start");
+                    }
+                }
+            } catch (const std::exception& e) {
+                conn.shell.reset();
+                response = std::string("Error: ") + e.what() + "\n";
+                exit_code = -1;
+            }
             
-            if (cd_result.empty()) {
-                // Success - send current directory as confirmation
-                response = current_dir_ + "\n";
-            } else {
-                // Error
-                response = cd_result;
-            }
-        } else if (trimmed == "pwd" || trimmed == "pwd\n") {
-            // Handle pwd command
-            response = current_dir_ + "\n";
-        } else if (trimmed == "remoot" || trimmed == "remoot\n") {
-            // Handle server restart command
-            response = "Server restart requested. Restarting...\n";
-            client_socket.send(response.c_str(), response.length(), 0);
-            std::cout << Color::PURPLE << "Restart requested by client. Shutting down for restart..." << Color::RESET << std::endl;
-            restart_requested_ = true;
-            running_ = false;
-            return;
-        } else {
-            // Make sure we're in the correct directory before executing
-            if (chdir(current_dir_.c_str()) != 0) {
-                response = "Error: Failed to change to working directory\n";
-            } else {
-                // Execute command
-                CommandExecutor::Result result = CommandExecutor::execute(command);
+            if (conn.shell) {
+                ShellSession& shell = *conn.shell;
+                channel.pid = shell.pid();
+                bool finished = false;
+                {
+                    AsyncPipe output(*shard.loop, shell.duplicateOutput());
+                    std::string chunk;
+                    std::string text;
+                    while (delivered && !channel.cancelled && !finished) {
+                        chunk.clear();
+                        ssize_t count = co_await output.async_read(chunk, OUTPUT_CHUNK_SIZE);
+                        text.clear();
+                        if (count > 0) {
+                            finished = shell.collect(chunk.data(), chunk.size(), text);
+                        } else {
+                            text = shell.drain();
+                        }
+                        if (!text.empty()) {
+                            // Only compression is worth a trip to the pool
+                            if (conn.compression_level > 0) {
+                                auto frame = offload(session_pool_.get(), *shard.loop, [this, &conn, &out, &channel, &text]() {
+                                    out.clear();
+                                    appendOutput(conn, out, channel.id, text);
+                                    return out.size();
+                                });
+                                co_await frame;
+                            } else {
+                                out.clear();
+                                appendOutput(conn, out, channel.id, text);
+                            }
+                            delivered = co_await stream.async_send(out);
+                        }
+                        if (count <= 0) {
+                            break;
+                        }
+                    }
+                }
+                channel.pid = 0;
                 
-                // Prepare response
-                if (!result.output.empty()) {
-                    response = result.output;
+                if (finished) {
+                    exit_code = shell.status();
+                    if (shell.directory() != conn.current_dir && !shell.directory().empty()) {
+                        enterDirectory(conn, shell.directory());
+                    }
                 } else {
-                    response = "(no output)\n";
+                    // The shell exited, or is abandoned with the command: reap it, and let the
+                    // next command start a new one
+                    CommandExecutor::Child child = shell.detach();
+                    conn.shell.reset();
+                    if (!delivered || channel.cancelled) {
+                        kill(-child.pid, SIGKILL);
+                    }
+                    {
+                        AsyncExit exit(*shard.loop, child.exit_fd);
+                        auto exited = exit.async_wait();
+                        co_await exited;
+                    }
+                    CommandExecutor::Result status = CommandExecutor::wait(child);
+                    response = status.output;
+                    exit_code = status.exit_code;
+                }
+            }
+        } else if (delivered && !builtin) {
+            CommandExecutor::Process process;
+            bool spawned = false;
+            try {
+                process = CommandExecutor::spawn(channel.command, conn.dir_fd, &conn.paths, true);
+                if (process.starting) {
+                    // The spawner answers once it has forked; the loop serves others meanwhile
+                    AsyncExit start(*shard.loop, process.exit_fd);
+                    auto forked = start.async_wait();
+                    co_await forked;
+                    CommandExecutor::finishLaunch(process);
                 }
+                spawned = true;
+            } catch (const std::exception& e) {
+                if (process.output_fd >= 0) {
+                    close(process.output_fd);
+                }
+                response = std::string("Error: ") + e.what() + "\n";
+                exit_code = -1;
+            }
+            
+            if (spawned) {
+                channel.pid = process.pid;
                 
-                // Add exit code if command failed
-                if (!result.success && result.exit_code >= 0) {
-                    response += "[Exit code: " + std::to_string(result.exit_code) + "]\n";
+                // Forward whatever the pipe holds as one OUTPUT frame at a time, no more than the
+                // window allows; the next chunk waits until the socket took the last, so a channel
+                // holds at most one chunk however much the command prints.
+                // Untransformed output is spliced pipe -> socket behind its header and never
+                // enters userspace; otherwise each chunk is read in place behind the header.
+                {
+                    AsyncPipe output(*shard.loop, process.output_fd);
+                    while (delivered && !channel.cancelled) {
+                        while (channel.window == 0 && !channel.cancelled) {
+                            co_await park(channel.waiter);
+                        }
+                        if (channel.cancelled) {
+                            break;
+                        }
+                        
+                        size_t length;
+                        out.resize(Protocol::HEADER_SIZE);
+                        if (conn.splice_output) {
+                            ssize_t buffered = co_await output.async_wait();
+                            if (buffered <= 0) {
+                                break;
+                            }
+                            length = std::min({static_cast<size_t>(buffered), SPLICE_CHUNK_SIZE, channel.window});
+                            Protocol::encodeHeader(out.data(), Protocol::FrameType::Output, channel.id,
+                                                   static_cast<uint32_t>(length));
+                            delivered = co_await stream.async_splice(out, output.fd(), length);
+                        } else {
+                            ssize_t count = co_await output.async_read(out, std::min(OUTPUT_CHUNK_SIZE, channel.window));
+                            if (count <= 0) {
+                                break;
+                            }
+                            length = static_cast<size_t>(count);
+                            Protocol::encodeHeader(out.data(), Protocol::FrameType::Output, channel.id,
+                                                   static_cast<uint32_t>(length));
+                            
+                            // Compress off the loop when a pool exists; keeps the plain frame if it does not shrink
+                            if (conn.compression_level > 0) {
+                                std::string_view payload(out.data() + Protocol::HEADER_SIZE, length);
+                                auto squeeze = offload(session_pool_.get(), *shard.loop, [this, &conn, &packed, &channel, payload]() {
+                                    packed.clear();
+                                    appendOutput(conn, packed, channel.id, payload);
+                                    return packed.size();
+                                });
+                                co_await squeeze;
+                                out.swap(packed);
+                            }
+                            delivered = co_await stream.async_send(out);
+                        }
+                        if (channel.window != SIZE_MAX) {
+                            channel.window -= length;
+                        }
+                    }
+                }
+                
+                // Nobody is left to read the rest: stop the command instead of draining it
+                if (!delivered || channel.cancelled) {
+                    kill(-process.pid, SIGKILL);
                 }
+                
+                // Output EOF usually means exit, but a command may linger after closing its output;
+                // its exit fd turns readable once it is gone, and reaping after that never blocks
+                // Named awaiter: GCC 12 mishandles temporaries inside a co_await expression
+                {
+                    AsyncExit exit(*shard.loop, process.exit_fd);
+                    auto exited = exit.async_wait();
+                    co_await exited;
+                }
+                CommandExecutor::Result status = CommandExecutor::wait(process);
+                channel.pid = 0;
+                response = status.output;
+                exit_code = status.exit_code;
+                std::cout << Color::GRAY << "Finished: exit " << exit_code << ", " << status.user_us / 1000 << " ms user, "
+                          << status.system_us / 1000 << " ms system, " << status.max_rss_kb << " KiB max RSS"
+                          << Color::RESET << std::endl;
             }
         }
         
-        // Send response back to client
-        try {
-            client_socket.send(response.c_str(), response.length(), 0);
-        } catch (const std::exception& e) {
-            std::cerr << "Error sending response: " << e.what() << std::endl;
-            break;
+        // Remaining output, then the terminal frame, both tagged with the request they answer
+        if (stream.isOpen()) {
+            out.clear();
+            if (!response.empty()) {
+                appendOutput(conn, out, channel.id, response);
+            }
+            Protocol::appendFrame(out, Protocol::FrameType::Exit, channel.id, std::to_string(exit_code));
+            co_await stream.async_send(out);
+        }
+        
+        if (restart_requested_) {
+            requestShutdown();
         }
+    } catch (const std::exception& e) {
+        std::cerr << Color::ROSE << "Error: " << e.what() << Color::RESET << std::endl;
     }
+    
+    retireChannel(conn, channel);
 }
 
-// Main server -  loop
-void Server::run() {
-    running_ = true;
+// Like runChannel, but the payload comes from a regular file and leaves through sendfile()
+Task Server::runDownload(Connection& conn, Channel& channel) {
+    Shard& shard = *conn.shard;
+    AsyncSocket& stream = *conn.stream;
+    std::string out;
+    int fd = -1;
     
-    // Install SIGCHLD handler if using fork
-    if (use_fork_) {
-        struct sigaction sa;
-        sa.sa_handler = sigchldHandler;
-        sigemptyset(&sa.sa_mask);
-        sa.sa_flags = SA_RESTART;  // Restart interrupted system calls
+    try {
+        while (channel.ordered && conn.turns.front() != channel.id && !channel.cancelled) {
+            co_await park(channel.waiter);
+        }
         
-        if (sigaction(SIGCHLD, &sa, nullptr) < 0) {
-            std::cerr << "Warning: Failed to install SIGCHLD handler: " 
-                      << strerror(errno) << std::endl;
+        // Whole file from offset on (digest of all of it), or one chunk (digest of the chunk)
+        bool chunk = (channel.flags & Protocol::FLAG_CHUNK) != 0;
+        uint64_t numbers[2] = {0, 0};
+        uint64_t size = 0;
+        uint64_t end = 0;
+        std::string path;
+        std::string error;
+        if (!FileTransfer::parseRequest(channel.command, chunk ? 2 : 1, numbers, path)) {
+            error = "Malformed GET request";
+        } else if ((fd = openat(conn.dir_fd, path.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+            error = path + ": " + strerror(errno);
         } else {
-            std::cout << "SIGCHLD handler installed for zombie reaping" << std::endl;
+            struct stat st;
+            if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+                error = path + ": Not a regular file";
+            } else {
+                size = static_cast<uint64_t>(st.st_size);
+                end = chunk ? numbers[0] + numbers[1] : size;
+                if (numbers[0] > size || end > size || end < numbers[0]) {
+                    error = path + ": Range is past the end of the file";
+                }
+            }
         }
-    }
-    
-    while (running_) {
-        try {
-            sockaddr_in client_addr;
-            
-            // Animated spinner for waiting
-            const char spinner[] = {'/', '-', '\\', '|'};
-            int spinner_idx = 0;
+        uint64_t offset = numbers[0];
+        uint64_t hash_from = chunk ? offset : 0;
+        
+        bool delivered = stream.isOpen() && !channel.cancelled;
+        std::string digest;
+        if (error.empty() && delivered) {
+            if (!chunk) {
+                std::cout << Color::GRAY << "Sending: " << Color::BG_PURPLE << " " << path << " " << Color::RESET << std::endl;
+            }
             
-            // Non-blocking accept with spinner
-            std::cout << Color::DIM << "\rWaiting for connection " << spinner[0] << Color::RESET << std::flush;
+            // The client checks its copy against the whole file, so a resumed transfer is verified too.
+            // With a pool the hash runs while the data goes out; the job posts its result back
+            bool hashing = session_pool_ != nullptr;
+            if (hashing) {
+                EventLoop* loop = shard.loop.get();
+                session_pool_->submit([loop, fd, hash_from, end, &digest, &hashing, &channel]() {
+                    std::string result;
+                    try {
+                        result = FileTransfer::sha256(fd, hash_from, end - hash_from);
+                    } catch (const std::exception&) {
+                    }
+                    loop->post([loop, result, &digest, &hashing, &channel]() {
+                        digest = result;
+                        hashing = false;
+                        unpark(*loop, channel.waiter);
+                    });
+                });
+            }
             
-            // Set socket to non-blocking temporarily for spinner
-            int flags = fcntl(listen_socket_.get(), F_GETFL, 0);
-            fcntl(listen_socket_.get(), F_SETFL, flags | O_NONBLOCK);
+            out = Protocol::encodeFrame(Protocol::FrameType::File, channel.id, std::to_string(size));
+            delivered = co_await stream.async_send(out);
             
-            Socket client_socket;
-            while (running_) {
-                try {
-                    client_socket = listen_socket_.accept(client_addr);
-                    break;  // Connection received!
-                } catch (...) {
-                    // No connection yet, update spinner
-                    spinner_idx = (spinner_idx + 1) % 4;
-                    std::cout << "\rWaiting for connection " << Color::DIM << spinner[spinner_idx] << Color::RESET << std::flush;
-                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            while (delivered && offset < end && !channel.cancelled) {
+                while (channel.window == 0 && !channel.cancelled) {
+                    co_await park(channel.waiter);
+                }
+                if (channel.cancelled) {
+                    break;
+                }
+                
+                size_t length = static_cast<size_t>(std::min<uint64_t>(end - offset, std::min(FileTransfer::DATA_CHUNK_SIZE, channel.window)));
+                out.resize(Protocol::HEADER_SIZE);
+                Protocol::encodeHeader(out.data(), Protocol::FrameType::Data, channel.id, static_cast<uint32_t>(length));
+                delivered = co_await stream.async_sendfile(out, fd, static_cast<off_t>(offset), length);
+                offset += length;
+                if (channel.window != SIZE_MAX) {
+                    channel.window -= length;
                 }
             }
             
-            // Restore blocking mode
-            fcntl(listen_socket_.get(), F_SETFL, flags);
-            
-            if (!running_) break;
+            // The job reads fd and writes into this frame, so wait for it even when cancelled
+            while (hashing) {
+                co_await park(channel.waiter);
+            }
+            if (delivered && !channel.cancelled) {
+                if (!session_pool_) {
+                    try {
+                        digest = FileTransfer::sha256(fd, hash_from, end - hash_from);
+                    } catch (const std::exception&) {
+                    }
+                }
+                if (digest.empty()) {
+                    error = path + ": Read failed";
+                }
+            } else {
+                error = "Cancelled";
+            }
+        }
+        
+        if (stream.isOpen()) {
+            out.clear();
+            if (!error.empty()) {
+                appendOutput(conn, out, channel.id, "Error: " + error + "\n");
+            } else {
+                Protocol::appendFrame(out, Protocol::FrameType::Digest, channel.id, digest);
+            }
+            Protocol::appendFrame(out, Protocol::FrameType::Exit, channel.id, error.empty() ? "0" : "1");
+            co_await stream.async_send(out);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << Color::ROSE << "Error: " << e.what() << Color::RESET << std::endl;
+    }
+    
+    if (fd >= 0) {
+        close(fd);
+    }
+    retireChannel(conn, channel);
+}
+
+// Tar headers are built on the loop and ride in front of the next file body, which leaves
+// through sendfile() like a GET; compressed archives come out of a GzipPipeline instead
+Task Server::runArchive(Connection& conn, Channel& channel) {
+    Shard& shard = *conn.shard;
+    AsyncSocket& stream = *conn.stream;
+    std::string out;
+    Archive::Entry entry;
+    entry.fd = -1;
+    
+    try {
+        while (channel.ordered && conn.turns.front() != channel.id && !channel.cancelled) {
+            co_await park(channel.waiter);
+        }
+        
+        std::unique_ptr<Archive::Walker> walker;
+        std::string error;
+        try {
+            walker = std::make_unique<Archive::Walker>(conn.dir_fd, channel.command);
+        } catch (const std::exception& e) {
+            error = e.what();
+        }
+        
+        bool delivered = stream.isOpen() && !channel.cancelled;
+        if (error.empty() && delivered) {
+            std::cout << Color::GRAY << "Archiving: " << Color::BG_PURPLE << " " << channel.command << " " << Color::RESET << std::endl;
             
-            // Clear spinner line
-            std::cout << "\r\033[K";
+            if (channel.flags & Protocol::FLAG_COMPRESSED) {
+                EventLoop* loop = shard.loop.get();
+                int level = compression_level_ > 0 ? compression_level_ : Compression::DEFAULT_LEVEL;
+                Archive::GzipPipeline pipeline(std::move(walker), level, [loop, &channel]() {
+                    loop->post([loop, &channel]() { unpark(*loop, channel.waiter); });
+                });
+                
+                std::string chunk;
+                while (delivered && !channel.cancelled) {
+                    if (!pipeline.take(chunk)) {
+                        if (pipeline.finished()) {
+                            break;
+                        }
+                        co_await park(channel.waiter);
+                        continue;
+                    }
+                    for (size_t sent = 0; delivered && sent < chunk.size() && !channel.cancelled; ) {
+                        while (channel.window == 0 && !channel.cancelled) {
+                            co_await park(channel.waiter);
+                        }
+                        if (channel.cancelled) {
+                            break;
+                        }
+                        size_t length = std::min({chunk.size() - sent, FileTransfer::DATA_CHUNK_SIZE, channel.window});
+                        out = Protocol::encodeFrame(Protocol::FrameType::Data, channel.id, std::string_view(chunk).substr(sent, length));
+                        delivered = co_await stream.async_send(out);
+                        sent += length;
+                        if (channel.window != SIZE_MAX) {
+                            channel.window -= length;
+                        }
+                    }
+                }
+                error = pipeline.error();
+            } else {
+                // Headers and padding collect in pending until the next frame goes out
+                std::string pending;
+                bool walking = true;
+                while (delivered && !channel.cancelled && (walking || !pending.empty())) {
+                    uint64_t offset = 0;
+                    if (walking && !walker->next(entry)) {
+                        walking = false;
+                        pending += Archive::trailer();
+                    } else if (walking) {
+                        pending += Archive::header(entry);
+                    }
+                    
+                    // Body in frames of at most DATA_CHUNK_SIZE, pending bytes in front of the first
+                    bool body = walking && entry.fd >= 0;
+                    while (delivered && !channel.cancelled &&
+                           ((body && offset < entry.size) || pending.size() >= FileTransfer::DATA_CHUNK_SIZE || (!walking && !pending.empty()))) {
+                        while (channel.window == 0 && !channel.cancelled) {
+                            co_await park(channel.waiter);
+                        }
+                        if (channel.cancelled) {
+                            break;
+                        }
+                        size_t budget = std::min(FileTransfer::DATA_CHUNK_SIZE, channel.window);
+                        size_t head = std::min(pending.size(), budget);
+                        size_t length = body ? static_cast<size_t>(std::min<uint64_t>(entry.size - offset, budget - head)) : 0;
+                        out.resize(Protocol::HEADER_SIZE);
+                        Protocol::encodeHeader(out.data(), Protocol::FrameType::Data, channel.id, static_cast<uint32_t>(head + length));
+                        out.append(pending, 0, head);
+                        pending.erase(0, head);
+                        
+                        // sendfile() cannot pad a file that shrank since its header was written
+                        struct stat st;
+                        if (length == 0) {
+                            delivered = co_await stream.async_send(out);
+                        } else if (fstat(entry.fd, &st) == 0 && static_cast<uint64_t>(st.st_size) >= offset + length) {
+                            delivered = co_await stream.async_sendfile(out, entry.fd, static_cast<off_t>(offset), length);
+                        } else if (Archive::readPadded(entry.fd, offset, length, out)) {
+                            delivered = co_await stream.async_send(out);
+                        } else {
+                            error = entry.name + ": " + strerror(errno);
+                            break;
+                        }
+                        offset += length;
+                        if (channel.window != SIZE_MAX) {
+                            channel.window -= head + length;
+                        }
+                    }
+                    if (body) {
+                        pending.append(Archive::padding(entry.size), '\0');
+                        close(entry.fd);
+                        entry.fd = -1;
+                    }
+                    if (!error.empty()) {
+                        break;
+                    }
+                }
+            }
+            if (error.empty() && (!delivered || channel.cancelled)) {
+                error = "Cancelled";
+            }
+        }
+        
+        if (stream.isOpen()) {
+            out.clear();
+            if (!error.empty()) {
+                appendOutput(conn, out, channel.id, "Error: " + error + "\n");
+            }
+            Protocol::appendFrame(out, Protocol::FrameType::Exit, channel.id, error.empty() ? "0" : "1");
+            co_await stream.async_send(out);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << Color::ROSE << "Error: " << e.what() << Color::RESET << std::endl;
+    }
+    
+    if (entry.fd >= 0) {
+        close(entry.fd);
+    }
+    retireChannel(conn, channel);
+}
+
+// Without FLAG_RESUME the target is truncated; with it, a target no longer than the upload is kept
+Server::Upload* Server::openUpload(Connection& conn, const Protocol::Frame& frame, std::string& out) {
+    out.clear();
+    
+    // Chunks of one file arrive on several connections at once: each sizes the file (a no-op once
+    // one has) and writes only its own range, so none of them truncates another's data
+    bool chunk = (frame.flags & Protocol::FLAG_CHUNK) != 0;
+    uint64_t numbers[3] = {0, 0, 0};
+    std::string path;
+    std::string error;
+    int fd = -1;
+    uint64_t start = 0;
+    uint64_t offset = 0;
+    uint64_t end = 0;
+    if (conn.channels.count(frame.request_id) || conn.uploads.count(frame.request_id)) {
+        error = "Request id " + std::to_string(frame.request_id) + " is already running";
+    } else if (!FileTransfer::parseRequest(frame.payload, chunk ? 3 : 1, numbers, path)) {
+        error = "Malformed PUT request";
+    } else if (chunk && (numbers[0] + numbers[1] > numbers[2] || numbers[0] + numbers[1] < numbers[0])) {
+        error = "Chunk is past the end of the file";
+    } else if ((fd = openat(conn.dir_fd, path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0) {
+        error = path + ": " + strerror(errno);
+    } else {
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            error = path + ": Not a regular file";
+        } else if (chunk) {
+            start = offset = numbers[0];
+            end = numbers[0] + numbers[1];
+            if (static_cast<uint64_t>(st.st_size) != numbers[2] && ftruncate(fd, static_cast<off_t>(numbers[2])) < 0) {
+                error = path + ": " + strerror(errno);
+            }
+        } else {
+            end = numbers[0];
+            bool resume = (frame.flags & Protocol::FLAG_RESUME) && static_cast<uint64_t>(st.st_size) <= end;
+            offset = resume ? static_cast<uint64_t>(st.st_size) : 0;
+            if (ftruncate(fd, static_cast<off_t>(offset)) < 0) {
+                error = path + ": " + strerror(errno);
+            }
+        }
+    }
+    
+    if (!error.empty()) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        appendOutput(conn, out, frame.request_id, "Error: " + error + "\n");
+        Protocol::appendFrame(out, Protocol::FrameType::Exit, frame.request_id, "1");
+        return nullptr;
+    }
+    
+    if (!chunk) {
+        std::cout << Color::GRAY << "Receiving: " << Color::BG_PURPLE << " " << path << " " << Color::RESET << std::endl;
+    }
+    Upload& upload = conn.uploads[frame.request_id];
+    upload.fd = fd;
+    upload.start = start;
+    upload.offset = offset;
+    upload.size = end;
+    upload.hash = std::make_unique<FileTransfer::Sha256>();
+    return &upload;
+}
+
+bool Server::writeUpload(Connection& conn, const Protocol::Frame& frame, std::string& out) {
+    out.clear();
+    
+    auto it = conn.uploads.find(frame.request_id);
+    if (it == conn.uploads.end()) {
+        return false;  // Cancelled or failed upload; its remaining DATA is dropped
+    }
+    Upload& upload = it->second;
+    
+    std::string error;
+    if (frame.payload.size() > upload.size - upload.offset) {
+        error = "More data than announced";
+    }
+    size_t written = 0;
+    while (error.empty() && written < frame.payload.size()) {
+        ssize_t count = pwrite(upload.fd, frame.payload.data() + written, frame.payload.size() - written,
+                               static_cast<off_t>(upload.offset + written));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            error = std::string("Write failed: ") + strerror(count < 0 ? errno : ENOSPC);
+            break;
+        }
+        written += static_cast<size_t>(count);
+    }
+    
+    if (!error.empty()) {
+        closeUpload(conn, frame.request_id);
+        appendOutput(conn, out, frame.request_id, "Error: " + error + "\n");
+        Protocol::appendFrame(out, Protocol::FrameType::Exit, frame.request_id, "1");
+        return false;
+    }
+    
+    upload.hash->update(frame.payload.data(), written);
+    upload.offset += written;
+    return upload.offset == upload.size;
+}
+
+// The new file is built under a hidden name in the target's directory, so the final rename
+// replaces the old one atomically; missing parent directories are created (syncing a tree)
+Server::Upload* Server::openSync(Connection& conn, const Protocol::Frame& frame, std::string& out) {
+    out.clear();
+    
+    uint64_t numbers[2] = {0, 0};
+    std::string path;
+    std::string error;
+    int base_fd = -1;
+    int fd = -1;
+    std::string temp;
+    uint64_t base_size = 0;
+    if (conn.channels.count(frame.request_id) || conn.uploads.count(frame.request_id)) {
+        error = "Request id " + std::to_string(frame.request_id) + " is already running";
+    } else if (!FileTransfer::parseRequest(frame.payload, 2, numbers, path) || path.back() == '/') {
+        error = "Malformed SYNC request";
+    } else {
+        for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+            mkdirat(conn.dir_fd, path.substr(0, slash).c_str(), 0755);
+        }
+        
+        struct stat st;
+        base_fd = openat(conn.dir_fd, path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (base_fd < 0 && errno != ENOENT) {
+            error = path + ": " + strerror(errno);
+        } else if (base_fd >= 0 && (fstat(base_fd, &st) < 0 || !S_ISREG(st.st_mode))) {
+            error = path + ": Not a regular file";
+        } else {
+            base_size = base_fd >= 0 ? static_cast<uint64_t>(st.st_size) : 0;
             
+            static std::atomic<uint64_t> temp_counter{0};
+            size_t name = path.find_last_of('/') + 1;
+            temp = path.substr(0, name) + "." + path.substr(name) + ".sync-" + std::to_string(getpid()) + "-" +
+                   std::to_string(temp_counter++);
+            fd = openat(conn.dir_fd, temp.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            if (fd < 0) {
+                error = path + ": " + strerror(errno);
+            }
+        }
+    }
+    
+    if (!error.empty()) {
+        if (base_fd >= 0) {
+            close(base_fd);
+        }
+        appendOutput(conn, out, frame.request_id, "Error: " + error + "\n");
+        Protocol::appendFrame(out, Protocol::FrameType::Exit, frame.request_id, "1");
+        return nullptr;
+    }
+    
+    std::cout << Color::GRAY << "Syncing: " << Color::BG_PURPLE << " " << path << " " << Color::RESET << std::endl;
+    Upload& upload = conn.uploads[frame.request_id];
+    upload.fd = fd;
+    upload.start = 0;
+    upload.offset = 0;
+    upload.size = numbers[0];
+    upload.hash = std::make_unique<FileTransfer::Sha256>();
+    upload.base_fd = base_fd;
+    upload.block_size = Delta::blockSize(base_size);
+    upload.base_size = base_size;
+    upload.mode = static_cast<mode_t>(numbers[1] & 07777);
+    upload.temp = temp;
+    upload.path = path;
+    return &upload;
+}
+
+void Server::closeUpload(Connection& conn, uint32_t request_id) {
+    auto it = conn.uploads.find(request_id);
+    if (it == conn.uploads.end()) {
+        return;
+    }
+    close(it->second.fd);
+    if (it->second.base_fd >= 0) {
+        close(it->second.base_fd);
+    }
+    if (!it->second.temp.empty()) {
+        unlinkat(conn.dir_fd, it->second.temp.c_str(), 0);
+    }
+    conn.uploads.erase(it);
+}
+
+void Server::cancelChannel(Connection& conn, Channel& channel) {
+    channel.cancelled = true;
+    if (channel.pid > 0) {
+        kill(-channel.pid, SIGKILL);
+    }
+    unpark(*conn.shard->loop, channel.waiter);
+}
+
+// Pass the turn on now; the channel itself is freed from the loop after this coroutine suspends
+void Server::retireChannel(Connection& conn, Channel& channel) {
+    EventLoop& loop = *conn.shard->loop;
+    
+    if (channel.ordered) {
+        conn.turns.erase(std::find(conn.turns.begin(), conn.turns.end(), channel.id));
+        if (!conn.turns.empty()) {
+            unpark(loop, conn.channels[conn.turns.front()]->waiter);
+        }
+    } else {
+        conn.concurrent--;
+    }
+    
+    Channel* finished = &channel;
+    loop.post([&conn, &loop, finished]() {
+        auto it = conn.channels.find(finished->id);
+        if (it != conn.channels.end() && it->second.get() == finished) {
+            conn.channels.erase(it);
+        }
+        unpark(loop, conn.waiter);
+    });
+}
+
+// Register an accepted client
+void Server::openConnection(Shard& shard, Socket client_socket, const std::string& peer) {
+    auto conn = std::make_unique<Connection>();
+    conn->stream = std::make_unique<AsyncSocket>(*shard.loop, std::move(client_socket));
+    conn->shard = &shard;
+    conn->peer = peer;
+    conn->state = require_auth_ ? Connection::State::Authenticating : Connection::State::Ready;
+    conn->current_dir = current_dir_;
+    conn->dir_fd = open(current_dir_.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+    
+    Connection& ref = *conn;
+    shard.connections[ref.stream->fd()] = std::move(conn);
+    
+    std::cout << Color::DIM << "  Mode: " << (command_mode_ ? "Command Execution" : "Echo") << Color::RESET << std::endl;
+    
+    ref.session = runSession(ref);
+    ref.session.start();
+}
+
+// Unregister and close a client
+void Server::closeConnection(Shard& shard, int fd) {
+    shard.connections.erase(fd);  // Destroys the session frame, then the socket
+}
+
+// Serve one client in a forked child with a private event loop
+void Server::serveForkedClient(Shard& shard, Socket client_socket, const std::string& peer) {
+    // Child doesn't need listening sockets; the parent's epoll instance / ring is
+    // shared across fork, so drop them without touching it
+    shard.acceptor->abandon();
+    if (shard.expiry_timer >= 0) {
+        close(std::exchange(shard.expiry_timer, -1));  // The parent sweeps
+    }
+    
+    // This runs from the inherited loop's poll(), still on the stack below, so that loop is
+    // leaked rather than destroyed: its watches and ring mappings stay valid until exit
+    shard.loop.release();
+    shard.loop = std::make_unique<EventLoop>();
+    openConnection(shard, std::move(client_socket), peer);
+    
+    while (running_ && !shard.connections.empty()) {
+        shard.loop->poll(-1);
+    }
+}
+
+// Reap a session child once its pidfd turns readable; nothing else waits for it
+void Server::watchForkedClient(Shard& shard, pid_t pid) {
+    int fd = CommandExecutor::pidfd(pid);
+    if (fd < 0) {
+        // Still reaped, just later: acceptClients() polls these on every connection
+        std::cerr << Color::ROSE << "Warning: pidfd_open failed for PID " << pid << ": " << strerror(errno)
+                  << Color::RESET << std::endl;
+        shard.unwatched.push_back(pid);
+        return;
+    }
+    
+    EventLoop& loop = *shard.loop;
+    loop.add(fd, EPOLLIN, [&loop, fd, pid](uint32_t) {
+        if (waitpid(pid, nullptr, WNOHANG) == 0) {
+            return;
+        }
+        loop.remove(fd);
+        close(fd);
+    });
+}
+
+// Accept loop: hand each client to a forked child or an in-process session
+Task Server::acceptClients(Shard& shard) {
+    AsyncAcceptor& acceptor = *shard.acceptor;
+    
+    while (running_) {
+        Socket client_socket = co_await acceptor.async_accept();
+        if (!client_socket.isValid()) {
+            break;  // Acceptor closed and drained
+        }
+        
+        // Forked clients that could not get a pidfd
+        shard.unwatched.erase(std::remove_if(shard.unwatched.begin(), shard.unwatched.end(), [](pid_t pid) {
+            return waitpid(pid, nullptr, WNOHANG) != 0;
+        }), shard.unwatched.end());
+        
+        try {
             // Convert client address to string
+            sockaddr_in client_addr;
+            socklen_t addr_len = sizeof(client_addr);
+            std::memset(&client_addr, 0, sizeof(client_addr));
+            getpeername(client_socket.get(), reinterpret_cast<sockaddr*>(&client_addr), &addr_len);
+            
             char client_ip[INET_ADDRSTRLEN];
             inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+            std::string peer = std::string(client_ip) + ":" + std::to_string(ntohs(client_addr.sin_port));
             std::cout << Color::THEME << "→ " << Color::RESET << "Connection from " 
-                      << Color::THEME << client_ip << ":" << ntohs(client_addr.sin_port) << Color::RESET << std::endl;
+                      << Color::THEME << peer << Color::RESET << std::endl;
             
             if (use_fork_) {
                 // Fork to handle client in separate process (Phase 2)
@@ -347,47 +1496,269 @@ void Server::run() {
                 
                 if (pid == 0) {
                     // Child process
-                    listen_socket_.close();  // Child doesn't need listening socket
-                    
                     try {
-                        if (command_mode_) {
-                            handleClientCommand(client_socket);
-                        } else {
-                            handleClientEcho(client_socket);
-                        }
+                        serveForkedClient(shard, std::move(client_socket), peer);
                     } catch (const std::exception& e) {
                         std::cerr << "Error in child process: " << e.what() << std::endl;
                     }
                     exit(0);// Exit child process
-                } else {
-                    
-                    // Parent process
-                    client_socket.close();  // Parent doesn't need client socket
-                    std::cout << Color::GRAY << "Spawned process (PID: " << pid << ")" << Color::RESET << std::endl;
-                }
-            } else {
-                // Handle client in main process (Phase 1)
-                if (command_mode_) {
-                    handleClientCommand(client_socket);
-                } else {
-                    handleClientEcho(client_socket);
                 }
+                
+                // Parent process: client_socket goes out of scope and is closed
+                std::cout << Color::GRAY << "Spawned process (PID: " << pid << ")" << Color::RESET << std::endl;
+                watchForkedClient(shard, pid);
+                continue;
             }
             
+            // Handle client in this process (single mode or pool worker)
+            openConnection(shard, std::move(client_socket), peer);
+            shard.sessions_served++;
+            
+            // Recycle the worker once it has served its quota; open sessions keep running
+            if (max_sessions_per_worker_ > 0 && shard.sessions_served >= max_sessions_per_worker_ && acceptor.isOpen()) {
+                acceptor.close();
+            }
         } catch (const std::exception& e) {
             std::cerr << Color::ROSE << "Error: " << e.what() << Color::RESET << std::endl;
-            if (!use_fork_) {
-                // continue to accept new connections in single-client mode
+        }
+    }
+}
+
+// Register listeners and dispatch until the shard has nothing left to serve
+void Server::runShard(Shard& shard, bool exclusive_accept) {
+    // The loop accepts as soon as a connection is pending and resumes the accept coroutine
+    shard.acceptor = std::make_unique<AsyncAcceptor>(*shard.loop);
+    for (Socket& listener : shard.listeners) {
+        shard.acceptor->listen(std::move(listener), exclusive_accept);
+    }
+    shard.listeners.clear();
+    
+    shard.accept_task = acceptClients(shard);
+    shard.accept_task.start();
+    
+    // Sessions expire as they fall due, not in one long catch-up when a shard is next used
+    if (shard.index == 0) {
+        startExpiryTimer(shard);
+    }
+    
+    // After the acceptor closes, drain open sessions before returning
+    while (running_ && (shard.acceptor->isOpen() || !shard.connections.empty())) {
+        shard.loop->poll(-1);
+    }
+    
+    if (shard.expiry_timer >= 0) {
+        shard.loop->remove(shard.expiry_timer);
+        close(std::exchange(shard.expiry_timer, -1));
+    }
+}
+
+// Sweep the session table once a second from this shard's loop
+void Server::startExpiryTimer(Shard& shard) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    struct itimerspec interval = {{1, 0}, {1, 0}};
+    if (fd < 0 || timerfd_settime(fd, 0, &interval, nullptr) < 0) {
+        std::cerr << Color::ROSE << "Warning: Session expiry timer unavailable: " << strerror(errno)
+                  << Color::RESET << std::endl;
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    
+    shard.expiry_timer = fd;
+    shard.loop->add(fd, EPOLLIN, [this, fd](uint32_t) {
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+            auth_->cleanupExpiredSessions();
+        }
+    });
+}
+
+// Stop all shards; wakes loops blocked on other threads
+void Server::requestShutdown() {
+    running_ = false;
+    for (auto& shard : shards_) {
+        EventLoop* loop = shard->loop.get();
+        loop->post([loop]() { loop->stop(); });
+    }
+}
+
+// One pinned thread per shard
+void Server::runShards() {
+    // CPUs this process may run on
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    std::vector<int> cpus;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    
+    for (auto& shard_ptr : shards_) {
+        Shard* shard = shard_ptr.get();
+        shard->thread = std::thread([this, shard]() {
+            try {
+                runShard(*shard, false);
+            } catch (const std::exception& e) {
+                std::cerr << Color::ROSE << "Error in shard " << shard->index << ": " << e.what() << Color::RESET << std::endl;
+                requestShutdown();
+            }
+        });
+        
+        if (!cpus.empty()) {
+            cpu_set_t cpu;
+            CPU_ZERO(&cpu);
+            CPU_SET(cpus[shard->index % cpus.size()], &cpu);
+            int err = pthread_setaffinity_np(shard->thread.native_handle(), sizeof(cpu), &cpu);
+            if (err != 0) {
+                std::cerr << "Warning: Failed to pin shard " << shard->index << ": " << strerror(err) << std::endl;
+            }
+        }
+    }
+    
+    for (auto& shard : shards_) {
+        shard->thread.join();
+    }
+}
+
+// Worker body
+void Server::runWorker() {
+    worker_pids_.clear();
+    Shard& shard = *shards_[0];
+    
+    // Fresh reactor: the supervisor's epoll instance / ring must not be shared
+    shard.loop = std::make_unique<EventLoop>();
+    
+    // Threads do not survive fork, so each worker builds its own pools
+    if (session_threads_ > 0) {
+        session_pool_ = std::make_unique<ThreadPool>(session_threads_);
+    }
+    if (auth_threads_ > 0) {
+        auth_pool_ = std::make_unique<ThreadPool>(auth_threads_);
+    }
+    
+    // EPOLLEXCLUSIVE wakes one waiting worker per connection instead of all of them
+    runShard(shard, true);
+}
+
+// Fork one pool worker
+void Server::spawnWorker() {
+    pid_t pid = fork();
+    
+    if (pid < 0) {
+        std::cerr << "Fork failed: " << strerror(errno) << std::endl;
+        return;
+    }
+    
+    if (pid == 0) {
+        int status = 0;
+        try {
+            runWorker();
+        } catch (const std::exception& e) {
+            std::cerr << "Error in worker process: " << e.what() << std::endl;
+        }
+        if (restart_requested_) {
+            status = RESTART_EXIT_CODE;
+        }
+        exit(status);
+    }
+    
+    worker_pids_.push_back(pid);
+    std::cout << Color::GRAY << "Started worker (PID: " << pid << ")" << Color::RESET << std::endl;
+}
+
+// Supervise the pool: replace workers as they are recycled
+void Server::runPreforkSupervisor() {
+    for (int i = 0; i < prefork_workers_; i++) {
+        spawnWorker();
+    }
+    
+    while (running_) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        
+        if (pid < 0) {
+            if (errno == EINTR) {
                 continue;
             }
+            std::cerr << "waitpid failed: " << strerror(errno) << std::endl;
+            break;
         }
+        
+        // The spawner is a child of this process too; only workers are replaced
+        auto worker = std::find(worker_pids_.begin(), worker_pids_.end(), pid);
+        if (worker == worker_pids_.end()) {
+            continue;
+        }
+        worker_pids_.erase(worker);
+        
+        if (WIFEXITED(status) && WEXITSTATUS(status) == RESTART_EXIT_CODE) {
+            std::cout << Color::PURPLE << "Restart requested by worker " << pid << Color::RESET << std::endl;
+            restart_requested_ = true;
+            running_ = false;
+            break;
+        }
+        
+        if (running_) {
+            std::cout << Color::GRAY << "Worker " << pid << " exited, recycling" << Color::RESET << std::endl;
+            spawnWorker();
+        }
+    }
+    
+    // Take the rest of the pool down with us
+    for (pid_t pid : worker_pids_) {
+        kill(pid, SIGTERM);
+    }
+    for (pid_t pid : worker_pids_) {
+        waitpid(pid, nullptr, 0);
+    }
+    worker_pids_.clear();
+}
+
+// Main server -  loop
+void Server::run() {
+    running_ = true;
+    
+    // splice() to a vanished client has no MSG_NOSIGNAL; let it fail with EPIPE instead
+    signal(SIGPIPE, SIG_IGN);
+    
+    // Pre-forked pool: this process only supervises, workers accept
+    if (prefork_workers_ > 0) {
+        std::cout << Color::DIM << "Waiting for connections..." << Color::RESET << std::endl;
+        runPreforkSupervisor();
+        return;
+    }
+    
+    // Forked session children run commands inline, so only in-process sessions get a pool.
+    // A forked child serves one client, so its login may as well block it
+    if (session_threads_ > 0 && !use_fork_) {
+        session_pool_ = std::make_unique<ThreadPool>(session_threads_);
+    }
+    if (auth_threads_ > 0 && !use_fork_) {
+        auth_pool_ = std::make_unique<ThreadPool>(auth_threads_);
+    }
+    
+    std::cout << Color::DIM << "Waiting for connections..." << Color::RESET << std::endl;
+    
+    if (shards_.size() > 1) {
+        runShards();
+    } else {
+        runShard(*shards_[0], false);
     }
 }
 
 // Stop server
 void Server::stop() {
     running_ = false;
-    listen_socket_.close();
+    for (pid_t pid : worker_pids_) {
+        kill(pid, SIGTERM);
+    }
+    for (auto& shard : shards_) {
+        shard->loop->stop();
+    }
     std::cout << Color::GRAY << "\nServer stopped." << Color::RESET << std::endl;
 }
 
@@ -401,6 +1772,70 @@ void Server::setUseFork(bool use_fork) {
     }
 }
 
+// Enable or disable the pre-forked worker pool
+void Server::setPrefork(int workers, int max_sessions_per_worker) {
+    prefork_workers_ = workers > 0 ? workers : 0;
+    max_sessions_per_worker_ = max_sessions_per_worker > 0 ? max_sessions_per_worker : 0;
+    if (prefork_workers_ > 0) {
+        std::cout << Color::GRAY << "Mode: Multi-client (prefork, " << prefork_workers_ << " workers";
+        if (max_sessions_per_worker_ > 0) {
+            std::cout << ", recycled after " << max_sessions_per_worker_ << " sessions";
+        }
+        std::cout << ")" << Color::RESET << std::endl;
+    }
+}
+
+// Run session commands on a thread pool
+void Server::setSessionThreads(int threads) {
+    session_threads_ = threads > 0 ? threads : 0;
+    if (session_threads_ > 0) {
+        std::cout << Color::GRAY << "Mode: Multi-client (threads, " << session_threads_ << " command threads)" << Color::RESET << std::endl;
+    }
+}
+
+// Password KDF cost, verification threads and login cache
+void Server::setAuthOptions(int kdf_iterations, int threads, int cache_seconds) {
+    auth_->setKdfIterations(kdf_iterations);
+    auth_->setCacheLifetime(std::chrono::seconds(cache_seconds));
+    auth_threads_ = threads > 0 ? threads : 0;
+    if (auth_threads_ > 0) {
+        std::cout << Color::GRAY << "Password checks: " << auth_threads_ << " threads" << Color::RESET << std::endl;
+    }
+}
+
+// Commands of a session share one shell coprocess
+void Server::setPersistentShell(bool enable) {
+    persistent_shell_ = enable;
+    if (persistent_shell_) {
+        std::cout << Color::GRAY << "Persistent shell: one per session" << Color::RESET << std::endl;
+    }
+}
+
+// zlib levels run 1 (fastest) to 9 (smallest)
+void Server::setCompressionLevel(int level) {
+    compression_level_ = level > 0 ? std::min(level, 9) : 0;
+    if (compression_level_ > 0) {
+        std::cout << Color::GRAY << "Output compression: zlib level " << compression_level_ << Color::RESET << std::endl;
+    }
+}
+
+// Run one SO_REUSEPORT listener per shard
+void Server::setShards(int shards) {
+    shard_count_ = shards > 0 ? shards : 0;
+    if (shard_count_ > 0) {
+        std::cout << Color::GRAY << "Mode: Multi-client (" << shard_count_ << " sharded event loops)" << Color::RESET << std::endl;
+    }
+}
+
+// Set bind address and ports
+void Server::setListenAddress(const std::string& address, const std::vector<int>& ports) {
+    bind_address_ = address.empty() ? "0.0.0.0" : address;
+    if (!ports.empty()) {
+        ports_ = ports;
+        port_ = ports.front();
+    }
+}
+
 // Enable or disable command mode
 void Server::setCommandMode(bool enable) {
     command_mode_ = enable;
@@ -431,47 +1866,15 @@ bool Server::isRestartRequested() const {
     return restart_requested_;
 }
 
-// Perform authentication handshake with client
-std::string Server::authenticateClient(Socket& client_socket) {
-    char buffer[BUFFER_SIZE];
-    
-    // Send authentication request
-    const char* auth_prompt = "AUTH_REQUIRED\n";
-    client_socket.send(auth_prompt, strlen(auth_prompt), 0);
-    
-    // Receive credentials (format: "AUTH username:password")
-    std::memset(buffer, 0, BUFFER_SIZE);
-    ssize_t bytes_received = client_socket.recv(buffer, BUFFER_SIZE - 1, 0);
-    
-    if (bytes_received <= 0) {
-        std::cerr << "Failed to receive authentication credentials" << std::endl;
-        return "";
-    }
-    
-    std::string auth_msg(buffer, bytes_received);
-    
-    // Remove trailing newline
-    if (!auth_msg.empty() && auth_msg.back() == '\n') {
-        auth_msg.pop_back();
-    }
-    
-    // Parse AUTH command
-    if (auth_msg.find("AUTH ") != 0) {
-        std::cerr << "Invalid authentication message format" << std::endl;
-        const char* error_msg = "AUTH_FAILED Invalid format\n";
-        client_socket.send(error_msg, strlen(error_msg), 0);
-        return "";
-    }
-    
-    // Extract credentials
-    std::string credentials = auth_msg.substr(5); // Skip "AUTH "
+// Authenticate a client from its AUTH frame
+bool Server::authenticateClient(Connection& conn, const std::string& credentials, std::string& reply) {
+    // Payload format: "username:password"
     size_t delimiter_pos = credentials.find(':');
     
     if (delimiter_pos == std::string::npos) {
         std::cerr << "Invalid credentials format" << std::endl;
-        const char* error_msg = "AUTH_FAILED Invalid credentials format\n";
-        client_socket.send(error_msg, strlen(error_msg), 0);
-        return "";
+        reply = "Invalid credentials format";
+        return false;
     }
     
     std::string username = credentials.substr(0, delimiter_pos);
@@ -481,14 +1884,39 @@ std::string Server::authenticateClient(Socket& client_socket) {
     std::string token = auth_->authenticate(username, password);
     
     if (token.empty()) {
-        const char* error_msg = "AUTH_FAILED Invalid username or password\n";
-        client_socket.send(error_msg, strlen(error_msg), 0);
-        return "";
+        reply = "Invalid username or password";
+        return false;
     }
     
-    // Send success with token
-    std::string success_msg = "AUTH_SUCCESS " + token + "\n";
-    client_socket.send(success_msg.c_str(), success_msg.length(), 0);
+    // Reply with the session token
+    conn.auth_token = token;
+    reply = token;
+    
+    return true;
+}
+
+// Resume a session from its token; the credentials were checked when it was issued
+bool Server::resumeClient(Connection& conn, const std::string& token, std::string& reply) {
+    if (!auth_->validateToken(token)) {
+        reply = "Invalid or expired session";
+        return false;
+    }
+    auth_->updateActivity(token);
+    
+    // Back to where the session was, if that directory is still there
+    std::string dir = auth_->getWorkingDirectory(token);
+    if (!dir.empty()) {
+        int dir_fd = open(dir.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd >= 0) {
+            if (conn.dir_fd >= 0) {
+                close(conn.dir_fd);
+            }
+            conn.dir_fd = dir_fd;
+            conn.current_dir = dir;
+        }
+    }
     
-    return token;
+    conn.auth_token = token;
+    reply = token;
+    return true;
 }
@@ -0,0 +1,562 @@
+#include "SessionStore.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace {
+
+constexpr char MAGIC[8] = {'R', 'C', 'E', 'S', 'E', 'S', 'S', '1'};
+constexpr uint32_t VERSION = 2;
+
+constexpr size_t KEY_SIZE = SessionStore::TOKEN_SIZE / 2;
+constexpr uint32_t SLOT_MASK = SessionStore::SLOTS_PER_SHARD - 1;
+constexpr uint32_t NONE = 0;                // Wheel links hold record index + 1
+
+constexpr size_t WHEEL_LEVELS = 4;
+constexpr unsigned WHEEL_BITS = 6;
+constexpr size_t WHEEL_SLOTS = size_t(1) << WHEEL_BITS;
+constexpr int64_t WHEEL_SPAN = int64_t(1) << (WHEEL_BITS * WHEEL_LEVELS);  // Seconds the wheel reaches ahead
+constexpr int64_t MAX_CATCH_UP = 3600;      // Ticks to replay one by one; a shard left idle longer is rescanned
+
+// One session; times are seconds since the epoch so they mean the same after a restart
+struct Record {
+    uint8_t used;
+    uint8_t level;                          // Wheel bucket holding the record
+    uint8_t slot;
+    uint8_t reserved;
+    uint32_t next;                          // Neighbours in that bucket
+    uint32_t prev;
+    uint8_t key[KEY_SIZE];
+    int64_t created;
+    int64_t last_activity;
+    int64_t expires;
+    char username[SessionStore::MAX_USERNAME + 1];
+    char working_dir[SessionStore::MAX_WORKING_DIR + 1];
+};
+
+int64_t now() {
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::chrono::system_clock::time_point timePoint(int64_t seconds) {
+    return std::chrono::system_clock::time_point(std::chrono::seconds(seconds));
+}
+
+void copyField(char* field, size_t size, const std::string& value) {
+    size_t length = std::min(value.size(), size - 1);
+    std::memcpy(field, value.data(), length);
+    field[length] = '\0';
+}
+
+int hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Raw bytes of a hex token; false if it is not one
+bool decodeToken(const std::string& token, uint8_t* key) {
+    if (token.size() != SessionStore::TOKEN_SIZE) {
+        return false;
+    }
+    for (size_t i = 0; i < KEY_SIZE; i++) {
+        int high = hexValue(token[2 * i]);
+        int low = hexValue(token[2 * i + 1]);
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        key[i] = static_cast<uint8_t>(high << 4 | low);
+    }
+    return true;
+}
+
+std::string encodeToken(const uint8_t* key) {
+    static const char digits[] = "0123456789abcdef";
+    std::string token(SessionStore::TOKEN_SIZE, '0');
+    for (size_t i = 0; i < KEY_SIZE; i++) {
+        token[2 * i] = digits[key[i] >> 4];
+        token[2 * i + 1] = digits[key[i] & 0xf];
+    }
+    return token;
+}
+
+// Tokens come from a CSPRNG, so their leading bytes are already a good hash
+uint64_t hashKey(const uint8_t* key) {
+    uint64_t hash;
+    std::memcpy(&hash, key, sizeof(hash));
+    return hash;
+}
+
+} // namespace
+
+struct SessionStore::Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t shards;
+    uint32_t slots;
+    uint32_t record_size;
+};
+
+/**
+ * One shard: an open-addressing table plus the timer wheel threading its
+ * live records. Level L of the wheel covers expiries up to 64^(L+1) seconds
+ * ahead in 64^L-second slots; on each tick the due slots of the upper levels
+ * cascade down, and the current level-0 slot is expired.
+ */
+struct alignas(64) SessionStore::Shard {
+    pthread_mutex_t mutex;         // PTHREAD_PROCESS_SHARED | PTHREAD_MUTEX_ROBUST
+    uint32_t count;
+    int64_t wheel_time;            // Last tick processed (0: wheel not started)
+    uint32_t heads[WHEEL_LEVELS][WHEEL_SLOTS];
+    Record records[SLOTS_PER_SHARD];
+
+    static uint32_t home(const uint8_t* key) {
+        return static_cast<uint32_t>(hashKey(key) >> 6) & SLOT_MASK;
+    }
+
+    Record* find(const uint8_t* key) {
+        for (uint32_t i = home(key), probes = 0; probes < SLOTS_PER_SHARD; i = (i + 1) & SLOT_MASK, probes++) {
+            if (!records[i].used) {
+                return nullptr;
+            }
+            if (std::memcmp(records[i].key, key, KEY_SIZE) == 0) {
+                return &records[i];
+            }
+        }
+        return nullptr;
+    }
+
+    uint32_t indexOf(const Record* record) const {
+        return static_cast<uint32_t>(record - records);
+    }
+
+    void link(uint32_t index, size_t level, size_t slot) {
+        Record& record = records[index];
+        record.level = static_cast<uint8_t>(level);
+        record.slot = static_cast<uint8_t>(slot);
+        record.prev = NONE;
+        record.next = heads[level][slot];
+        if (record.next != NONE) {
+            records[record.next - 1].prev = index + 1;
+        }
+        heads[level][slot] = index + 1;
+    }
+
+    void unlink(uint32_t index) {
+        Record& record = records[index];
+        if (record.prev != NONE) {
+            records[record.prev - 1].next = record.next;
+        } else {
+            heads[record.level][record.slot] = record.next;
+        }
+        if (record.next != NONE) {
+            records[record.next - 1].prev = record.prev;
+        }
+    }
+
+    // File a linked-out record under its expiry; one already due goes in the slot being expired
+    void schedule(uint32_t index) {
+        int64_t expires = records[index].expires;
+        int64_t delta = expires - wheel_time;
+        if (delta <= 0) {
+            link(index, 0, static_cast<uint64_t>(wheel_time) & (WHEEL_SLOTS - 1));
+            return;
+        }
+        if (delta >= WHEEL_SPAN) {
+            expires = wheel_time + WHEEL_SPAN - 1;  // Revisited when that slot cascades
+            delta = WHEEL_SPAN - 1;
+        }
+        size_t level = 0;
+        while (delta >= int64_t(1) << (WHEEL_BITS * (level + 1))) {
+            level++;
+        }
+        link(index, level, (static_cast<uint64_t>(expires) >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+    }
+
+    // Move a record to a free slot, keeping its wheel neighbours pointing at it
+    void relocate(uint32_t from, uint32_t to) {
+        records[to] = records[from];
+        Record& record = records[to];
+        if (record.prev != NONE) {
+            records[record.prev - 1].next = to + 1;
+        } else {
+            heads[record.level][record.slot] = to + 1;
+        }
+        if (record.next != NONE) {
+            records[record.next - 1].prev = to + 1;
+        }
+        records[from].used = 0;
+    }
+
+    // Drop a record; later members of its probe run shift back so lookups need no tombstones
+    void remove(uint32_t index) {
+        unlink(index);
+        records[index].used = 0;
+        count--;
+        uint32_t hole = index;
+        for (uint32_t i = (hole + 1) & SLOT_MASK; records[i].used; i = (i + 1) & SLOT_MASK) {
+            uint32_t wanted = home(records[i].key);
+            bool reachable = hole <= i ? (hole < wanted && wanted <= i) : (hole < wanted || wanted <= i);
+            if (!reachable) {
+                relocate(i, hole);
+                hole = i;
+            }
+        }
+    }
+
+    // Record at the front of the wheel, the next to expire or close to it
+    uint32_t earliest() const {
+        for (size_t level = 0; level < WHEEL_LEVELS; level++) {
+            uint64_t current = static_cast<uint64_t>(wheel_time) >> (WHEEL_BITS * level);
+            for (size_t offset = 0; offset < WHEEL_SLOTS; offset++) {
+                uint32_t head = heads[level][(current + offset) & (WHEEL_SLOTS - 1)];
+                if (head != NONE) {
+                    return head - 1;
+                }
+            }
+        }
+        return SLOTS_PER_SHARD;
+    }
+
+    void expire(std::vector<std::string>& expired, uint32_t index) {
+        expired.push_back(records[index].username);
+        remove(index);
+    }
+
+    // Run the wheel up to time, expiring what falls due
+    void advance(int64_t time, std::vector<std::string>& expired) {
+        // An empty wheel has nothing to cascade or expire, however far behind it is
+        if (count == 0) {
+            wheel_time = time;
+            return;
+        }
+        if (wheel_time == 0 || time - wheel_time > MAX_CATCH_UP || time < wheel_time) {
+            rebuild(time, expired);
+            return;
+        }
+        while (wheel_time < time) {
+            wheel_time++;
+            uint64_t tick = static_cast<uint64_t>(wheel_time);
+            for (size_t level = WHEEL_LEVELS - 1; level > 0; level--) {
+                if ((tick & ((uint64_t(1) << (WHEEL_BITS * level)) - 1)) != 0) {
+                    continue;
+                }
+                size_t slot = (tick >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+                while (heads[level][slot] != NONE) {
+                    uint32_t index = heads[level][slot] - 1;
+                    unlink(index);
+                    schedule(index);
+                }
+            }
+            size_t slot = tick & (WHEEL_SLOTS - 1);
+            while (heads[0][slot] != NONE) {
+                uint32_t index = heads[0][slot] - 1;
+                if (records[index].expires <= wheel_time) {
+                    expire(expired, index);
+                } else {
+                    unlink(index);
+                    schedule(index);
+                }
+            }
+        }
+    }
+
+    // Refile every record from scratch; only after the wheel was left behind (a restart after more
+    // than MAX_CATCH_UP, a clock jump)
+    void rebuild(int64_t time, std::vector<std::string>& expired) {
+        wheel_time = time;
+        std::memset(heads, 0, sizeof(heads));
+        std::vector<uint8_t> due;
+        for (uint32_t i = 0; i < SLOTS_PER_SHARD; i++) {
+            if (records[i].used) {
+                schedule(i);
+                if (records[i].expires <= time) {
+                    due.insert(due.end(), records[i].key, records[i].key + KEY_SIZE);
+                }
+            }
+        }
+        // Removal shifts records around, so go by key
+        for (size_t i = 0; i < due.size(); i += KEY_SIZE) {
+            expire(expired, indexOf(find(&due[i])));
+        }
+    }
+
+    // Make the shard consistent after a process died while changing it: a backward shift may have
+    // left a record twice or out of reach of its probe run, and wheel links may be half rewritten
+    // (cycles, dangling indices). Every used record is rehashed into a clean table, then the
+    // wheel is refiled from scratch
+    void repair(int64_t time) {
+        std::vector<Record> live;
+        for (const Record& record : records) {
+            if (record.used) {
+                live.push_back(record);
+            }
+        }
+        std::memset(records, 0, sizeof(records));
+        count = 0;
+        for (const Record& record : live) {
+            if (count >= MAX_LIVE || find(record.key)) {
+                continue;  // The copy a relocation left behind
+            }
+            uint32_t index = home(record.key);
+            while (records[index].used) {
+                index = (index + 1) & SLOT_MASK;
+            }
+            records[index] = record;
+            count++;
+        }
+        std::vector<std::string> expired;
+        rebuild(time, expired);
+    }
+};
+
+namespace {
+
+constexpr size_t HEADER_SPACE = 64;  // Header, padded so the shards stay cache-line aligned
+
+// Holds a shard's robust mutex; repairs the shard if its last owner died while holding it
+template <typename ShardType>
+class ShardLock {
+private:
+    pthread_mutex_t* mutex_;
+
+public:
+    explicit ShardLock(ShardType* shard) : mutex_(&shard->mutex) {
+        if (pthread_mutex_lock(mutex_) == EOWNERDEAD) {
+            // A worker died mid-update, possibly halfway through a shift or a relink
+            shard->repair(now());
+            pthread_mutex_consistent(mutex_);
+        }
+    }
+    ~ShardLock() {
+        pthread_mutex_unlock(mutex_);
+    }
+    ShardLock(const ShardLock&) = delete;
+    ShardLock& operator=(const ShardLock&) = delete;
+};
+
+} // namespace
+
+SessionStore::SessionStore(const std::string& path, std::chrono::seconds max_idle)
+    : base_(MAP_FAILED), size_(HEADER_SPACE + SHARDS * sizeof(Shard)), persistent_(false),
+      max_idle_(std::max(max_idle, std::chrono::seconds(1))) {
+    static_assert(sizeof(Header) <= HEADER_SPACE, "Header must fit its space");
+    static_assert((SLOTS_PER_SHARD & SLOT_MASK) == 0, "Slots per shard must be a power of two");
+
+    // A file outlives the process; the lock serialises first-time setup between processes
+    std::string dir = path.substr(0, path.find_last_of('/') == std::string::npos ? 0 : path.find_last_of('/'));
+    if (!dir.empty()) {
+        mkdir(dir.c_str(), 0755);
+    }
+    bool fresh = true;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd >= 0 && flock(fd, LOCK_EX) == 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (static_cast<size_t>(st.st_size) == size_ || ftruncate(fd, static_cast<off_t>(size_)) == 0)) {
+            base_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if (base_ != MAP_FAILED) {
+            const Header* header = static_cast<const Header*>(base_);
+            fresh = static_cast<size_t>(st.st_size) != size_ || std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 ||
+                    header->version != VERSION || header->shards != SHARDS || header->slots != SLOTS_PER_SHARD ||
+                    header->record_size != sizeof(Record);
+            persistent_ = true;
+        }
+    }
+    if (base_ == MAP_FAILED) {
+        std::cerr << "Warning: Cannot map session file " << path << " (" << strerror(errno)
+                  << "); sessions will not survive a restart" << std::endl;
+        base_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (base_ == MAP_FAILED) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            throw std::runtime_error(std::string("Cannot map session table: ") + strerror(errno));
+        }
+    }
+
+    // New, or written by an incompatible build: start empty. The file is sparse and the
+    // pages are zero already, so only the headers and the mutexes are touched
+    if (fresh) {
+        if (persistent_ && (ftruncate(fd, 0) != 0 || ftruncate(fd, static_cast<off_t>(size_)) != 0)) {
+            std::memset(base_, 0, size_);
+        }
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        for (size_t i = 0; i < SHARDS; i++) {
+            pthread_mutex_init(&shard(i)->mutex, &attr);
+        }
+        pthread_mutexattr_destroy(&attr);
+
+        Header* header = static_cast<Header*>(base_);
+        header->version = VERSION;
+        header->shards = SHARDS;
+        header->slots = SLOTS_PER_SHARD;
+        header->record_size = sizeof(Record);
+        std::memcpy(header->magic, MAGIC, sizeof(MAGIC));
+    }
+    if (fd >= 0) {
+        // The mapping keeps the open file (and so the flock) alive past close(); unlock explicitly
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+}
+
+SessionStore::~SessionStore() {
+    munmap(base_, size_);
+}
+
+SessionStore::Shard* SessionStore::shard(size_t index) const {
+    return reinterpret_cast<Shard*>(static_cast<char*>(base_) + HEADER_SPACE) + index;
+}
+
+SessionStore::Shard* SessionStore::shardFor(const std::string& token, uint8_t* key) const {
+    if (!decodeToken(token, key)) {
+        return nullptr;
+    }
+    return shard(hashKey(key) % SHARDS);
+}
+
+void SessionStore::insert(const std::string& token, const std::string& username) {
+    uint8_t key[KEY_SIZE];
+    Shard* shard = shardFor(token, key);
+    if (!shard) {
+        throw std::invalid_argument("Session token must be " + std::to_string(TOKEN_SIZE) + " hex characters");
+    }
+    ShardLock lock(shard);
+    int64_t time = now();
+    std::vector<std::string> expired;
+    shard->advance(time, expired);
+
+    Record* record = shard->find(key);
+    if (record) {
+        shard->remove(shard->indexOf(record));
+    }
+    if (shard->count >= MAX_LIVE) {
+        shard->remove(shard->earliest());  // Full: the session closest to expiring gives way
+    }
+    uint32_t index = Shard::home(key);
+    while (shard->records[index].used) {
+        index = (index + 1) & SLOT_MASK;
+    }
+
+    record = &shard->records[index];
+    std::memcpy(record->key, key, KEY_SIZE);
+    copyField(record->username, sizeof(record->username), username);
+    record->created = time;
+    record->last_activity = time;
+    record->expires = time + max_idle_.count();
+    record->working_dir[0] = '\0';
+    record->used = 1;
+    shard->count++;
+    shard->schedule(index);
+}
+
+bool SessionStore::find(const std::string& token, Session& session) const {
+    uint8_t key[KEY_SIZE];
+    Shard* shard = shardFor(token, key);
+    if (!shard) {
+        return false;
+    }
+    ShardLock lock(shard);
+    const Record* record = shard->find(key);
+    if (!record) {
+        return false;
+    }
+    session.username = record->username;
+    session.token = encodeToken(record->key);
+    session.created_at = timePoint(record->created);
+    session.last_activity = timePoint(record->last_activity);
+    session.working_dir = record->working_dir;
+    return true;
+}
+
+bool SessionStore::touch(const std::string& token) {
+    uint8_t key[KEY_SIZE];
+    Shard* shard = shardFor(token, key);
+    if (!shard) {
+        return false;
+    }
+    ShardLock lock(shard);
+    Record* record = shard->find(key);
+    if (record) {
+        uint32_t index = shard->indexOf(record);
+        record->last_activity = now();
+        record->expires = record->last_activity + max_idle_.count();
+        shard->unlink(index);
+        shard->schedule(index);
+    }
+    return record != nullptr;
+}
+
+bool SessionStore::setWorkingDirectory(const std::string& token, const std::string& dir) {
+    uint8_t key[KEY_SIZE];
+    Shard* shard = shardFor(token, key);
+    if (!shard) {
+        return false;
+    }
+    ShardLock lock(shard);
+    Record* record = shard->find(key);
+    if (record) {
+        copyField(record->working_dir, sizeof(record->working_dir), dir.size() <= MAX_WORKING_DIR ? dir : "");
+    }
+    return record != nullptr;
+}
+
+bool SessionStore::erase(const std::string& token) {
+    uint8_t key[KEY_SIZE];
+    Shard* shard = shardFor(token, key);
+    if (!shard) {
+        return false;
+    }
+    ShardLock lock(shard);
+    Record* record = shard->find(key);
+    if (record) {
+        shard->remove(shard->indexOf(record));
+    }
+    return record != nullptr;
+}
+
+std::vector<std::string> SessionStore::sweep() {
+    std::vector<std::string> expired;
+    int64_t time = now();
+    for (size_t i = 0; i < SHARDS; i++) {
+        // Empty shards are skipped unlocked; an insert racing this advances its own wheel
+        Shard* current = shard(i);
+        if (__atomic_load_n(&current->count, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        ShardLock lock(current);
+        current->advance(time, expired);
+    }
+    return expired;
+}
+
+size_t SessionStore::count() const {
+    size_t total = 0;
+    for (size_t i = 0; i < SHARDS; i++) {
+        total += __atomic_load_n(&shard(i)->count, __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+bool SessionStore::persistent() const {
+    return persistent_;
+}
@@ -0,0 +1,180 @@
+#include "ShellSession.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/random.h>
+
+namespace {
+
+constexpr size_t SENTINEL_BYTES = 16;
+constexpr int PIPE_CAPACITY = 1024 * 1024;
+
+// Quote for the shell: everything literal inside '...', with ' itself as '\''
+std::string quote(const std::string& text) {
+    std::string quoted = "'";
+    for (char c : text) {
+        if (c == '\'') {
+            quoted += "'\\''";
+        } else {
+            quoted += c;
+        }
+    }
+    quoted += "'";
+    return quoted;
+}
+
+} // namespace
+
+// Start the coprocess
+ShellSession::ShellSession(int dir_fd, bool deferred) : input_fd_(-1), output_fd_(-1), status_(0) {
+    unsigned char random[SENTINEL_BYTES];
+    if (getrandom(random, sizeof(random), 0) != static_cast<ssize_t>(sizeof(random))) {
+        throw std::runtime_error(std::string("Failed to generate shell sentinel: ") + strerror(errno));
+    }
+    static const char digits[] = "0123456789abcdef";
+    marker_ = "__rce_";
+    for (unsigned char byte : random) {
+        marker_ += digits[byte >> 4];
+        marker_ += digits[byte & 0xf];
+    }
+    marker_ += ':';
+    
+    int input[2];
+    int output[2];
+    if (pipe2(input, O_CLOEXEC) < 0) {
+        throw std::runtime_error(std::string("Failed to create pipe: ") + strerror(errno));
+    }
+    if (pipe2(output, O_CLOEXEC) < 0) {
+        int error = errno;
+        close(input[0]);
+        close(input[1]);
+        throw std::runtime_error(std::string("Failed to create pipe: ") + strerror(error));
+    }
+    fcntl(output[0], F_SETPIPE_SZ, PIPE_CAPACITY);
+    
+    // Only the server's end: the shell's stdin stays blocking
+    int flags = fcntl(input[1], F_GETFL, 0);
+    if (flags < 0 || fcntl(input[1], F_SETFL, flags | O_NONBLOCK) < 0) {
+        int error = errno;
+        close(input[0]);
+        close(input[1]);
+        close(output[0]);
+        close(output[1]);
+        throw std::runtime_error(std::string("Failed to set shell input non-blocking: ") + strerror(error));
+    }
+    
+    char* argv[] = {const_cast<char*>("sh"), nullptr};
+    try {
+        child_ = CommandExecutor::launch("/bin/sh", argv, dir_fd, input[0], output[1], deferred);
+    } catch (const std::exception&) {
+        close(input[0]);
+        close(input[1]);
+        close(output[0]);
+        close(output[1]);
+        throw;
+    }
+    close(input[0]);
+    close(output[1]);
+    input_fd_ = input[1];
+    output_fd_ = output[0];
+}
+
+ShellSession::~ShellSession() {
+    if (child_.pid > 0) {
+        kill(-child_.pid, SIGKILL);
+        CommandExecutor::wait(child_);
+    } else if (child_.starting) {
+        // Never seen: the shell reads EOF once input_fd_ closes, and the spawner reaps it
+        close(child_.exit_fd);
+    }
+    close(input_fd_);
+    close(output_fd_);
+}
+
+int ShellSession::startFd() const {
+    return child_.starting ? child_.exit_fd : -1;
+}
+
+void ShellSession::finishStart() {
+    CommandExecutor::finishLaunch(child_);
+}
+
+// A command and the line that reports its end
+std::string ShellSession::script(const std::string& command) const {
+    // The marker goes in as two arguments: `set -v` echoes this script and `set -x` traces the
+    // printf with its arguments apart, so only the status line itself holds the marker whole
+    size_t half = marker_.size() / 2;
+    return "command eval " + quote(command) + " </dev/null\n" +
+           "command printf '%s%s%d:%s\\n' " + quote(marker_.substr(0, half)) + " " +
+           quote(marker_.substr(half)) + " \"$?\" \"$PWD\"\n";
+}
+
+int ShellSession::input() const {
+    return input_fd_;
+}
+
+int ShellSession::duplicateOutput() const {
+    int fd = fcntl(output_fd_, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("Failed to duplicate shell output: ") + strerror(errno));
+    }
+    return fd;
+}
+
+// Split shell output at the status line
+bool ShellSession::collect(const char* data, size_t length, std::string& output) {
+    pending_.append(data, length);
+    
+    size_t found = pending_.find(marker_);
+    if (found != std::string::npos) {
+        output.append(pending_, 0, found);
+        pending_.erase(0, found);
+        size_t newline = pending_.find('\n');
+        if (newline == std::string::npos) {
+            return false;
+        }
+        
+        // <marker><status>:<directory>
+        std::string line = pending_.substr(marker_.size(), newline - marker_.size());
+        pending_.erase(0, newline + 1);
+        size_t colon = line.find(':');
+        status_ = std::atoi(line.substr(0, colon).c_str());
+        directory_ = colon == std::string::npos ? "" : line.substr(colon + 1);
+        return true;
+    }
+    
+    // Hold back a tail that could be the start of the marker
+    size_t keep = std::min(pending_.size(), marker_.size() - 1);
+    while (keep > 0 && pending_.compare(pending_.size() - keep, keep, marker_, 0, keep) != 0) {
+        keep--;
+    }
+    output.append(pending_, 0, pending_.size() - keep);
+    pending_.erase(0, pending_.size() - keep);
+    return false;
+}
+
+std::string ShellSession::drain() {
+    return std::exchange(pending_, std::string());
+}
+
+int ShellSession::status() const {
+    return status_;
+}
+
+const std::string& ShellSession::directory() const {
+    return directory_;
+}
+
+pid_t ShellSession::pid() const {
+    return child_.pid;
+}
+
+CommandExecutor::Child ShellSession::detach() {
+    return std::exchange(child_, CommandExecutor::Child());
+}
@@ -0,0 +1,501 @@
+#include "Spawner.h"
+#include "Colors.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+namespace {
+
+constexpr uint32_t HAS_INPUT = 1;
+constexpr uint32_t HAS_DIRECTORY = 2;
+constexpr uint32_t INHERIT_ENVIRONMENT = UINT32_MAX;
+constexpr size_t MAX_FDS = 4;              // Reply socket, output, stdin, directory
+
+// Request: this header, then path, argv and environment as NUL-terminated strings.
+// SCM_RIGHTS carries the reply socket, the output fd, then stdin and the directory if flagged
+struct RequestHeader {
+    uint32_t argc;
+    uint32_t envc;                         // INHERIT_ENVIRONMENT: the spawner's own
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t cpu_seconds;
+    uint64_t memory_bytes;
+    uint64_t open_files;
+};
+
+// Sent twice on the reply socket: value is 0 or the errno of a failed start, then the wait
+// status along with the command's resource usage
+struct Report {
+    int32_t pid;
+    int32_t value;
+    int64_t user_us;
+    int64_t system_us;
+    int64_t max_rss_kb;
+};
+
+int request_socket = -1;                   // Server side of the spawner's socket
+pid_t spawner_pid = 0;
+std::atomic<bool> started(false);
+std::atomic<bool> enabled(true);
+Spawner::Limits command_limits;
+
+// Stop using a spawner that has gone away, and reap it if this process started it
+void lose() {
+    if (started.exchange(false)) {
+        std::cerr << Color::ROSE << "Warning: Spawner exited, starting commands directly" << Color::RESET << std::endl;
+        waitpid(spawner_pid, nullptr, WNOHANG);
+    }
+}
+
+ssize_t receiveReport(int fd, Report& report) {
+    ssize_t count;
+    do {
+        count = recv(fd, &report, sizeof(report), 0);
+    } while (count < 0 && errno == EINTR);
+    return count;
+}
+
+void sendReport(int fd, pid_t pid, int value, const struct rusage* usage = nullptr) {
+    Report report = {};
+    report.pid = static_cast<int32_t>(pid);
+    report.value = static_cast<int32_t>(value);
+    if (usage) {
+        report.user_us = usage->ru_utime.tv_sec * 1000000LL + usage->ru_utime.tv_usec;
+        report.system_us = usage->ru_stime.tv_sec * 1000000LL + usage->ru_stime.tv_usec;
+        report.max_rss_kb = usage->ru_maxrss;
+    }
+    send(fd, &report, sizeof(report), MSG_NOSIGNAL);
+}
+
+bool applyLimit(int resource, uint64_t value) {
+    if (value == 0) {
+        return true;
+    }
+    struct rlimit limit;
+    limit.rlim_cur = value;
+    limit.rlim_max = value;
+    return setrlimit(resource, &limit) == 0;
+}
+
+// Child side of a start: set up the process and exec; reports errno on errors and never returns.
+// Only async-signal-safe calls, as the caller may have threads
+[[noreturn]] void runCommand(const Spawner::Limits& limits, const char* path, char* const argv[], char* const envp[],
+                             int output_fd, int input_fd, int dir_fd, int errors) {
+    setpgid(0, 0);
+    if (input_fd >= 0) {
+        dup2(input_fd, STDIN_FILENO);
+    }
+    dup2(output_fd, STDOUT_FILENO);
+    dup2(output_fd, STDERR_FILENO);
+
+    // A command that cannot be limited is not run
+    if ((dir_fd < 0 || fchdir(dir_fd) == 0) && applyLimit(RLIMIT_CPU, limits.cpu_seconds) &&
+        applyLimit(RLIMIT_AS, limits.memory_bytes) && applyLimit(RLIMIT_NOFILE, limits.open_files)) {
+        // The spawner ignores SIGINT and the server SIGPIPE; commands get defaults and no blocked signals
+        signal(SIGINT, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, nullptr);
+
+        execve(path, argv, envp ? envp : environ);
+    }
+
+    int error = errno;
+    ssize_t ignored = write(errors, &error, sizeof(error));
+    (void)ignored;
+    _exit(127);
+}
+
+// fork() and runCommand(); the pid once the exec succeeded, else 0 with error set
+pid_t forkCommand(const Spawner::Limits& limits, const char* path, char* const argv[], char* const envp[],
+                  int output_fd, int input_fd, int dir_fd, int& error) {
+    // Close-on-exec pipe: EOF means exec succeeded, an int is the errno it failed with
+    int errors[2];
+    if (pipe2(errors, O_CLOEXEC) < 0) {
+        error = errno;
+        return 0;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(errors[0]);
+        runCommand(limits, path, argv, envp, output_fd, input_fd, dir_fd, errors[1]);
+    }
+    error = pid < 0 ? errno : 0;
+    close(errors[1]);
+
+    if (pid > 0) {
+        int failure = 0;
+        ssize_t count;
+        do {
+            count = read(errors[0], &failure, sizeof(failure));
+        } while (count < 0 && errno == EINTR);
+        if (count == sizeof(failure)) {
+            waitpid(pid, nullptr, 0);
+            error = failure;
+            pid = 0;
+        }
+    } else {
+        pid = 0;
+    }
+    close(errors[0]);
+    return pid;
+}
+
+// Start the command of one request and answer on its reply socket (fds[0]); closes every fd
+// except a reply socket that waits for the exit status in children
+void startCommand(const char* data, size_t length, const std::vector<int>& fds,
+                  std::unordered_map<pid_t, int>& children) {
+    int reply = fds.empty() ? -1 : fds[0];
+    RequestHeader header;
+    size_t expected = 0;
+    if (length >= sizeof(header)) {
+        memcpy(&header, data, sizeof(header));
+        expected = 2 + ((header.flags & HAS_INPUT) ? 1 : 0) + ((header.flags & HAS_DIRECTORY) ? 1 : 0);
+    }
+
+    // path, argv and the environment, each string NUL-terminated within the message
+    std::vector<char*> strings;
+    const char* cursor = data + sizeof(header);
+    const char* end = data + length;
+    size_t needed = 0;
+    if (expected > 0) {
+        needed = 1 + static_cast<size_t>(header.argc) +
+                 (header.envc == INHERIT_ENVIRONMENT ? 0 : static_cast<size_t>(header.envc));
+    }
+    while (strings.size() < needed && cursor < end) {
+        const char* nul = static_cast<const char*>(memchr(cursor, '\0', end - cursor));
+        if (nul == nullptr) {
+            break;
+        }
+        strings.push_back(const_cast<char*>(cursor));
+        cursor = nul + 1;
+    }
+
+    bool valid = expected > 0 && fds.size() == expected && header.argc > 0 && strings.size() == needed;
+    pid_t pid = 0;
+    int error = EINVAL;
+    if (valid) {
+        int output_fd = fds[1];
+        int input_fd = (header.flags & HAS_INPUT) ? fds[2] : -1;
+        int dir_fd = (header.flags & HAS_DIRECTORY) ? fds.back() : -1;
+
+        std::vector<char*> argv(strings.begin() + 1, strings.begin() + 1 + header.argc);
+        argv.push_back(nullptr);
+        std::vector<char*> envp;
+        if (header.envc != INHERIT_ENVIRONMENT) {
+            envp.assign(strings.begin() + 1 + header.argc, strings.end());
+            envp.push_back(nullptr);
+        }
+
+        Spawner::Limits limits;
+        limits.cpu_seconds = header.cpu_seconds;
+        limits.memory_bytes = header.memory_bytes;
+        limits.open_files = header.open_files;
+        pid = forkCommand(limits, strings[0], argv.data(), envp.empty() ? nullptr : envp.data(),
+                          output_fd, input_fd, dir_fd, error);
+    }
+
+    if (reply >= 0) {
+        sendReport(reply, pid, error);
+    }
+    for (size_t i = 1; i < fds.size(); i++) {
+        close(fds[i]);
+    }
+    if (pid > 0) {
+        children[pid] = reply;
+    } else if (reply >= 0) {
+        close(reply);
+    }
+}
+
+} // namespace
+
+// Fork the spawner while the server is still one small thread
+bool Spawner::start() {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0) {
+        std::cerr << Color::ROSE << "Warning: Failed to create spawner socket: " << strerror(errno) << Color::RESET << std::endl;
+        return false;
+    }
+
+    // Room for the largest request (best effort: capped by wmem_max / rmem_max)
+    int buffer = static_cast<int>(MAX_REQUEST * 2);
+    setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+    setsockopt(pair[1], SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << Color::ROSE << "Warning: Failed to start spawner: " << strerror(errno) << Color::RESET << std::endl;
+        close(pair[0]);
+        close(pair[1]);
+        return false;
+    }
+    if (pid == 0) {
+        close(pair[0]);
+        serve(pair[1]);
+    }
+
+    close(pair[1]);
+    request_socket = pair[0];
+    spawner_pid = pid;
+    started = true;
+    std::cout << Color::GRAY << "Spawner started (PID: " << pid << ")" << Color::RESET << std::endl;
+    return true;
+}
+
+void Spawner::setLimits(const Limits& limits) {
+    command_limits = limits;
+}
+
+const Spawner::Limits& Spawner::limits() {
+    return command_limits;
+}
+
+// Fork and exec from the calling process with the limits set in between
+pid_t Spawner::startLimited(const char* path, char* const argv[], char* const envp[], int dir_fd, int input_fd,
+                            int output_fd) {
+    int error = 0;
+    pid_t pid = forkCommand(command_limits, path, argv, envp, output_fd, input_fd, dir_fd, error);
+    if (pid == 0) {
+        throw std::runtime_error(std::string("Failed to start command: ") + strerror(error));
+    }
+    return pid;
+}
+
+bool Spawner::running() {
+    return started && enabled;
+}
+
+void Spawner::setEnabled(bool enable) {
+    enabled = enable;
+}
+
+// Hand a command to the spawner and wait for its pid
+pid_t Spawner::launch(const char* path, char* const argv[], char* const envp[], int dir_fd, int input_fd,
+                      int output_fd, int& exit_fd) {
+    int reply = submit(path, argv, envp, dir_fd, input_fd, output_fd);
+    if (reply < 0) {
+        return 0;
+    }
+    pid_t pid = collect(reply);
+    if (pid > 0) {
+        exit_fd = reply;
+    }
+    return pid;
+}
+
+// Send a start request; the reply socket is the caller's to wait on
+int Spawner::submit(const char* path, char* const argv[], char* const envp[], int dir_fd, int input_fd,
+                    int output_fd) {
+    if (!running()) {
+        return -1;
+    }
+
+    RequestHeader header = {};
+    header.flags = (input_fd >= 0 ? HAS_INPUT : 0) | (dir_fd >= 0 ? HAS_DIRECTORY : 0);
+    header.cpu_seconds = command_limits.cpu_seconds;
+    header.memory_bytes = command_limits.memory_bytes;
+    header.open_files = command_limits.open_files;
+
+    std::string request(sizeof(header), '\0');
+    request.append(path).push_back('\0');
+    for (char* const* arg = argv; *arg; arg++) {
+        request.append(*arg).push_back('\0');
+        header.argc++;
+    }
+    header.envc = envp ? 0 : INHERIT_ENVIRONMENT;
+    for (char* const* var = envp; var && *var; var++) {
+        request.append(*var).push_back('\0');
+        header.envc++;
+    }
+    if (request.size() > MAX_REQUEST) {
+        return -1;
+    }
+    memcpy(request.data(), &header, sizeof(header));
+
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0) {
+        throw std::runtime_error(std::string("Failed to start command: ") + strerror(errno));
+    }
+
+    int fds[MAX_FDS] = {pair[1], output_fd};
+    size_t fd_count = 2;
+    if (input_fd >= 0) {
+        fds[fd_count++] = input_fd;
+    }
+    if (dir_fd >= 0) {
+        fds[fd_count++] = dir_fd;
+    }
+
+    union {
+        char buffer[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {request.data(), request.size()};
+    struct msghdr message = {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fd_count);
+
+    // One datagram per request, so server threads and processes can share the socket
+    ssize_t sent;
+    do {
+        sent = sendmsg(request_socket, &message, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    int error = errno;
+    close(pair[1]);
+
+    if (sent < 0) {
+        close(pair[0]);
+        if (error != EMSGSIZE) {
+            lose();
+        }
+        return -1;
+    }
+    return pair[0];
+}
+
+// The spawner's first answer on a reply socket: the pid, or the errno of a failed start
+pid_t Spawner::collect(int reply_fd) {
+    Report report;
+    if (receiveReport(reply_fd, report) != sizeof(report)) {
+        close(reply_fd);
+        lose();
+        return 0;
+    }
+    if (report.value != 0) {
+        close(reply_fd);
+        throw std::runtime_error(std::string("Failed to start command: ") + strerror(report.value));
+    }
+    return report.pid;
+}
+
+// Read the report the spawner sends once it has reaped the command
+bool Spawner::wait(int exit_fd, int& status, struct rusage& usage) {
+    Report report;
+    if (receiveReport(exit_fd, report) != sizeof(report)) {
+        return false;
+    }
+    status = report.value;
+    usage = {};
+    usage.ru_utime.tv_sec = report.user_us / 1000000;
+    usage.ru_utime.tv_usec = report.user_us % 1000000;
+    usage.ru_stime.tv_sec = report.system_us / 1000000;
+    usage.ru_stime.tv_usec = report.system_us % 1000000;
+    usage.ru_maxrss = report.max_rss_kb;
+    return true;
+}
+
+// Spawner body: a poll loop over the request socket and SIGCHLD
+void Spawner::serve(int socket) {
+    prctl(PR_SET_NAME, "spawner");
+
+    // Ctrl-C is for the server; the spawner leaves when the server closes the socket
+    signal(SIGINT, SIG_IGN);
+    sigset_t children_exited;
+    sigemptyset(&children_exited);
+    sigaddset(&children_exited, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &children_exited, nullptr);
+    int signals = signalfd(-1, &children_exited, SFD_CLOEXEC);
+    if (signals < 0) {
+        _exit(1);
+    }
+
+    std::unordered_map<pid_t, int> children;  // Running command -> reply socket
+    std::vector<char> buffer(MAX_REQUEST);
+    for (;;) {
+        struct pollfd fds[2] = {{socket, POLLIN, 0}, {signals, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            _exit(1);
+        }
+
+        // Report and forget every command that has exited
+        if (fds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            ssize_t ignored = read(signals, &info, sizeof(info));
+            (void)ignored;
+            int status;
+            struct rusage usage;
+            pid_t pid;
+            while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+                auto it = children.find(pid);
+                if (it != children.end()) {
+                    sendReport(it->second, pid, status, &usage);
+                    close(it->second);
+                    children.erase(it);
+                }
+            }
+        }
+
+        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            union {
+                char buffer[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+                struct cmsghdr align;
+            } control;
+            struct iovec iov = {buffer.data(), buffer.size()};
+            struct msghdr message = {};
+            message.msg_iov = &iov;
+            message.msg_iovlen = 1;
+            message.msg_control = control.buffer;
+            message.msg_controllen = sizeof(control.buffer);
+
+            ssize_t count = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                break;  // Every server process is gone
+            }
+
+            std::vector<int> received;
+            for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+                if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                    size_t count_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                    for (size_t i = 0; i < count_fds; i++) {
+                        int fd;
+                        memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                        received.push_back(fd);
+                    }
+                }
+            }
+            if (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+                if (!received.empty()) {
+                    sendReport(received[0], 0, E2BIG);
+                }
+                for (int fd : received) {
+                    close(fd);
+                }
+                continue;
+            }
+            startCommand(buffer.data(), static_cast<size_t>(count), received, children);
+        }
+    }
+    _exit(0);
+}
@@ -0,0 +1,60 @@
+#include "ThreadPool.h"
+#include <iostream>
+
+ThreadPool::ThreadPool(size_t thread_count) : stopping_(false) {
+    if (thread_count == 0) {
+        thread_count = 1;
+    }
+    for (size_t i = 0; i < thread_count; i++) {
+        threads_.emplace_back(&ThreadPool::workerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+
+    for (std::thread& thread : threads_) {
+        thread.join();
+    }
+}
+
+// Queue a task
+void ThreadPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(task));
+    }
+    cv_.notify_one();
+}
+
+size_t ThreadPool::size() const {
+    return threads_.size();
+}
+
+// Run tasks until the pool is stopped and the queue is empty
+void ThreadPool::workerLoop() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+
+            if (tasks_.empty()) {
+                return;  // Stopping and nothing left to do
+            }
+
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+
+        try {
+            task();
+        } catch (const std::exception& e) {
+            std::cerr << "Error in pool thread: " << e.what() << std::endl;
+        }
+    }
+}
@@ -1,4 +1,5 @@
 #include "Auth.h"
+#include "Config.h"
 #include <iostream>
 #include <string>
 
@@ -18,8 +19,12 @@ int main(int argc, char* argv[]) {
     std::string password = argv[2];
 
     try {
-        // Create Auth instance
+        // Create Auth instance, hashing at the server's configured cost
         Auth auth("data/users.txt");
+        Config config;
+        if (config.load()) {
+            auth.setKdfIterations(config.getInt("kdf_iterations", Auth::DEFAULT_KDF_ITERATIONS));
+        }
 
         // Add user
         if (auth.addUser(username, password)) {
@@ -1,12 +1,19 @@
 #include "Server.h"
+#include "Spawner.h"
+#include "EventLoop.h"
+#include "IoUring.h"
 #include "Config.h"
 #include "SetupWizard.h"
 #include "CLIUtils.h"
 #include "Colors.h"
+#include <algorithm>
 #include <iostream>
 #include <cstdlib>
 #include <csignal>
 #include <unistd.h>
+#include <sched.h>
+#include <sstream>
+#include <vector>
 
 // ASCII Banner (minimal)
 void printBanner() {
@@ -22,6 +29,33 @@ void printBanner() {
     std::cout << Color::DIM << "                    Easy Remote Shell Server v1.1.0" << Color::RESET << "\n\n";
 }
 
+// Parse a comma-separated port list ("8080,8081")
+std::vector<int> parsePorts(const std::string& list) {
+    std::vector<int> ports;
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        int port = std::atoi(item.c_str());
+        if (port > 0) {
+            ports.push_back(port);
+        }
+    }
+    return ports;
+}
+
+// Parse a shard count; "auto" means one shard per usable CPU
+int parseShards(const std::string& value) {
+    if (value == "auto") {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            return CPU_COUNT(&allowed);
+        }
+        return static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    return std::atoi(value.c_str());
+}
+
 // Global server 
 Server* g_server = nullptr;
 
@@ -42,8 +76,18 @@ int main(int argc, char* argv[]) {
         // Check for command-line flags
         bool reconfigure = false;
         int port_override = -1;
+        std::vector<int> ports_override;
+        std::string bind_override;
+        int shards_override = -1;
         bool fork_override = false;
         bool command_override = false;
+        int prefork_override = -1;
+        int max_sessions_override = -1;
+        int threads_override = -1;
+        int compress_override = -1;
+        bool shell_override = false;
+        bool no_spawner = false;
+        std::string backend_override;
         bool has_overrides = false;
         
         for (int i = 1; i < argc; i++) {
@@ -53,21 +97,71 @@ int main(int argc, char* argv[]) {
                 reconfigure = true;
             } else if (arg == "-p" || arg == "--port") {
                 if (i + 1 < argc) {
-                    port_override = std::atoi(argv[++i]);
+                    ports_override = parsePorts(argv[++i]);
+                    if (!ports_override.empty()) {
+                        port_override = ports_override.front();
+                    }
+                    has_overrides = true;
+                }
+            } else if (arg == "-b" || arg == "--bind") {
+                if (i + 1 < argc) {
+                    bind_override = argv[++i];
+                }
+            } else if (arg == "--shards") {
+                if (i + 1 < argc) {
+                    shards_override = parseShards(argv[++i]);
                     has_overrides = true;
                 }
             } else if (arg == "-f" || arg == "--fork") {
                 fork_override = true;
                 has_overrides = true;
+            } else if (arg == "--prefork") {
+                if (i + 1 < argc) {
+                    prefork_override = std::atoi(argv[++i]);
+                    has_overrides = true;
+                }
+            } else if (arg == "-t" || arg == "--threads") {
+                if (i + 1 < argc) {
+                    threads_override = std::atoi(argv[++i]);
+                    has_overrides = true;
+                }
+            } else if (arg == "--io-backend") {
+                if (i + 1 < argc) {
+                    backend_override = argv[++i];
+                }
+            } else if (arg == "--io-uring") {
+                backend_override = "io_uring";
+            } else if (arg == "--max-sessions") {
+                if (i + 1 < argc) {
+                    max_sessions_override = std::atoi(argv[++i]);
+                }
+            } else if (arg == "--compress") {
+                if (i + 1 < argc) {
+                    compress_override = std::atoi(argv[++i]);
+                }
+            } else if (arg == "--no-spawner") {
+                no_spawner = true;
+            } else if (arg == "--shell") {
+                shell_override = true;
             } else if (arg == "-c" || arg == "--command") {
                 command_override = true;
                 has_overrides = true;
             } else if (arg == "-h" || arg == "--help") {
                 std::cout << "Usage: " << argv[0] << " [options]\n"
                           << "Options:\n"
-                          << "  -p, --port PORT      Port to listen on\n"
+                          << "  -p, --port PORTS     Port(s) to listen on (comma-separated)\n"
+                          << "  -b, --bind ADDR      Address to bind (default: 0.0.0.0)\n"
+                          << "  --shards N|auto      One SO_REUSEPORT listener and pinned event loop per shard\n"
                           << "  -f, --fork           Enable multi-client support with fork\n"
+                          << "  --prefork N          Serve clients from a pool of N pre-forked workers\n"
+                          << "  --max-sessions N     Recycle a pool worker after N sessions\n"
+                          << "  -t, --threads N      Run session commands on a pool of N threads\n"
+                          << "  --io-backend NAME    Event loop backend: epoll (default) or io_uring\n"
+                          << "  --io-uring           Same as --io-backend io_uring\n"
+                          << "  --compress LEVEL     zlib level (1-9) for output to clients that accept it, 0 = off\n"
                           << "  -c, --command        Enable command execution mode\n"
+                          << "  --shell              Run each session's commands in one persistent shell\n"
+                          << "  --no-spawner         Start commands from the server instead of the spawner process\n"
                           << "  --reconfigure        Re-run setup wizard\n"
                           << "  -h, --help           Show this help message\n";
                 return 0;
@@ -104,14 +198,52 @@ int main(int argc, char* argv[]) {
         
         // Get configuration values (command-line overrides config file)
         int port = port_override > 0 ? port_override : config.getInt("port", 8080);
+        std::vector<int> ports = !ports_override.empty() ? ports_override : parsePorts(config.get("ports", std::to_string(port)));
+        if (ports.empty()) {
+            ports.push_back(port);
+        }
+        std::string bind_address = !bind_override.empty() ? bind_override : config.get("bind_address", "0.0.0.0");
+        int shards = shards_override >= 0 ? shards_override : (has_overrides ? 0 : parseShards(config.get("shards", "0")));
         bool use_fork = fork_override || (!has_overrides && config.getBool("use_fork", false));
+        int prefork_workers = prefork_override >= 0 ? prefork_override : (has_overrides ? 0 : config.getInt("prefork_workers", 0));
+        int max_sessions = max_sessions_override >= 0 ? max_sessions_override : config.getInt("max_sessions_per_worker", 0);
+        int session_threads = threads_override >= 0 ? threads_override : (has_overrides ? 0 : config.getInt("session_threads", 0));
         bool command_mode = command_override || (!has_overrides && config.getBool("command_mode", false));
+        bool persistent_shell = shell_override || config.getBool("persistent_shell", false);
+        int compression_level = compress_override >= 0 ? compress_override : config.getInt("compression_level", 0);
+        int kdf_iterations = config.getInt("kdf_iterations", Auth::DEFAULT_KDF_ITERATIONS);
+        int auth_threads = config.getInt("auth_threads", 2);
+        int auth_cache_seconds = config.getInt("auth_cache_seconds", Auth::DEFAULT_CACHE_SECONDS);
+        std::string io_backend = !backend_override.empty() ? backend_override : config.get("io_backend", "epoll");
+        
+        // io_uring needs multishot accept/recv and provided buffers; fall back to epoll otherwise
+        if (io_backend == "io_uring" || io_backend == "uring") {
+            if (IoUring::isSupported()) {
+                EventLoop::setPreferredBackend(EventLoop::Backend::IoUring);
+            } else {
+                std::cerr << Color::ROSE << "Warning: io_uring is not supported by this kernel, using epoll" << Color::RESET << std::endl;
+            }
+        } else if (io_backend != "epoll") {
+            std::cerr << Color::ROSE << "Warning: Unknown I/O backend '" << io_backend << "', using epoll" << Color::RESET << std::endl;
+        }
+        
+        // Command limits: the spawner sets them, and so does launch() when it forks a command itself
+        Spawner::Limits limits;
+        limits.cpu_seconds = static_cast<rlim_t>(std::max(0, config.getInt("command_cpu_seconds", 0)));
+        limits.memory_bytes = static_cast<rlim_t>(std::max(0, config.getInt("command_memory_mb", 0))) * 1024 * 1024;
+        limits.open_files = static_cast<rlim_t>(std::max(0, config.getInt("command_max_files", 0)));
+        Spawner::setLimits(limits);
+        
+        // The spawner forks before anything else exists: no threads, sockets or session table
+        if (!no_spawner && config.getBool("spawner", true)) {
+            Spawner::start();
+        }
         
         // Restart loop
         bool should_restart = true;
         while (should_restart) {
             // Create server
-            Server server(port);
+            Server server(ports.front());
             g_server = &server;
             
             // Register signal handlers
@@ -120,6 +252,13 @@ int main(int argc, char* argv[]) {
             
             // Configure server
             server.setUseFork(use_fork);
+            server.setPrefork(prefork_workers, max_sessions);
+            server.setSessionThreads(session_threads);
+            server.setShards(shards);
+            server.setListenAddress(bind_address, ports);
+            server.setAuthOptions(kdf_iterations, auth_threads, auth_cache_seconds);
+            server.setCompressionLevel(compression_level);
+            server.setPersistentShell(persistent_shell);
             server.setCommandMode(command_mode);
             
             // Start and run server
@@ -0,0 +1,99 @@
+#include "Compression.h"
+#include "Protocol.h"
+#include <stdexcept>
+#include <zlib.h>
+
+namespace Compression {
+
+constexpr size_t LENGTH_SIZE = 4;
+
+bool compress(std::string_view input, std::string& out, int level) {
+    if (input.size() < MIN_INPUT || input.size() > Protocol::MAX_PAYLOAD) {
+        return false;
+    }
+
+    // Anything at or above the input size is a loss, so give zlib no more room than that
+    size_t offset = out.size();
+    uLongf packed = static_cast<uLongf>(input.size() - LENGTH_SIZE - 1);
+    out.resize(offset + LENGTH_SIZE + packed);
+
+    char* dest = &out[offset];
+    uint32_t length = static_cast<uint32_t>(input.size());
+    dest[0] = static_cast<char>(length >> 24);
+    dest[1] = static_cast<char>((length >> 16) & 0xFF);
+    dest[2] = static_cast<char>((length >> 8) & 0xFF);
+    dest[3] = static_cast<char>(length & 0xFF);
+
+    int result = compress2(reinterpret_cast<Bytef*>(dest + LENGTH_SIZE), &packed,
+                           reinterpret_cast<const Bytef*>(input.data()), static_cast<uLong>(input.size()), level);
+    if (result != Z_OK) {
+        out.resize(offset);   // Z_BUF_ERROR: it did not shrink
+        return false;
+    }
+    out.resize(offset + LENGTH_SIZE + packed);
+    return true;
+}
+
+std::string decompress(std::string_view input) {
+    if (input.size() < LENGTH_SIZE) {
+        throw std::runtime_error("Compressed payload too short");
+    }
+
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(input.data());
+    uint32_t length = (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+                      (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+    if (length > Protocol::MAX_PAYLOAD) {
+        throw std::runtime_error("Compressed payload too large (" + std::to_string(length) + " bytes)");
+    }
+
+    std::string output(length, '\0');
+    uLongf produced = length;
+    int result = uncompress(reinterpret_cast<Bytef*>(output.data()), &produced,
+                            p + LENGTH_SIZE, static_cast<uLong>(input.size() - LENGTH_SIZE));
+    if (result != Z_OK || produced != length) {
+        throw std::runtime_error("Corrupt compressed payload");
+    }
+    return output;
+}
+
+GzipStream::GzipStream(int level) : stream_(new z_stream()) {
+    // 15 window bits plus 16 selects the gzip wrapper
+    z_stream* stream = static_cast<z_stream*>(stream_);
+    if (deflateInit2(stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        delete stream;
+        throw std::runtime_error("Cannot start gzip stream");
+    }
+}
+
+GzipStream::~GzipStream() {
+    z_stream* stream = static_cast<z_stream*>(stream_);
+    deflateEnd(stream);
+    delete stream;
+}
+
+static void deflateInto(z_stream* stream, std::string_view input, std::string& out, int flush) {
+    stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(input.data()));
+    stream->avail_in = static_cast<uInt>(input.size());
+    int result;
+    do {
+        size_t offset = out.size();
+        size_t room = deflateBound(stream, stream->avail_in) + 64;
+        out.resize(offset + room);
+        stream->next_out = reinterpret_cast<Bytef*>(&out[offset]);
+        stream->avail_out = static_cast<uInt>(room);
+        result = deflate(stream, flush);
+        out.resize(offset + room - stream->avail_out);
+    } while (result == Z_OK && (stream->avail_in > 0 || flush == Z_FINISH));
+}
+
+void GzipStream::write(std::string_view input, std::string& out) {
+    if (!input.empty()) {
+        deflateInto(static_cast<z_stream*>(stream_), input, out, Z_NO_FLUSH);
+    }
+}
+
+void GzipStream::finish(std::string& out) {
+    deflateInto(static_cast<z_stream*>(stream_), std::string_view(), out, Z_FINISH);
+}
+
+} // namespace Compression
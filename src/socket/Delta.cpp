@@ -0,0 +1,388 @@
+#include "Delta.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <openssl/evp.h>
+#include <unistd.h>
+
+namespace Delta {
+
+constexpr size_t COPY_BUFFER_SIZE = 1024 * 1024;
+constexpr unsigned FILTER_BITS = 20;   // Bitmap that turns away most rolling checksums without a lookup
+
+static void putUint32(std::string& out, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        out += static_cast<char>((value >> shift) & 0xFF);
+    }
+}
+
+static void putUint64(std::string& out, uint64_t value) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        out += static_cast<char>((value >> shift) & 0xFF);
+    }
+}
+
+static uint64_t getUint(const char* data, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        value = (value << 8) | static_cast<unsigned char>(data[i]);
+    }
+    return value;
+}
+
+static void strongChecksum(const char* data, size_t length, char* out) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length = 0;
+    if (EVP_Digest(data, length, digest, &digest_length, EVP_sha256(), nullptr) != 1) {
+        throw std::runtime_error("SHA-256 failed");
+    }
+    std::memcpy(out, digest, STRONG_SIZE);
+}
+
+static size_t filterIndex(uint32_t weak) {
+    return static_cast<size_t>((weak * 0x9E3779B1u) >> (32 - FILTER_BITS));
+}
+
+static bool readAll(int fd, char* data, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t count = pread(fd, data, length, static_cast<off_t>(offset));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            if (count == 0) {
+                errno = EIO;
+            }
+            return false;
+        }
+        data += count;
+        length -= static_cast<size_t>(count);
+        offset += static_cast<uint64_t>(count);
+    }
+    return true;
+}
+
+static bool writeAll(int fd, const char* data, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t count = pwrite(fd, data, length, static_cast<off_t>(offset));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            if (count == 0) {
+                errno = ENOSPC;
+            }
+            return false;
+        }
+        data += count;
+        length -= static_cast<size_t>(count);
+        offset += static_cast<uint64_t>(count);
+    }
+    return true;
+}
+
+std::string Stats::describe() const {
+    auto format = [](double bytes) {
+        const char* units[] = {"B", "KB", "MB", "GB"};
+        size_t unit = 0;
+        while (bytes >= 1024 && unit < 3) {
+            bytes /= 1024;
+            unit++;
+        }
+        char text[32];
+        std::snprintf(text, sizeof(text), unit == 0 ? "%.0f %s" : "%.1f %s", bytes, units[unit]);
+        return std::string(text);
+    };
+    return format(static_cast<double>(matched + literal)) + ", " + format(static_cast<double>(literal)) + " sent";
+}
+
+size_t blockSize(uint64_t size) {
+    size_t root = static_cast<size_t>(std::sqrt(static_cast<double>(size)));
+    root = (root + 1023) & ~static_cast<size_t>(1023);
+    return std::clamp(root, MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+}
+
+// rsync's checksum: a is the byte sum, b the sum of running a values, both mod 2^16
+uint32_t weakChecksum(const char* data, size_t length) {
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for (size_t i = 0; i < length; i++) {
+        a += static_cast<unsigned char>(data[i]);
+        b += a;
+    }
+    return ((b & 0xFFFF) << 16) | (a & 0xFFFF);
+}
+
+std::string signature(int fd, uint64_t size, size_t block_size, size_t threads) {
+    uint64_t blocks = (size + block_size - 1) / block_size;
+    std::string result(static_cast<size_t>(blocks * ENTRY_SIZE), '\0');
+
+    // Each thread signs its own run of blocks into its own slice of result
+    auto sign = [&](uint64_t first, uint64_t last) {
+        std::vector<char> buffer(std::max(COPY_BUFFER_SIZE / block_size, static_cast<size_t>(1)) * block_size);
+        size_t per_read = buffer.size() / block_size;
+        for (uint64_t block = first; block < last; ) {
+            size_t count = static_cast<size_t>(std::min<uint64_t>(last - block, per_read));
+            uint64_t start = block * block_size;
+            size_t length = static_cast<size_t>(std::min<uint64_t>(size - start, count * block_size));
+            if (!readAll(fd, buffer.data(), length, start)) {
+                throw std::runtime_error(std::string("Read failed: ") + strerror(errno));
+            }
+            for (size_t i = 0; i < count; i++) {
+                const char* data = buffer.data() + i * block_size;
+                size_t block_length = std::min(block_size, length - i * block_size);
+                char* entry = &result[static_cast<size_t>((block + i) * ENTRY_SIZE)];
+                uint32_t weak = weakChecksum(data, block_length);
+                for (size_t byte = 0; byte < 4; byte++) {
+                    entry[byte] = static_cast<char>((weak >> (24 - 8 * byte)) & 0xFF);
+                }
+                strongChecksum(data, block_length, entry + 4);
+            }
+            block += count;
+        }
+    };
+
+    if (threads <= 1 || size < PARALLEL_SIGNATURE) {
+        sign(0, blocks);
+        return result;
+    }
+
+    std::vector<std::thread> workers;
+    std::vector<std::exception_ptr> errors(threads);
+    uint64_t per_thread = (blocks + threads - 1) / threads;
+    for (size_t i = 0; i < threads; i++) {
+        uint64_t first = std::min(blocks, i * per_thread);
+        uint64_t last = std::min(blocks, first + per_thread);
+        workers.emplace_back([&sign, &errors, i, first, last]() {
+            try {
+                sign(first, last);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    for (std::exception_ptr& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    return result;
+}
+
+void encode(const char* data, uint64_t size, size_t block_size, uint64_t base_size, const std::string& signature,
+            const std::function<void(const std::string&)>& emit, Stats& stats) {
+    // Whole blocks sorted by weak checksum, so all candidates for one checksum sit together. A
+    // short last block can only match the end of data, which is checked once at the end
+    uint64_t blocks = std::min<uint64_t>(signature.size() / ENTRY_SIZE, base_size / block_size);
+    size_t tail = static_cast<size_t>(base_size % block_size);
+    std::vector<std::pair<uint32_t, uint64_t>> index;
+    std::vector<bool> filter(static_cast<size_t>(1) << FILTER_BITS);
+    index.reserve(static_cast<size_t>(blocks));
+    for (uint64_t block = 0; block < blocks; block++) {
+        uint32_t weak = static_cast<uint32_t>(getUint(signature.data() + block * ENTRY_SIZE, 4));
+        index.emplace_back(weak, block);
+        filter[filterIndex(weak)] = true;
+    }
+    std::sort(index.begin(), index.end());
+
+    std::string out;
+    uint64_t literal_start = 0;
+    uint64_t run_first = 0;        // Matched blocks not yet written out, as one copy
+    uint64_t run_count = 0;
+
+    auto flush = [&]() {
+        if (out.size() >= MAX_LITERAL) {
+            emit(out);
+            out.clear();
+        }
+    };
+    auto flushRun = [&]() {
+        if (run_count > 0) {
+            out += 'C';
+            putUint64(out, run_first);
+            putUint32(out, static_cast<uint32_t>(run_count));
+            run_count = 0;
+            flush();
+        }
+    };
+    auto flushLiteral = [&](uint64_t end) {
+        while (literal_start < end) {
+            flushRun();
+            size_t length = static_cast<size_t>(std::min<uint64_t>(end - literal_start, MAX_LITERAL));
+            out += 'L';
+            putUint32(out, static_cast<uint32_t>(length));
+            out.append(data + literal_start, length);
+            stats.literal += length;
+            literal_start += length;
+            flush();
+        }
+    };
+    // Copy block for the length bytes at position; consecutive blocks extend one copy
+    auto copyBlock = [&](uint64_t position, uint64_t block, size_t length) {
+        flushLiteral(position);
+        if (run_count == 0 || run_first + run_count != block || run_count == UINT32_MAX) {
+            flushRun();
+            run_first = block;
+        }
+        run_count++;
+        stats.matched += length;
+        literal_start = position + length;
+    };
+
+    uint64_t position = 0;
+    uint32_t a = 0;
+    uint32_t b = 0;
+    auto reset = [&]() {
+        a = 0;
+        b = 0;
+        for (size_t i = 0; i < block_size; i++) {
+            a += static_cast<unsigned char>(data[position + i]);
+            b += a;
+        }
+    };
+
+    if (blocks > 0 && size >= block_size) {
+        reset();
+    }
+    while (blocks > 0 && position + block_size <= size) {
+        uint32_t weak = ((b & 0xFFFF) << 16) | (a & 0xFFFF);
+
+        // Most positions fail the filter; a hit is confirmed with the strong checksum, preferring
+        // the block after the last match so runs of unchanged blocks become one copy
+        uint64_t match = UINT64_MAX;
+        if (filter[filterIndex(weak)]) {
+            auto range = std::equal_range(index.begin(), index.end(), std::make_pair(weak, uint64_t(0)),
+                                          [](const auto& x, const auto& y) { return x.first < y.first; });
+            if (range.first != range.second) {
+                char strong[STRONG_SIZE];
+                strongChecksum(data + position, block_size, strong);
+                uint64_t next = run_count > 0 ? run_first + run_count : UINT64_MAX;
+                for (auto it = range.first; it != range.second; ++it) {
+                    if (std::memcmp(signature.data() + it->second * ENTRY_SIZE + 4, strong, STRONG_SIZE) == 0) {
+                        if (match == UINT64_MAX || it->second == next) {
+                            match = it->second;
+                        }
+                        if (match == next) {
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        if (match != UINT64_MAX) {
+            copyBlock(position, match, block_size);
+            position += block_size;
+            if (position + block_size <= size) {
+                reset();
+            }
+            continue;
+        }
+
+        if (position + block_size == size) {
+            break;
+        }
+        uint32_t gone = static_cast<unsigned char>(data[position]);
+        a += static_cast<unsigned char>(data[position + block_size]) - gone;
+        b += a - static_cast<uint32_t>(block_size) * gone;
+        position++;
+        if (position - literal_start >= MAX_LITERAL) {
+            flushLiteral(position);
+        }
+    }
+
+    // Files usually keep their ending, so try the old short block against the new file's last bytes
+    if (tail > 0 && size >= literal_start + tail && signature.size() >= (blocks + 1) * ENTRY_SIZE) {
+        const char* entry = signature.data() + blocks * ENTRY_SIZE;
+        const char* end = data + size - tail;
+        char strong[STRONG_SIZE];
+        if (weakChecksum(end, tail) == static_cast<uint32_t>(getUint(entry, 4))) {
+            strongChecksum(end, tail, strong);
+            if (std::memcmp(entry + 4, strong, STRONG_SIZE) == 0) {
+                copyBlock(size - tail, blocks, tail);
+            }
+        }
+    }
+
+    flushLiteral(size);
+    flushRun();
+    if (!out.empty()) {
+        emit(out);
+    }
+}
+
+bool apply(const std::string& instructions, int base_fd, size_t block_size, uint64_t base_size,
+           int out_fd, uint64_t& offset, uint64_t limit, FileTransfer::Sha256& hash, std::string& error) {
+    uint64_t blocks = (base_size + block_size - 1) / block_size;
+    std::vector<char> buffer;
+    size_t position = 0;
+    while (position < instructions.size()) {
+        char op = instructions[position];
+        if (op == 'C' && instructions.size() - position >= 13) {
+            uint64_t first = getUint(instructions.data() + position + 1, 8);
+            uint64_t count = getUint(instructions.data() + position + 9, 4);
+            position += 13;
+            if (count > blocks || first > blocks - count) {
+                error = "Delta refers to a block past the end of the file";
+                return false;
+            }
+            uint64_t source = first * block_size;
+            uint64_t end = std::min(source + count * block_size, base_size);
+            if (end - source > limit - offset) {
+                error = "More data than announced";
+                return false;
+            }
+
+            // Old blocks pass through a buffer, since the new file is hashed as it is written
+            buffer.resize(std::max(COPY_BUFFER_SIZE, block_size));
+            while (source < end) {
+                size_t length = static_cast<size_t>(std::min<uint64_t>(end - source, buffer.size()));
+                if (!readAll(base_fd, buffer.data(), length, source)) {
+                    error = std::string("Read failed: ") + strerror(errno);
+                    return false;
+                }
+                if (!writeAll(out_fd, buffer.data(), length, offset)) {
+                    error = std::string("Write failed: ") + strerror(errno);
+                    return false;
+                }
+                hash.update(buffer.data(), length);
+                source += length;
+                offset += length;
+            }
+        } else if (op == 'L' && instructions.size() - position >= 5) {
+            size_t length = static_cast<size_t>(getUint(instructions.data() + position + 1, 4));
+            position += 5;
+            if (length > instructions.size() - position) {
+                error = "Malformed delta";
+                return false;
+            }
+            if (length > limit - offset) {
+                error = "More data than announced";
+                return false;
+            }
+            if (!writeAll(out_fd, instructions.data() + position, length, offset)) {
+                error = std::string("Write failed: ") + strerror(errno);
+                return false;
+            }
+            hash.update(instructions.data() + position, length);
+            position += length;
+            offset += length;
+        } else {
+            error = "Malformed delta";
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace Delta
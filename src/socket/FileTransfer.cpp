@@ -0,0 +1,103 @@
+#include "FileTransfer.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include <openssl/evp.h>
+#include <unistd.h>
+
+namespace FileTransfer {
+
+constexpr size_t HASH_BUFFER_SIZE = 1024 * 1024;
+
+Sha256::Sha256() : context_(EVP_MD_CTX_new()) {
+    if (!context_ || EVP_DigestInit_ex(static_cast<EVP_MD_CTX*>(context_), EVP_sha256(), nullptr) != 1) {
+        EVP_MD_CTX_free(static_cast<EVP_MD_CTX*>(context_));
+        throw std::runtime_error("Cannot initialise SHA-256");
+    }
+}
+
+Sha256::~Sha256() {
+    EVP_MD_CTX_free(static_cast<EVP_MD_CTX*>(context_));
+}
+
+void Sha256::update(const void* data, size_t length) {
+    EVP_DigestUpdate(static_cast<EVP_MD_CTX*>(context_), data, length);
+}
+
+void Sha256::updateFromFile(int fd, uint64_t offset, uint64_t length) {
+    std::vector<unsigned char> buffer(HASH_BUFFER_SIZE);
+    uint64_t end = offset + length;
+    while (offset < end) {
+        size_t want = static_cast<size_t>(std::min<uint64_t>(end - offset, buffer.size()));
+        ssize_t count = pread(fd, buffer.data(), want, static_cast<off_t>(offset));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            throw std::runtime_error(count < 0 ? std::string("Read failed: ") + strerror(errno) : "File shrank while hashing");
+        }
+        update(buffer.data(), static_cast<size_t>(count));
+        offset += static_cast<uint64_t>(count);
+    }
+}
+
+std::string Sha256::finish() {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length = 0;
+    EVP_DigestFinal_ex(static_cast<EVP_MD_CTX*>(context_), digest, &digest_length);
+
+    static const char hex[] = "0123456789abcdef";
+    std::string result;
+    result.reserve(digest_length * 2);
+    for (unsigned int i = 0; i < digest_length; i++) {
+        result += hex[digest[i] >> 4];
+        result += hex[digest[i] & 0x0F];
+    }
+    return result;
+}
+
+std::string sha256(int fd, uint64_t offset, uint64_t length) {
+    Sha256 hash;
+    hash.updateFromFile(fd, offset, length);
+    return hash.finish();
+}
+
+bool parseRequest(const std::string& payload, size_t count, uint64_t* numbers, std::string& path) {
+    size_t position = 0;
+    for (size_t field = 0; field < count; field++) {
+        size_t space = payload.find(' ', position);
+        if (space == std::string::npos || space == position) {
+            return false;
+        }
+        for (size_t i = position; i < space; i++) {
+            if (payload[i] < '0' || payload[i] > '9') {
+                return false;
+            }
+        }
+        errno = 0;
+        numbers[field] = std::strtoull(payload.c_str() + position, nullptr, 10);
+        if (errno == ERANGE) {
+            return false;
+        }
+        position = space + 1;
+    }
+    if (position >= payload.size()) {
+        return false;
+    }
+    path = payload.substr(position);
+    return true;
+}
+
+std::string formatRequest(std::initializer_list<uint64_t> numbers, const std::string& path) {
+    std::string payload;
+    for (uint64_t number : numbers) {
+        payload += std::to_string(number);
+        payload += ' ';
+    }
+    return payload + path;
+}
+
+} // namespace FileTransfer
@@ -0,0 +1,134 @@
+#include "Protocol.h"
+#include <stdexcept>
+#include <string>
+
+namespace Protocol {
+
+static uint16_t getUint16(const unsigned char* p) {
+    return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+static uint32_t getUint32(const unsigned char* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+           (static_cast<uint32_t>(p[2]) << 8) | static_cast<uint32_t>(p[3]);
+}
+
+static void writeUint16(char* dest, uint16_t value) {
+    dest[0] = static_cast<char>(value >> 8);
+    dest[1] = static_cast<char>(value & 0xFF);
+}
+
+static void writeUint32(char* dest, uint32_t value) {
+    dest[0] = static_cast<char>(value >> 24);
+    dest[1] = static_cast<char>((value >> 16) & 0xFF);
+    dest[2] = static_cast<char>((value >> 8) & 0xFF);
+    dest[3] = static_cast<char>(value & 0xFF);
+}
+
+void encodeHeader(char* dest, FrameType type, uint32_t request_id, uint32_t length, uint16_t flags) {
+    if (length > MAX_PAYLOAD) {
+        throw std::runtime_error("Frame payload too large");
+    }
+
+    dest[0] = static_cast<char>(PROTOCOL_VERSION);
+    dest[1] = static_cast<char>(type);
+    writeUint16(dest + 2, flags);
+    writeUint32(dest + 4, request_id);
+    writeUint32(dest + 8, length);
+}
+
+// Encode header + payload onto the end of out
+void appendFrame(std::string& out, FrameType type, uint32_t request_id,
+                 std::string_view payload, uint16_t flags) {
+    if (payload.size() > MAX_PAYLOAD) {
+        throw std::runtime_error("Frame payload too large");
+    }
+
+    size_t offset = out.size();
+    out.reserve(offset + HEADER_SIZE + payload.size());
+    out.resize(offset + HEADER_SIZE);
+    encodeHeader(&out[offset], type, request_id, static_cast<uint32_t>(payload.size()), flags);
+    out.append(payload);
+}
+
+std::string encodeFrame(FrameType type, uint32_t request_id, std::string_view payload, uint16_t flags) {
+    std::string out;
+    appendFrame(out, type, request_id, payload, flags);
+    return out;
+}
+
+const char* typeName(FrameType type) {
+    switch (type) {
+        case FrameType::Hello:      return "HELLO";
+        case FrameType::Auth:       return "AUTH";
+        case FrameType::AuthOk:     return "AUTH_OK";
+        case FrameType::AuthFailed: return "AUTH_FAILED";
+        case FrameType::Command:    return "COMMAND";
+        case FrameType::Output:     return "OUTPUT";
+        case FrameType::Error:      return "ERROR";
+        case FrameType::Exit:       return "EXIT";
+        case FrameType::Window:     return "WINDOW";
+        case FrameType::Cancel:     return "CANCEL";
+        case FrameType::Get:        return "GET";
+        case FrameType::Put:        return "PUT";
+        case FrameType::File:       return "FILE";
+        case FrameType::Data:       return "DATA";
+        case FrameType::Digest:     return "DIGEST";
+        case FrameType::Sync:       return "SYNC";
+        case FrameType::Archive:    return "ARCHIVE";
+        case FrameType::Resume:     return "RESUME";
+    }
+    return "UNKNOWN";
+}
+
+FrameParser::FrameParser() : offset_(0) {}
+
+void FrameParser::feed(const char* data, size_t length) {
+    buffer_.append(data, length);
+}
+
+std::string& FrameParser::buffer() {
+    return buffer_;
+}
+
+// Decode one frame if the buffer holds all of it
+bool FrameParser::next(Frame& frame) {
+    if (buffer_.size() - offset_ < HEADER_SIZE) {
+        return false;
+    }
+
+    const unsigned char* header = reinterpret_cast<const unsigned char*>(buffer_.data() + offset_);
+    if (header[0] != PROTOCOL_VERSION) {
+        throw std::runtime_error("Unsupported protocol version " + std::to_string(header[0]));
+    }
+
+    uint32_t length = getUint32(header + 8);
+    if (length > MAX_PAYLOAD) {
+        throw std::runtime_error("Frame payload too large (" + std::to_string(length) + " bytes)");
+    }
+    if (buffer_.size() - offset_ < HEADER_SIZE + length) {
+        return false;
+    }
+
+    frame.type = static_cast<FrameType>(header[1]);
+    frame.flags = getUint16(header + 2);
+    frame.request_id = getUint32(header + 4);
+    frame.payload.assign(buffer_, offset_ + HEADER_SIZE, length);
+    offset_ += HEADER_SIZE + length;
+
+    // Compact once the consumed prefix dominates, so a batch of frames costs one move
+    if (offset_ == buffer_.size()) {
+        buffer_.clear();
+        offset_ = 0;
+    } else if (offset_ > buffer_.size() / 2) {
+        buffer_.erase(0, offset_);
+        offset_ = 0;
+    }
+    return true;
+}
+
+size_t FrameParser::pending() const {
+    return buffer_.size() - offset_;
+}
+
+} // namespace Protocol
@@ -1,7 +1,9 @@
 #include "Socket.h"
 #include <stdexcept>
 #include <cstring>
+#include <cerrno>
 #include <fcntl.h>
+#include <netinet/tcp.h>
 
 // Default constructor
 Socket::Socket() : fd_(-1) {}
@@ -63,6 +65,11 @@ void Socket::create() {
 
 // Bind to port
 void Socket::bind(int port) {
+    bind("0.0.0.0", port);
+}
+
+// Bind to address and port
+void Socket::bind(const std::string& address, int port) {
     if (!isValid()) {
         throw std::runtime_error("Cannot bind invalid socket");
     }
@@ -70,9 +77,12 @@ void Socket::bind(int port) {
     sockaddr_in addr;
     std::memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = INADDR_ANY;
     addr.sin_port = htons(port);
     
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) <= 0) {
+        throw std::runtime_error("Invalid bind address: " + address);
+    }
+    
     if (::bind(fd_, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         throw std::runtime_error(std::string("Failed to bind socket: ") + strerror(errno));
     }
@@ -99,6 +109,10 @@ Socket Socket::accept(sockaddr_in& client_addr) {
     int client_fd = ::accept(fd_, (struct sockaddr*)&client_addr, &addr_len);
     
     if (client_fd < 0) {
+        // Non-blocking listener with no pending connection
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return Socket();
+        }
         throw std::runtime_error(std::string("Failed to accept connection: ") + strerror(errno));
     }
     
@@ -134,6 +148,10 @@ ssize_t Socket::send(const void* buffer, size_t length, int flags) {
     
     ssize_t sent = ::send(fd_, buffer, length, flags);
     if (sent < 0) {
+        // Non-blocking socket with a full send buffer
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1;
+        }
         throw std::runtime_error(std::string("Failed to send: ") + strerror(errno));
     }
     
@@ -148,6 +166,10 @@ ssize_t Socket::recv(void* buffer, size_t length, int flags) {
     
     ssize_t received = ::recv(fd_, buffer, length, flags);
     if (received < 0) {
+        // Non-blocking socket with nothing to read yet
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1;
+        }
         throw std::runtime_error(std::string("Failed to receive: ") + strerror(errno));
     }
     
@@ -166,6 +188,30 @@ void Socket::setReuseAddr(bool reuse) {
     }
 }
 
+// Set SO_REUSEPORT option
+void Socket::setReusePort(bool reuse) {
+    if (!isValid()) {
+        throw std::runtime_error("Cannot set option on invalid socket");
+    }
+    
+    int opt = reuse ? 1 : 0;
+    if (setsockopt(fd_, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        throw std::runtime_error(std::string("Failed to set SO_REUSEPORT: ") + strerror(errno));
+    }
+}
+
+// Set TCP_NODELAY option (callers batch their own writes)
+void Socket::setNoDelay(bool nodelay) {
+    if (!isValid()) {
+        throw std::runtime_error("Cannot set option on invalid socket");
+    }
+    
+    int opt = nodelay ? 1 : 0;
+    if (setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) < 0) {
+        throw std::runtime_error(std::string("Failed to set TCP_NODELAY: ") + strerror(errno));
+    }
+}
+
 // Set non-blocking mode
 void Socket::setNonBlocking(bool nonblocking) {
     if (!isValid()) {